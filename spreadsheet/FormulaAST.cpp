@@ -4,8 +4,10 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -13,6 +15,7 @@
 namespace ASTImpl {
 
     enum ExprPrecedence {
+        EP_COMPARE,
         EP_ADD,
         EP_SUB,
         EP_MUL,
@@ -58,13 +61,18 @@ namespace ASTImpl {
     //     (currently in the table we're always putting in the parentheses)
     // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
     // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // A < (B + C) - always okay (comparison has the lowest grammatic precedence)
+    // A < (B < C) - never okay (comparisons are left-associative)
+    // A + (B < C), -(A < B) - never okay
+    // Function arguments are printed as top-level expressions (EP_ATOM parent).
     constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-        /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_COMPARE */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
     class Expr {
@@ -74,9 +82,49 @@ namespace ASTImpl {
         virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
         virtual double Evaluate(const SheetInterface& sheet) const = 0;
 
+        // Строит упрощённую копию выражения для вычисления: константные
+        // поддеревья свёрнуты, цепочки унарных операций сокращены, тождества
+        // вида X*1 убраны. Значение и ошибки копии совпадают с исходным
+        // выражением при любом содержимом ячеек. Если что-то упрощено,
+        // changed выставляется в true.
+        virtual std::unique_ptr<Expr> Simplify(bool& changed) const = 0;
+
+        // Значение выражения, если оно не зависит от ячеек и известно заранее
+        virtual std::optional<double> GetConstant() const {
+            return std::nullopt;
+        }
+
+        // Строит копию выражения, в которой операции заменены ссылками на
+        // общие подвыражения пула
+        virtual std::unique_ptr<Expr> Share(ExpressionPool& pool) const = 0;
+
+        // Дописывает к key ключ выражения в пуле. Для операции ключ состоит из
+        // её типа и ключей операндов; операнды уже в пуле, так что ключ короткий
+        virtual void AppendKey(std::string& key) const = 0;
+
+        // Дописывает к code инструкции, вычисляющие выражение для формулы в
+        // ячейке origin. Возвращает false, если выражение нельзя скомпилировать.
+        virtual bool Compile(std::vector<ColumnProgram::Instruction>& code, Position origin) const = 0;
+
+        // Копия выражения, в которой ссылки на ячейки сдвинуты на
+        // (row_shift, col_shift). Позиции ссылок копии добавляются в cells,
+        // ссылок на другие таблицы - в external_cells; ссылки, вышедшие за
+        // пределы таблицы, становятся некорректными (#REF!).
+        virtual std::unique_ptr<Expr> Clone(std::forward_list<Position>& cells,
+            std::forward_list<ExternalCell>& external_cells, int row_shift, int col_shift) const = 0;
+
+        // Память узлов выражения в байтах. Общие подвыражения принадлежат
+        // пулу и не учитываются: узел-ссылка считается только сам.
+        virtual size_t MemoryUsage() const = 0;
+
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
+        // Есть ли в выражении условные операции (см. FormulaAST::ReadsConditionally)
+        virtual bool ReadsConditionally() const {
+            return false;
+        }
+
         void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
             bool right_child = false) const {
             auto precedence = GetPrecedence();
@@ -95,7 +143,167 @@ namespace ASTImpl {
     };
     
 
+    template <typename T>
+    void AppendBytes(std::string& key, const T& value) {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    // Общее подвыражение в пуле. Значение кэшируется на ревизию таблицы.
+    struct PooledExpr {
+        PooledExpr(std::unique_ptr<Expr> expr, const ExpressionPool& pool)
+            : expr(std::move(expr))
+            , pool(pool) {
+        }
+
+        double Evaluate(const SheetInterface& sheet) const {
+            const uint64_t revision = pool.GetRevision();
+            if (value && computed_at == revision) {
+                SHEET_STATS(++pool.Stats().shared_expression_hits);
+            }
+            else {
+                try {
+                    value = expr->Evaluate(sheet);
+                }
+                catch (const FormulaError& error) {
+                    value = error;
+                }
+                computed_at = revision;
+            }
+
+            if (std::holds_alternative<FormulaError>(*value)) {
+                throw std::get<FormulaError>(*value);
+            }
+            return std::get<double>(*value);
+        }
+
+        std::unique_ptr<Expr> expr;
+        const ExpressionPool& pool;
+        mutable std::optional<std::variant<double, FormulaError>> value;
+        mutable uint64_t computed_at = 0;
+    };
+
     namespace {
+        // Ссылка формулы на общее подвыражение
+        class SharedExpr final : public Expr {
+        public:
+            explicit SharedExpr(std::shared_ptr<PooledExpr> node)
+                : node_(std::move(node)) {
+            }
+
+            void Print(std::ostream& out) const override {
+                node_->expr->Print(out);
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                node_->expr->DoPrintFormula(out, precedence);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return node_->expr->GetPrecedence();
+            }
+
+            bool ReadsConditionally() const override {
+                return node_->expr->ReadsConditionally();
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                // Подвыражение встречается лишь в одном месте: кэш ничего не даст
+                if (node_.use_count() == 1) {
+                    return node_->expr->Evaluate(sheet);
+                }
+                return node_->Evaluate(sheet);
+            }
+
+            std::unique_ptr<Expr> Simplify(bool& /* changed */) const override {
+                return std::make_unique<SharedExpr>(node_);
+            }
+
+            std::unique_ptr<Expr> Share(ExpressionPool& /* pool */) const override {
+                return std::make_unique<SharedExpr>(node_);
+            }
+
+            void AppendKey(std::string& key) const override {
+                key += 'p';
+                AppendBytes(key, node_.get());
+            }
+
+            bool Compile(std::vector<ColumnProgram::Instruction>& code, Position origin) const override {
+                return node_->expr->Compile(code, origin);
+            }
+
+            std::unique_ptr<Expr> Clone(std::forward_list<Position>& cells,
+                std::forward_list<ExternalCell>& external_cells, int row_shift, int col_shift) const override {
+                return node_->expr->Clone(cells, external_cells, row_shift, col_shift);
+            }
+
+            size_t MemoryUsage() const override {
+                return sizeof(*this);
+            }
+
+        private:
+            std::shared_ptr<PooledExpr> node_;
+        };
+
+        class NumberExpr final : public Expr {
+        public:
+            explicit NumberExpr(double value)
+                : value_(value) {
+            }
+
+            void Print(std::ostream& out) const override {
+                out << value_;
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                out << value_;
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                return value_;
+            }
+
+            std::unique_ptr<Expr> Simplify(bool& /* changed */) const override {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
+            std::optional<double> GetConstant() const override {
+                return value_;
+            }
+
+            std::unique_ptr<Expr> Share(ExpressionPool& /* pool */) const override {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
+            void AppendKey(std::string& key) const override {
+                key += 'n';
+                AppendBytes(key, value_);
+            }
+
+            bool Compile(std::vector<ColumnProgram::Instruction>& code, Position /* origin */) const override {
+                ColumnProgram::Instruction instruction{ ColumnProgram::OpCode::LoadNumber };
+                instruction.number = value_;
+                code.push_back(instruction);
+                return true;
+            }
+
+            std::unique_ptr<Expr> Clone(std::forward_list<Position>& /* cells */,
+                std::forward_list<ExternalCell>& /* external_cells */, int /* row_shift */,
+                int /* col_shift */) const override {
+                return std::make_unique<NumberExpr>(value_);
+            }
+
+            size_t MemoryUsage() const override {
+                return sizeof(*this);
+            }
+
+        private:
+            double value_;
+        };
+
         class BinaryOpExpr final : public Expr {
         public:
             enum Type : char {
@@ -143,17 +351,102 @@ namespace ASTImpl {
                 }
             }
 
+            bool ReadsConditionally() const override {
+                return lhs_->ReadsConditionally() || rhs_->ReadsConditionally();
+            }
+
             double Evaluate(const SheetInterface& sheet) const override {
                 double lhs = lhs_->Evaluate(sheet);
                 double rhs = rhs_->Evaluate(sheet);
+                return Apply(type_, lhs, rhs);
+            }
+
+            std::unique_ptr<Expr> Simplify(bool& changed) const override {
+                auto lhs = lhs_->Simplify(changed);
+                auto rhs = rhs_->Simplify(changed);
+                const std::optional<double> lhs_value = lhs->GetConstant();
+                const std::optional<double> rhs_value = rhs->GetConstant();
+
+                if (lhs_value && rhs_value) {
+                    // Ошибку (например, деление на ноль) не сворачиваем:
+                    // она возникнет при вычислении, как и без упрощения
+                    try {
+                        const double result = Apply(type_, *lhs_value, *rhs_value);
+                        changed = true;
+                        return std::make_unique<NumberExpr>(result);
+                    }
+                    catch (const FormulaError&) {
+                    }
+                }
+
+                // Убираются только константные операнды: выражение с ячейками
+                // вычисляется всегда, чтобы не потерять его ошибку. X+0 и 0+X
+                // не упрощаются: для X = -0 результат равен +0.
+                const bool is_one_on_right = rhs_value && *rhs_value == 1.0;
+                const bool is_positive_zero_on_right = rhs_value && *rhs_value == 0.0 && !std::signbit(*rhs_value);
+                if (((type_ == Multiply || type_ == Divide) && is_one_on_right)
+                    || (type_ == Subtract && is_positive_zero_on_right)) {
+                    changed = true;
+                    return lhs;
+                }
+                if (type_ == Multiply && lhs_value && *lhs_value == 1.0) {
+                    changed = true;
+                    return rhs;
+                }
+
+                return std::make_unique<BinaryOpExpr>(type_, std::move(lhs), std::move(rhs));
+            }
+
+            std::unique_ptr<Expr> Share(ExpressionPool& pool) const override {
+                return pool.Intern(std::make_unique<BinaryOpExpr>(type_, lhs_->Share(pool), rhs_->Share(pool)));
+            }
+
+            void AppendKey(std::string& key) const override {
+                key += static_cast<char>(type_);
+                lhs_->AppendKey(key);
+                rhs_->AppendKey(key);
+            }
 
+            bool Compile(std::vector<ColumnProgram::Instruction>& code, Position origin) const override {
+                if (!lhs_->Compile(code, origin) || !rhs_->Compile(code, origin)) {
+                    return false;
+                }
+                switch (type_) {
+                case Add:
+                    code.push_back({ ColumnProgram::OpCode::Add });
+                    break;
+                case Subtract:
+                    code.push_back({ ColumnProgram::OpCode::Subtract });
+                    break;
+                case Multiply:
+                    code.push_back({ ColumnProgram::OpCode::Multiply });
+                    break;
+                case Divide:
+                    code.push_back({ ColumnProgram::OpCode::Divide });
+                    break;
+                }
+                return true;
+            }
+
+            std::unique_ptr<Expr> Clone(std::forward_list<Position>& cells,
+                std::forward_list<ExternalCell>& external_cells, int row_shift, int col_shift) const override {
+                return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(cells, external_cells, row_shift, col_shift),
+                    rhs_->Clone(cells, external_cells, row_shift, col_shift));
+            }
+
+            size_t MemoryUsage() const override {
+                return sizeof(*this) + lhs_->MemoryUsage() + rhs_->MemoryUsage();
+            }
+
+        private:
+            static double Apply(Type type, double lhs, double rhs) {
                 if (!std::isfinite(lhs) || !std::isfinite(rhs)) {
                     throw FormulaError(FormulaError::Category::Arithmetic);
                 }
 
                 double result;
 
-                switch (type_) {
+                switch (type) {
                 case Add:      
                     result = lhs + rhs;
                     if (!std::isfinite(result)) {
@@ -186,7 +479,6 @@ namespace ASTImpl {
                 throw FormulaError(FormulaError::Category::Value); // fallback
             }
 
-        private:
             Type type_;
             std::unique_ptr<Expr> lhs_;
             std::unique_ptr<Expr> rhs_;
@@ -220,6 +512,10 @@ namespace ASTImpl {
                 return EP_UNARY;
             }
 
+            bool ReadsConditionally() const override {
+                return operand_->ReadsConditionally();
+            }
+
             double Evaluate(const SheetInterface& sheet) const override {
                 double val = operand_->Evaluate(sheet);
                 if (!std::isfinite(val)) {
@@ -228,17 +524,463 @@ namespace ASTImpl {
                 return (type_ == UnaryMinus ? -val : +val);
             }
 
+            std::unique_ptr<Expr> Simplify(bool& changed) const override {
+                auto operand = operand_->Simplify(changed);
+                // Значения ячеек всегда конечны, поэтому унарный плюс ничего не
+                // меняет, а двойное отрицание возвращает исходное значение
+                if (type_ == UnaryPlus) {
+                    changed = true;
+                    return operand;
+                }
+                if (const std::optional<double> value = operand->GetConstant()) {
+                    changed = true;
+                    return std::make_unique<NumberExpr>(-*value);
+                }
+                // Унарный плюс во вложенном выражении уже убран
+                if (auto* inner = dynamic_cast<UnaryOpExpr*>(operand.get())) {
+                    changed = true;
+                    return std::move(inner->operand_);
+                }
+                return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+            }
+
+            std::unique_ptr<Expr> Share(ExpressionPool& pool) const override {
+                return pool.Intern(std::make_unique<UnaryOpExpr>(type_, operand_->Share(pool)));
+            }
+
+            void AppendKey(std::string& key) const override {
+                // Префикс отличает унарную операцию от бинарной того же знака
+                key += 'u';
+                key += static_cast<char>(type_);
+                operand_->AppendKey(key);
+            }
+
+            bool Compile(std::vector<ColumnProgram::Instruction>& code, Position origin) const override {
+                if (!operand_->Compile(code, origin)) {
+                    return false;
+                }
+                if (type_ == UnaryMinus) {
+                    code.push_back({ ColumnProgram::OpCode::Negate });
+                }
+                return true;
+            }
+
+            std::unique_ptr<Expr> Clone(std::forward_list<Position>& cells,
+                std::forward_list<ExternalCell>& external_cells, int row_shift, int col_shift) const override {
+                return std::make_unique<UnaryOpExpr>(type_, operand_->Clone(cells, external_cells, row_shift, col_shift));
+            }
+
+            size_t MemoryUsage() const override {
+                return sizeof(*this) + operand_->MemoryUsage();
+            }
+
     private:
         Type type_;
         std::unique_ptr<Expr> operand_;
     };
 
+        // Сравнение чисел: 1, если оно истинно, иначе 0
+        class ComparisonExpr final : public Expr {
+        public:
+            enum Type : char {
+                Equal = '=',
+                NotEqual = '!',
+                Less = '<',
+                LessOrEqual = 'l',
+                Greater = '>',
+                GreaterOrEqual = 'g',
+            };
+
+        public:
+            explicit ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+                : type_(type)
+                , lhs_(std::move(lhs))
+                , rhs_(std::move(rhs)) {
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << GetSymbol(type_) << ' ';
+                lhs_->Print(out);
+                out << ' ';
+                rhs_->Print(out);
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+                lhs_->PrintFormula(out, precedence);
+                out << GetSymbol(type_);
+                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_COMPARE;
+            }
+
+            bool ReadsConditionally() const override {
+                return lhs_->ReadsConditionally() || rhs_->ReadsConditionally();
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                double lhs = lhs_->Evaluate(sheet);
+                double rhs = rhs_->Evaluate(sheet);
+                return Apply(type_, lhs, rhs);
+            }
+
+            std::unique_ptr<Expr> Simplify(bool& changed) const override {
+                auto lhs = lhs_->Simplify(changed);
+                auto rhs = rhs_->Simplify(changed);
+                const std::optional<double> lhs_value = lhs->GetConstant();
+                const std::optional<double> rhs_value = rhs->GetConstant();
+                if (lhs_value && rhs_value) {
+                    changed = true;
+                    return std::make_unique<NumberExpr>(Apply(type_, *lhs_value, *rhs_value));
+                }
+                return std::make_unique<ComparisonExpr>(type_, std::move(lhs), std::move(rhs));
+            }
+
+            std::unique_ptr<Expr> Share(ExpressionPool& pool) const override {
+                return pool.Intern(std::make_unique<ComparisonExpr>(type_, lhs_->Share(pool), rhs_->Share(pool)));
+            }
+
+            void AppendKey(std::string& key) const override {
+                // Префикс отличает сравнение от бинарной операции того же знака
+                key += 'r';
+                key += static_cast<char>(type_);
+                lhs_->AppendKey(key);
+                rhs_->AppendKey(key);
+            }
+
+            bool Compile(std::vector<ColumnProgram::Instruction>& code, Position origin) const override {
+                if (!lhs_->Compile(code, origin) || !rhs_->Compile(code, origin)) {
+                    return false;
+                }
+                switch (type_) {
+                case Equal:
+                    code.push_back({ ColumnProgram::OpCode::Equal });
+                    break;
+                case NotEqual:
+                    code.push_back({ ColumnProgram::OpCode::NotEqual });
+                    break;
+                case Less:
+                    code.push_back({ ColumnProgram::OpCode::Less });
+                    break;
+                case LessOrEqual:
+                    code.push_back({ ColumnProgram::OpCode::LessOrEqual });
+                    break;
+                case Greater:
+                    code.push_back({ ColumnProgram::OpCode::Greater });
+                    break;
+                case GreaterOrEqual:
+                    code.push_back({ ColumnProgram::OpCode::GreaterOrEqual });
+                    break;
+                }
+                return true;
+            }
+
+            std::unique_ptr<Expr> Clone(std::forward_list<Position>& cells,
+                std::forward_list<ExternalCell>& external_cells, int row_shift, int col_shift) const override {
+                return std::make_unique<ComparisonExpr>(type_, lhs_->Clone(cells, external_cells, row_shift, col_shift),
+                    rhs_->Clone(cells, external_cells, row_shift, col_shift));
+            }
+
+            size_t MemoryUsage() const override {
+                return sizeof(*this) + lhs_->MemoryUsage() + rhs_->MemoryUsage();
+            }
+
+        private:
+            static const char* GetSymbol(Type type) {
+                switch (type) {
+                case Equal:
+                    return "=";
+                case NotEqual:
+                    return "<>";
+                case Less:
+                    return "<";
+                case LessOrEqual:
+                    return "<=";
+                case Greater:
+                    return ">";
+                case GreaterOrEqual:
+                    return ">=";
+                }
+                assert(false);
+                return "";
+            }
+
+            static double Apply(Type type, double lhs, double rhs) {
+                bool result = false;
+                switch (type) {
+                case Equal:
+                    result = lhs == rhs;
+                    break;
+                case NotEqual:
+                    result = lhs != rhs;
+                    break;
+                case Less:
+                    result = lhs < rhs;
+                    break;
+                case LessOrEqual:
+                    result = lhs <= rhs;
+                    break;
+                case Greater:
+                    result = lhs > rhs;
+                    break;
+                case GreaterOrEqual:
+                    result = lhs >= rhs;
+                    break;
+                }
+                return result ? 1.0 : 0.0;
+            }
+
+            Type type_;
+            std::unique_ptr<Expr> lhs_;
+            std::unique_ptr<Expr> rhs_;
+        };
+
+        // Условные функции IF, AND, OR, IFERROR. Аргументы вычисляются слева
+        // направо и лишь пока результат не известен: IF вычисляет одну из
+        // ветвей, AND и OR останавливаются на первом решающем аргументе,
+        // IFERROR вычисляет запасное значение только при ошибке. Ячейки
+        // невычисленных аргументов не читаются, хотя остаются ссылками
+        // формулы. Истина - любое ненулевое число; AND и OR дают 1 или 0.
+        class ConditionalExpr final : public Expr {
+        public:
+            enum Type : char {
+                If = 'i',
+                And = '&',
+                Or = '|',
+                IfError = 'e',
+            };
+
+        public:
+            ConditionalExpr(Type type, std::vector<std::unique_ptr<Expr>> args)
+                : type_(type)
+                , args_(std::move(args)) {
+            }
+
+            static const char* GetName(Type type) {
+                switch (type) {
+                case If:
+                    return "IF";
+                case And:
+                    return "AND";
+                case Or:
+                    return "OR";
+                case IfError:
+                    return "IFERROR";
+                }
+                assert(false);
+                return "";
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << GetName(type_);
+                for (const auto& arg : args_) {
+                    out << ' ';
+                    arg->Print(out);
+                }
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+                out << GetName(type_) << '(';
+                bool first = true;
+                for (const auto& arg : args_) {
+                    if (!first) {
+                        out << ',';
+                    }
+                    first = false;
+                    arg->PrintFormula(out, EP_ATOM);
+                }
+                out << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            bool ReadsConditionally() const override {
+                return true;
+            }
+
+            double Evaluate(const SheetInterface& sheet) const override {
+                switch (type_) {
+                case If:
+                    if (args_[0]->Evaluate(sheet) != 0.0) {
+                        return args_[1]->Evaluate(sheet);
+                    }
+                    return args_.size() > 2 ? args_[2]->Evaluate(sheet) : 0.0;
+                case And:
+                    for (const auto& arg : args_) {
+                        if (arg->Evaluate(sheet) == 0.0) {
+                            return 0.0;
+                        }
+                    }
+                    return 1.0;
+                case Or:
+                    for (const auto& arg : args_) {
+                        if (arg->Evaluate(sheet) != 0.0) {
+                            return 1.0;
+                        }
+                    }
+                    return 0.0;
+                case IfError:
+                    // Перехватываются только ошибки формул: отложенное
+                    // вычисление ячейки (см. Cell) проходит дальше
+                    try {
+                        return args_[0]->Evaluate(sheet);
+                    }
+                    catch (const FormulaError&) {
+                        return args_[1]->Evaluate(sheet);
+                    }
+                }
+                throw FormulaError(FormulaError::Category::Value); // fallback
+            }
+
+            std::unique_ptr<Expr> Simplify(bool& changed) const override {
+                std::vector<std::unique_ptr<Expr>> args;
+                for (const auto& arg : args_) {
+                    args.push_back(arg->Simplify(changed));
+                }
+                const std::optional<double> first = args.front()->GetConstant();
+
+                // Константы не дают ошибок, поэтому известное условие IF
+                // выбирает ветвь заранее, а IFERROR от константы - она сама
+                if (type_ == If && first) {
+                    changed = true;
+                    if (*first != 0.0) {
+                        return std::move(args[1]);
+                    }
+                    return args.size() > 2 ? std::move(args[2]) : std::make_unique<NumberExpr>(0.0);
+                }
+                if (type_ == IfError && first) {
+                    changed = true;
+                    return std::move(args[0]);
+                }
+
+                if (type_ == And || type_ == Or) {
+                    // Константа, которая не решает результат, не нужна; решающая
+                    // отбрасывает аргументы после себя, а если перед ней нет
+                    // аргументов с ячейками - и весь вызов
+                    const double decisive_result = type_ == And ? 0.0 : 1.0;
+                    std::vector<std::unique_ptr<Expr>> kept;
+                    for (size_t i = 0; i < args.size(); ++i) {
+                        const std::optional<double> value = args[i]->GetConstant();
+                        if (!value) {
+                            kept.push_back(std::move(args[i]));
+                            continue;
+                        }
+                        changed = true;
+                        if ((*value != 0.0) == (type_ == And)) {
+                            continue;
+                        }
+                        if (kept.empty()) {
+                            return std::make_unique<NumberExpr>(decisive_result);
+                        }
+                        kept.push_back(std::make_unique<NumberExpr>(decisive_result));
+                        break;
+                    }
+                    if (kept.empty()) {
+                        return std::make_unique<NumberExpr>(1.0 - decisive_result);
+                    }
+                    args = std::move(kept);
+                }
+                return std::make_unique<ConditionalExpr>(type_, std::move(args));
+            }
+
+            std::unique_ptr<Expr> Share(ExpressionPool& pool) const override {
+                std::vector<std::unique_ptr<Expr>> args;
+                for (const auto& arg : args_) {
+                    args.push_back(arg->Share(pool));
+                }
+                return pool.Intern(std::make_unique<ConditionalExpr>(type_, std::move(args)));
+            }
+
+            void AppendKey(std::string& key) const override {
+                // Число аргументов отделяет их ключи от ключей соседних узлов
+                key += 'f';
+                key += static_cast<char>(type_);
+                AppendBytes(key, static_cast<uint32_t>(args_.size()));
+                for (const auto& arg : args_) {
+                    arg->AppendKey(key);
+                }
+            }
+
+            bool Compile(std::vector<ColumnProgram::Instruction>& /* code */, Position /* origin */) const override {
+                // Программа вычисляет все операнды целиком, что противоречит
+                // ленивому вычислению аргументов
+                return false;
+            }
+
+            std::unique_ptr<Expr> Clone(std::forward_list<Position>& cells,
+                std::forward_list<ExternalCell>& external_cells, int row_shift, int col_shift) const override {
+                std::vector<std::unique_ptr<Expr>> args;
+                for (const auto& arg : args_) {
+                    args.push_back(arg->Clone(cells, external_cells, row_shift, col_shift));
+                }
+                return std::make_unique<ConditionalExpr>(type_, std::move(args));
+            }
+
+            size_t MemoryUsage() const override {
+                size_t result = sizeof(*this) + args_.capacity() * sizeof(args_.front());
+                for (const auto& arg : args_) {
+                    result += arg->MemoryUsage();
+                }
+                return result;
+            }
+
+        private:
+            Type type_;
+            std::vector<std::unique_ptr<Expr>> args_;
+        };
+
+    // Значение ячейки как операнд формулы: пустой текст - ноль, непустой -
+    // ошибка #VALUE!, ошибка ячейки передаётся дальше
+    double ToOperand(const CellInterface::Value& value) {
+        if (std::holds_alternative<double>(value)) {
+            return std::get<double>(value);
+        }
+
+        if (std::holds_alternative<std::string>(value)) {
+            if (std::get<std::string>(value).empty()) {
+                // текст пуст
+                return 0.0;
+            }
+            else {
+                throw FormulaError(FormulaError::Category::Value);
+            }
+        }
+
+        // CellInterface::Value::Error
+        throw std::get<FormulaError>(value);
+    }
+
+    // Позиция, сдвинутая на (row_shift, col_shift); вышедшая за пределы
+    // таблицы становится некорректной
+    Position ShiftCell(Position cell, int row_shift, int col_shift) {
+        if (!cell.IsValid()) {
+            return Position::NONE;
+        }
+        const Position shifted{ cell.row + row_shift, cell.col + col_shift };
+        return shifted.IsValid() ? shifted : Position::NONE;
+    }
+
     class CellExpr final : public Expr {
     public:
         explicit CellExpr(const Position* cell)
             : cell_(cell) {
         }
 
+        // Узел с собственной копией позиции: для общих подвыражений пула,
+        // которые переживают формулу, где впервые встретились
+        explicit CellExpr(Position cell)
+            : own_cell_(cell)
+            , cell_(&own_cell_) {
+        }
+
+        CellExpr(const CellExpr&) = delete;
+        CellExpr& operator=(const CellExpr&) = delete;
+
         void Print(std::ostream& out) const override {
             if (!cell_->IsValid()) {
                 out << FormulaError::Category::Ref;
@@ -261,52 +1003,84 @@ namespace ASTImpl {
                 throw FormulaError(FormulaError::Category::Ref);
             }
 
-            const CellInterface* cell = sheet.GetCell(*cell_);
+            const CellInterface* cell = sheet.FindCell(*cell_);
 
             if (!cell) {
                 return 0.0;
             }
 
-            auto value = cell->GetValue();
+            return ToOperand(cell->GetValue());
+        }
 
-            if (std::holds_alternative<double>(value)) {
-                return std::get<double>(value);
-            }
+        std::unique_ptr<Expr> Simplify(bool& /* changed */) const override {
+            return std::make_unique<CellExpr>(cell_);
+        }
 
-            if (std::holds_alternative<std::string>(value)) {
-                if (std::get<std::string>(value).empty()) {
-                    // текст пуст
-                    return 0.0;
-                }
-                else {
-                    throw FormulaError(FormulaError::Category::Value);
-                }
-            }
+        std::unique_ptr<Expr> Share(ExpressionPool& /* pool */) const override {
+            return std::make_unique<CellExpr>(*cell_);
+        }
+
+        void AppendKey(std::string& key) const override {
+            key += 'c';
+            AppendBytes(key, cell_->row);
+            AppendBytes(key, cell_->col);
+        }
 
-            // CellInterface::Value::Error
-            if (std::holds_alternative<FormulaError>(value)) {
-                throw std::get<FormulaError>(value);
+        bool Compile(std::vector<ColumnProgram::Instruction>& code, Position origin) const override {
+            if (!cell_->IsValid()) {
+                return false;
             }
-            
-            return 0.0;
+            ColumnProgram::Instruction instruction{ ColumnProgram::OpCode::LoadCell };
+            instruction.row_offset = cell_->row - origin.row;
+            instruction.col_offset = cell_->col - origin.col;
+            code.push_back(instruction);
+            return true;
+        }
+
+        std::unique_ptr<Expr> Clone(std::forward_list<Position>& cells,
+            std::forward_list<ExternalCell>& /* external_cells */, int row_shift, int col_shift) const override {
+            cells.push_front(ShiftCell(*cell_, row_shift, col_shift));
+            return std::make_unique<CellExpr>(&cells.front());
+        }
+
+        size_t MemoryUsage() const override {
+            return sizeof(*this);
         }
 
     private:
+        Position own_cell_;
         const Position* cell_;
     };
 
-    class NumberExpr final : public Expr {
+    // Ссылка на ячейку другой таблицы книги. Значение читается через
+    // таблицу формулы (SheetInterface::GetExternalValue); пакетно такие
+    // формулы не вычисляются.
+    class ExternalCellExpr final : public Expr {
     public:
-        explicit NumberExpr(double value)
-            : value_(value) {
+        explicit ExternalCellExpr(const ExternalCell* cell)
+            : cell_(cell) {
+        }
+
+        // Узел с собственной копией ссылки, как у CellExpr
+        explicit ExternalCellExpr(ExternalCell cell)
+            : own_cell_(std::move(cell))
+            , cell_(&own_cell_) {
         }
 
+        ExternalCellExpr(const ExternalCellExpr&) = delete;
+        ExternalCellExpr& operator=(const ExternalCellExpr&) = delete;
+
         void Print(std::ostream& out) const override {
-            out << value_;
+            if (!cell_->pos.IsValid()) {
+                out << FormulaError::Category::Ref;
+            }
+            else {
+                out << cell_->sheet << '!' << cell_->pos.ToString();
+            }
         }
 
         void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-            out << value_;
+            Print(out);
         }
 
         ExprPrecedence GetPrecedence() const override {
@@ -314,11 +1088,45 @@ namespace ASTImpl {
         }
 
         double Evaluate(const SheetInterface& sheet) const override {
-            return value_;
+            if (!cell_->pos.IsValid()) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            return ToOperand(sheet.GetExternalValue(cell_->sheet, cell_->pos));
+        }
+
+        std::unique_ptr<Expr> Simplify(bool& /* changed */) const override {
+            return std::make_unique<ExternalCellExpr>(cell_);
+        }
+
+        std::unique_ptr<Expr> Share(ExpressionPool& /* pool */) const override {
+            return std::make_unique<ExternalCellExpr>(*cell_);
+        }
+
+        void AppendKey(std::string& key) const override {
+            key += 'x';
+            AppendBytes(key, cell_->pos.row);
+            AppendBytes(key, cell_->pos.col);
+            key += cell_->sheet;
+            key += '!';
+        }
+
+        bool Compile(std::vector<ColumnProgram::Instruction>& /* code */, Position /* origin */) const override {
+            return false;
+        }
+
+        std::unique_ptr<Expr> Clone(std::forward_list<Position>& /* cells */,
+            std::forward_list<ExternalCell>& external_cells, int row_shift, int col_shift) const override {
+            external_cells.push_front({ cell_->sheet, ShiftCell(cell_->pos, row_shift, col_shift) });
+            return std::make_unique<ExternalCellExpr>(&external_cells.front());
+        }
+
+        size_t MemoryUsage() const override {
+            return sizeof(*this) + StringHeapBytes(own_cell_.sheet);
         }
 
     private:
-        double value_;
+        ExternalCell own_cell_;
+        const ExternalCell* cell_;
     };
 
     class ParseASTListener final : public FormulaBaseListener {
@@ -335,6 +1143,10 @@ namespace ASTImpl {
             return std::move(cells_);
         }
 
+        std::forward_list<ExternalCell> MoveExternalCells() {
+            return std::move(external_cells_);
+        }
+
     public:
         void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
             assert(args_.size() >= 1);
@@ -369,11 +1181,27 @@ namespace ASTImpl {
 
         void exitCell(FormulaParser::CellContext* ctx) override {
             auto value_str = ctx->CELL()->getSymbol()->getText();
-            auto value = Position::FromString(value_str);
+            // Ссылка на удалённую ячейку остаётся некорректной: при вычислении
+            // даёт #REF!, в списке ссылок формулы не участвует
+            if (value_str == "#REF!") {
+                cells_.push_front(Position::NONE);
+                args_.push_back(std::make_unique<CellExpr>(&cells_.front()));
+                return;
+            }
+            // Имя таблицы отделено от ячейки знаком '!'
+            const size_t separator = value_str.find('!');
+            const std::string_view cell_str = separator == std::string::npos
+                ? std::string_view(value_str) : std::string_view(value_str).substr(separator + 1);
+            auto value = Position::FromString(cell_str);
             if (!value.IsValid()) {
                 throw FormulaException("Invalid position: " + value_str);
             }
 
+            if (separator != std::string::npos) {
+                external_cells_.push_front({ value_str.substr(0, separator), value });
+                args_.push_back(std::make_unique<ExternalCellExpr>(&external_cells_.front()));
+                return;
+            }
             cells_.push_front(value);
             auto node = std::make_unique<CellExpr>(&cells_.front());
             args_.push_back(std::move(node));
@@ -406,6 +1234,75 @@ namespace ASTImpl {
             args_.back() = std::move(node);
         }
 
+        void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+            assert(args_.size() >= 2);
+
+            auto rhs = std::move(args_.back());
+            args_.pop_back();
+
+            auto lhs = std::move(args_.back());
+
+            ComparisonExpr::Type type;
+            if (ctx->EQ()) {
+                type = ComparisonExpr::Equal;
+            }
+            else if (ctx->NE()) {
+                type = ComparisonExpr::NotEqual;
+            }
+            else if (ctx->LT()) {
+                type = ComparisonExpr::Less;
+            }
+            else if (ctx->LE()) {
+                type = ComparisonExpr::LessOrEqual;
+            }
+            else if (ctx->GT()) {
+                type = ComparisonExpr::Greater;
+            }
+            else {
+                assert(ctx->GE() != nullptr);
+                type = ComparisonExpr::GreaterOrEqual;
+            }
+
+            auto node = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+            args_.back() = std::move(node);
+        }
+
+        void exitFunction(FormulaParser::FunctionContext* ctx) override {
+            const std::string name = ctx->FUNCTION()->getSymbol()->getText();
+            const size_t count = ctx->expr().size();
+            assert(args_.size() >= count);
+
+            ConditionalExpr::Type type;
+            size_t min_count = 1;
+            size_t max_count = count;
+            if (name == "IF") {
+                type = ConditionalExpr::If;
+                min_count = 2;
+                max_count = 3;
+            }
+            else if (name == "AND") {
+                type = ConditionalExpr::And;
+            }
+            else if (name == "OR") {
+                type = ConditionalExpr::Or;
+            }
+            else if (name == "IFERROR") {
+                type = ConditionalExpr::IfError;
+                min_count = max_count = 2;
+            }
+            else {
+                throw ParsingError("Unknown function: " + name);
+            }
+            if (count < min_count || count > max_count) {
+                throw ParsingError("Wrong number of arguments: " + name);
+            }
+
+            std::vector<std::unique_ptr<Expr>> args(std::make_move_iterator(args_.end() - count),
+                std::make_move_iterator(args_.end()));
+            args_.resize(args_.size() - count);
+            args_.push_back(std::make_unique<ConditionalExpr>(type, std::move(args)));
+        }
+
         void visitErrorNode(antlr4::tree::ErrorNode* node) override {
             throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
         }
@@ -413,6 +1310,7 @@ namespace ASTImpl {
     private:
         std::vector<std::unique_ptr<Expr>> args_;
         std::forward_list<Position> cells_;
+        std::forward_list<ExternalCell> external_cells_;
     };
 
     class BailErrorListener : public antlr4::BaseErrorListener {
@@ -449,7 +1347,7 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveExternalCells());
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
@@ -472,13 +1370,407 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
 }
 
 double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+    if (shared_expr_) {
+        return shared_expr_->Evaluate(sheet);
+    }
+    return (simplified_expr_ ? simplified_expr_ : root_expr_)->Evaluate(sheet);
+}
+
+void FormulaAST::Share(ExpressionPool& pool) {
+    // Значение общего подвыражения из кэша не читает ячеек, и формула с
+    // условными операциями не узнала бы, от каких ячеек зависит результат
+    if (ReadsConditionally()) {
+        return;
+    }
+    pool_ = &pool;
+    shared_expr_ = (simplified_expr_ ? simplified_expr_ : root_expr_)->Share(pool);
+    simplified_expr_.reset();
+}
+
+bool FormulaAST::ReadsConditionally() const {
+    return root_expr_->ReadsConditionally();
+}
+
+FormulaAST::HandlingResult FormulaAST::RewriteCells(const std::function<HandlingResult(Position&)>& rewrite) {
+    HandlingResult result = HandlingResult::NothingChanged;
+    for (Position& cell : cells_) {
+        if (cell.IsValid()) {
+            result = std::max(result, rewrite(cell));
+        }
+    }
+    if (result == HandlingResult::NothingChanged) {
+        return result;
+    }
+
+    // Узлы списка переставляются, а не копируются: CellExpr ссылаются на них
+    cells_.sort();
+    Reshare();
+    return result;
+}
+
+FormulaAST::HandlingResult FormulaAST::RewriteExternalCells(
+    std::string_view sheet, const std::function<HandlingResult(Position&)>& rewrite) {
+    HandlingResult result = HandlingResult::NothingChanged;
+    for (ExternalCell& cell : external_cells_) {
+        if (cell.sheet == sheet && cell.pos.IsValid()) {
+            result = std::max(result, rewrite(cell.pos));
+        }
+    }
+    if (result != HandlingResult::NothingChanged) {
+        Reshare();
+    }
+    return result;
+}
+
+FormulaAST::HandlingResult FormulaAST::Rewrite(
+    std::string_view sheet, const std::function<HandlingResult(Position&)>& rewrite) {
+    return sheet.empty() ? RewriteCells(rewrite) : RewriteExternalCells(sheet, rewrite);
+}
+
+void FormulaAST::Reshare() {
+    if (pool_) {
+        // Общие подвыражения хранят свои копии позиций: строим их заново
+        bool changed = false;
+        auto simplified = root_expr_->Simplify(changed);
+        shared_expr_ = (changed ? simplified : root_expr_)->Share(*pool_);
+    }
+}
+
+FormulaAST::HandlingResult FormulaAST::HandleInsertedRows(int before, int count, std::string_view sheet) {
+    return Rewrite(sheet, [before, count](Position& cell) {
+        if (cell.row < before) {
+            return HandlingResult::NothingChanged;
+        }
+        cell.row += count;
+        return HandlingResult::ReferencesRenamedOnly;
+    });
+}
+
+FormulaAST::HandlingResult FormulaAST::HandleInsertedCols(int before, int count, std::string_view sheet) {
+    return Rewrite(sheet, [before, count](Position& cell) {
+        if (cell.col < before) {
+            return HandlingResult::NothingChanged;
+        }
+        cell.col += count;
+        return HandlingResult::ReferencesRenamedOnly;
+    });
+}
+
+FormulaAST::HandlingResult FormulaAST::HandleDeletedRows(int first, int count, std::string_view sheet) {
+    return Rewrite(sheet, [first, count](Position& cell) {
+        if (cell.row < first) {
+            return HandlingResult::NothingChanged;
+        }
+        if (cell.row < first + count) {
+            cell = Position::NONE;
+            return HandlingResult::ReferencesChanged;
+        }
+        cell.row -= count;
+        return HandlingResult::ReferencesRenamedOnly;
+    });
+}
+
+FormulaAST::HandlingResult FormulaAST::HandleDeletedCols(int first, int count, std::string_view sheet) {
+    return Rewrite(sheet, [first, count](Position& cell) {
+        if (cell.col < first) {
+            return HandlingResult::NothingChanged;
+        }
+        if (cell.col < first + count) {
+            cell = Position::NONE;
+            return HandlingResult::ReferencesChanged;
+        }
+        cell.col -= count;
+        return HandlingResult::ReferencesRenamedOnly;
+    });
+}
+
+size_t FormulaAST::MemoryUsage() const {
+    size_t result = sizeof(*this) + root_expr_->MemoryUsage();
+    for (const auto* expr : { &simplified_expr_, &shared_expr_ }) {
+        if (*expr) {
+            result += (*expr)->MemoryUsage();
+        }
+    }
+    // Узел односвязного списка - указатель на следующий и значение
+    for (auto it = cells_.begin(); it != cells_.end(); ++it) {
+        result += sizeof(void*) + sizeof(Position);
+    }
+    for (const ExternalCell& cell : external_cells_) {
+        result += sizeof(void*) + sizeof(ExternalCell) + StringHeapBytes(cell.sheet);
+    }
+    return result;
+}
+
+FormulaAST FormulaAST::Offset(int row_shift, int col_shift) const {
+    std::forward_list<Position> cells;
+    std::forward_list<ExternalCell> external_cells;
+    auto root = root_expr_->Clone(cells, external_cells, row_shift, col_shift);
+    FormulaAST result(std::move(root), std::move(cells), std::move(external_cells));
+    if (pool_) {
+        result.Share(*pool_);
+    }
+    return result;
+}
+
+std::shared_ptr<const ColumnProgram> FormulaAST::CompileColumnProgram(Position origin, ExpressionPool& pool) const {
+    if (cells_.empty()) {
+        return nullptr;
+    }
+    const ASTImpl::Expr* expr = shared_expr_ ? shared_expr_.get()
+        : simplified_expr_ ? simplified_expr_.get() : root_expr_.get();
+    ColumnProgram program;
+    if (!expr->Compile(program.code, origin)) {
+        return nullptr;
+    }
+    return pool.InternProgram(std::move(program));
+}
+
+bool ColumnProgram::ReadsOwnColumn() const {
+    return std::any_of(code.begin(), code.end(), [](const Instruction& instruction) {
+        return instruction.op == OpCode::LoadCell && instruction.col_offset == 0;
+    });
+}
+
+namespace {
+    // Столбец значений стековой машины. errors[i] - 0 либо категория ошибки + 1
+    struct ValueColumn {
+        std::vector<double> values;
+        std::vector<uint8_t> errors;
+    };
+
+    uint8_t ToErrorCode(FormulaError::Category category) {
+        return static_cast<uint8_t>(category) + 1;
+    }
+
+    const uint8_t ARITHMETIC_ERROR = ToErrorCode(FormulaError::Category::Arithmetic);
+    const uint8_t VALUE_ERROR = ToErrorCode(FormulaError::Category::Value);
+
+    // Читает значения ячеек так же, как CellExpr::Evaluate
+    void LoadColumn(const SheetInterface& sheet, Position first, size_t count, ValueColumn& column) {
+        column.values.assign(count, 0.0);
+        column.errors.assign(count, 0);
+        for (size_t i = 0; i < count; ++i) {
+            const CellInterface* cell = sheet.FindCell({ first.row + static_cast<int>(i), first.col });
+            if (!cell) {
+                continue;
+            }
+            const CellInterface::Value value = cell->GetValue();
+            if (std::holds_alternative<double>(value)) {
+                column.values[i] = std::get<double>(value);
+            }
+            else if (std::holds_alternative<std::string>(value)) {
+                if (!std::get<std::string>(value).empty()) {
+                    column.errors[i] = VALUE_ERROR;
+                }
+            }
+            else {
+                column.errors[i] = ToErrorCode(std::get<FormulaError>(value).GetCategory());
+            }
+        }
+    }
+
+    // Результат в lhs. Ошибка операнда важнее арифметической, ошибка левого
+    // операнда - правого: так же ошибки возникают при обычном вычислении.
+    // Конечность операндов не проверяется: значения без ошибки всегда конечны.
+    void ApplyBinary(ColumnProgram::OpCode op, ValueColumn& lhs, const ValueColumn& rhs) {
+        const size_t count = lhs.values.size();
+        double* a = lhs.values.data();
+        const double* b = rhs.values.data();
+        switch (op) {
+        case ColumnProgram::OpCode::Add:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] += b[i];
+            }
+            break;
+        case ColumnProgram::OpCode::Subtract:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] -= b[i];
+            }
+            break;
+        case ColumnProgram::OpCode::Multiply:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] *= b[i];
+            }
+            break;
+        case ColumnProgram::OpCode::Divide:
+            // Деление на ноль даёт бесконечность или NaN и помечается ниже
+            for (size_t i = 0; i < count; ++i) {
+                a[i] /= b[i];
+            }
+            break;
+        case ColumnProgram::OpCode::Equal:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] = a[i] == b[i] ? 1.0 : 0.0;
+            }
+            break;
+        case ColumnProgram::OpCode::NotEqual:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] = a[i] != b[i] ? 1.0 : 0.0;
+            }
+            break;
+        case ColumnProgram::OpCode::Less:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] = a[i] < b[i] ? 1.0 : 0.0;
+            }
+            break;
+        case ColumnProgram::OpCode::LessOrEqual:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] = a[i] <= b[i] ? 1.0 : 0.0;
+            }
+            break;
+        case ColumnProgram::OpCode::Greater:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] = a[i] > b[i] ? 1.0 : 0.0;
+            }
+            break;
+        case ColumnProgram::OpCode::GreaterOrEqual:
+            for (size_t i = 0; i < count; ++i) {
+                a[i] = a[i] >= b[i] ? 1.0 : 0.0;
+            }
+            break;
+        default:
+            assert(false);
+        }
+
+        uint8_t* errors = lhs.errors.data();
+        const uint8_t* rhs_errors = rhs.errors.data();
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t arithmetic = std::isfinite(a[i]) ? 0 : ARITHMETIC_ERROR;
+            const uint8_t operand = errors[i] ? errors[i] : rhs_errors[i];
+            errors[i] = operand ? operand : arithmetic;
+        }
+    }
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+std::vector<std::variant<double, FormulaError>> ColumnProgram::Evaluate(
+    const SheetInterface& sheet, Position origin, size_t count) const {
+    std::vector<ValueColumn> stack;
+    stack.reserve(code.size());
+
+    for (const Instruction& instruction : code) {
+        switch (instruction.op) {
+        case OpCode::LoadCell:
+            stack.emplace_back();
+            LoadColumn(sheet, { origin.row + instruction.row_offset, origin.col + instruction.col_offset },
+                count, stack.back());
+            break;
+        case OpCode::LoadNumber:
+            stack.push_back({ std::vector<double>(count, instruction.number), std::vector<uint8_t>(count, 0) });
+            break;
+        case OpCode::Negate:
+            for (double& value : stack.back().values) {
+                value = -value;
+            }
+            break;
+        default: {
+            const ValueColumn rhs = std::move(stack.back());
+            stack.pop_back();
+            ApplyBinary(instruction.op, stack.back(), rhs);
+            break;
+        }
+        }
+    }
+
+    assert(stack.size() == 1);
+    const ValueColumn& result = stack.back();
+    std::vector<std::variant<double, FormulaError>> values;
+    values.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (result.errors[i]) {
+            values.push_back(FormulaError(static_cast<FormulaError::Category>(result.errors[i] - 1)));
+        }
+        else {
+            values.push_back(result.values[i]);
+        }
+    }
+    return values;
+}
+
+ExpressionPool::ExpressionPool(const uint64_t& revision, SheetStats& stats)
+    : revision_(revision)
+    , stats_(stats) {
+}
+
+ExpressionPool::~ExpressionPool() = default;
+
+std::unique_ptr<ASTImpl::Expr> ExpressionPool::Intern(std::unique_ptr<ASTImpl::Expr> expr) {
+    std::string key;
+    expr->AppendKey(key);
+
+    std::weak_ptr<ASTImpl::PooledExpr>& entry = nodes_[key];
+    std::shared_ptr<ASTImpl::PooledExpr> node = entry.lock();
+    if (!node) {
+        node = std::make_shared<ASTImpl::PooledExpr>(std::move(expr), *this);
+        entry = node;
+        if (nodes_.size() >= purge_threshold_) {
+            Purge();
+        }
+    }
+    return std::make_unique<ASTImpl::SharedExpr>(std::move(node));
+}
+
+std::shared_ptr<const ColumnProgram> ExpressionPool::InternProgram(ColumnProgram program) {
+    std::string key;
+    for (const ColumnProgram::Instruction& instruction : program.code) {
+        key += static_cast<char>(instruction.op);
+        if (instruction.op == ColumnProgram::OpCode::LoadCell) {
+            ASTImpl::AppendBytes(key, instruction.row_offset);
+            ASTImpl::AppendBytes(key, instruction.col_offset);
+        }
+        else if (instruction.op == ColumnProgram::OpCode::LoadNumber) {
+            ASTImpl::AppendBytes(key, instruction.number);
+        }
+    }
+
+    std::weak_ptr<const ColumnProgram>& entry = programs_[key];
+    std::shared_ptr<const ColumnProgram> shared = entry.lock();
+    if (!shared) {
+        shared = std::make_shared<const ColumnProgram>(std::move(program));
+        entry = shared;
+        if (programs_.size() >= purge_threshold_) {
+            Purge();
+        }
+    }
+    return shared;
+}
+
+size_t ExpressionPool::GetSize() const {
+    return std::count_if(nodes_.begin(), nodes_.end(), [](const auto& entry) {
+        return !entry.second.expired();
+    });
+}
+
+void ExpressionPool::Purge() {
+    auto erase_expired = [](auto& entries) {
+        for (auto it = entries.begin(); it != entries.end();) {
+            if (it->second.expired()) {
+                it = entries.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    };
+    erase_expired(nodes_);
+    erase_expired(programs_);
+    // Следующая чистка - когда пул снова вырастет вдвое
+    purge_threshold_ = std::max<size_t>(1024, std::max(nodes_.size(), programs_.size()) * 2);
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+    std::forward_list<ExternalCell> external_cells)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , external_cells_(std::move(external_cells)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+
+    bool changed = false;
+    auto simplified = root_expr_->Simplify(changed);
+    if (changed) {
+        simplified_expr_ = std::move(simplified);
+    }
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
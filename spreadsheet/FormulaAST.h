@@ -2,25 +2,145 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "stats.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
     class Expr;
+    struct PooledExpr;
 }
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Ссылка формулы на ячейку другой таблицы книги (Sheet2!A1)
+struct ExternalCell {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const ExternalCell& rhs) const {
+        return sheet == rhs.sheet && pos == rhs.pos;
+    }
+
+    bool operator<(const ExternalCell& rhs) const {
+        return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+    }
+};
+
+// Формула в виде программы стековой машины над столбцами значений. Ссылки
+// на ячейки хранятся как смещения от ячейки формулы, поэтому одинаковые
+// формулы, протянутые по столбцу (=A1*B1+C1, =A2*B2+C2, ...), дают одну и ту
+// же программу. Её можно выполнить сразу для блока строк: входные столбцы
+// читаются в массивы, а арифметика идёт простыми циклами по массивам,
+// которые компилятор векторизует.
+struct ColumnProgram {
+    enum class OpCode : uint8_t {
+        LoadCell,
+        LoadNumber,
+        Negate,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        // Сравнения дают 1 или 0
+        Equal,
+        NotEqual,
+        Less,
+        LessOrEqual,
+        Greater,
+        GreaterOrEqual,
+    };
+
+    struct Instruction {
+        OpCode op;
+        // Для LoadCell - смещение ячейки относительно ячейки формулы
+        int row_offset = 0;
+        int col_offset = 0;
+        // Для LoadNumber
+        double number = 0.0;
+    };
+
+    // Читает ли программа столбец самой формулы. Тогда строки блока могут
+    // зависеть друг от друга (=A1+B2 в A2), и пакетно их вычислять нельзя.
+    bool ReadsOwnColumn() const;
+
+    // Вычисляет формулу для count строк, начиная с ячейки origin. Результат
+    // каждой строки совпадает с результатом обычного вычисления её формулы,
+    // включая ошибки.
+    std::vector<std::variant<double, FormulaError>> Evaluate(
+        const SheetInterface& sheet, Position origin, size_t count) const;
+
+    std::vector<Instruction> code;
+};
+
+// Общие подвыражения формул одной таблицы (hash-consing). Одинаковые
+// подвыражения над одними и теми же ячейками, например (B1+C1)*D1 в десятках
+// формул, хранятся один раз. Значение подвыражения, которое используют
+// несколько формул, вычисляется один раз за ревизию таблицы и затем берётся
+// из кэша; запись в любую ячейку меняет ревизию и тем самым сбрасывает кэш.
+class ExpressionPool {
+public:
+    // revision - счётчик ревизий таблицы; stats - её статистика
+    ExpressionPool(const uint64_t& revision, SheetStats& stats);
+    ~ExpressionPool();
+
+    ExpressionPool(const ExpressionPool&) = delete;
+    ExpressionPool& operator=(const ExpressionPool&) = delete;
+
+    // Возвращает узел-ссылку на общее подвыражение, равное expr
+    // (дочерние узлы expr должны быть уже добавлены в пул)
+    std::unique_ptr<ASTImpl::Expr> Intern(std::unique_ptr<ASTImpl::Expr> expr);
+
+    // Возвращает программу, равную program, общую для всех таких формул
+    std::shared_ptr<const ColumnProgram> InternProgram(ColumnProgram program);
+
+    // Число общих подвыражений, используемых хотя бы одной формулой
+    size_t GetSize() const;
+
+    uint64_t GetRevision() const {
+        return revision_;
+    }
+
+    SheetStats& Stats() const {
+        return stats_;
+    }
+
+private:
+    // Удаляет записи подвыражений, которые больше не используются
+    void Purge();
+
+    const uint64_t& revision_;
+    SheetStats& stats_;
+    std::unordered_map<std::string, std::weak_ptr<ASTImpl::PooledExpr>> nodes_;
+    std::unordered_map<std::string, std::weak_ptr<const ColumnProgram>> programs_;
+    size_t purge_threshold_ = 1024;
+};
+
 class FormulaAST {
 public:
+    // Результат правки ссылок при вставке или удалении строк и столбцов
+    enum class HandlingResult {
+        NothingChanged,         // ссылки не изменились
+        ReferencesRenamedOnly,  // ссылки сдвинулись вместе с ячейками
+        ReferencesChanged,      // часть ссылок указывала на удалённые ячейки
+    };
+
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+        std::forward_list<Position> cells, std::forward_list<ExternalCell> external_cells = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
     // все ссылки на ячейки обрабатываются узлом CellExpr,
     // который при вычислении обращается к таблице
@@ -29,6 +149,40 @@ public:
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
+    // Переводит вычисление на общие подвыражения из пула. Формулы с
+    // условными операциями не переводятся (см. ReadsConditionally).
+    void Share(ExpressionPool& pool);
+
+    // Есть ли в формуле условные операции (IF, AND, OR, IFERROR): их
+    // аргументы вычисляются лишь при необходимости, и вычисление читает
+    // только часть ссылок. Чтобы ячейка могла запомнить, какие именно,
+    // такие формулы не берут значения из кэша общих подвыражений.
+    bool ReadsConditionally() const;
+
+    // Сдвигают ссылки на ячейки на месте, без повторного разбора.
+    // Ссылки на удалённые ячейки становятся некорректными (#REF!).
+    // Если задано sheet, правятся лишь ссылки на ячейки таблицы sheet
+    // (вида sheet!A1), иначе - ссылки на ячейки таблицы формулы.
+    HandlingResult HandleInsertedRows(int before, int count, std::string_view sheet = {});
+    HandlingResult HandleInsertedCols(int before, int count, std::string_view sheet = {});
+    HandlingResult HandleDeletedRows(int first, int count, std::string_view sheet = {});
+    HandlingResult HandleDeletedCols(int first, int count, std::string_view sheet = {});
+
+    // Копия формулы для ячейки, сдвинутой на (row_shift, col_shift) от
+    // исходной: ссылки сдвигаются на столько же, текст заново не разбирается.
+    // Ссылки, вышедшие за пределы таблицы, становятся #REF!. Копия использует
+    // тот же пул общих подвыражений.
+    FormulaAST Offset(int row_shift, int col_shift) const;
+
+    // Программа для пакетного вычисления формулы, записанной в ячейку origin,
+    // вместе с такими же формулами соседних строк. nullptr, если формула не
+    // ссылается на ячейки или ссылается на некорректные.
+    std::shared_ptr<const ColumnProgram> CompileColumnProgram(Position origin, ExpressionPool& pool) const;
+
+    // Память формулы в байтах: узлы выражений и списки ссылок. Общие
+    // подвыражения принадлежат пулу и не учитываются.
+    size_t MemoryUsage() const;
+
     std::forward_list<Position>& GetCells() {
         return cells_;
     }
@@ -37,13 +191,37 @@ public:
         return cells_;
     }
 
+    // Ссылки на ячейки других таблиц книги
+    const std::forward_list<ExternalCell>& GetExternalCells() const {
+        return external_cells_;
+    }
+
 private:
+    // Применяет rewrite ко всем ссылкам формулы. rewrite возвращает, что
+    // стало со ссылкой: NothingChanged, ReferencesRenamedOnly (сдвинута)
+    // или ReferencesChanged (удалена).
+    HandlingResult RewriteCells(const std::function<HandlingResult(Position&)>& rewrite);
+    // То же для ссылок на ячейки таблицы sheet
+    HandlingResult RewriteExternalCells(std::string_view sheet, const std::function<HandlingResult(Position&)>& rewrite);
+    HandlingResult Rewrite(std::string_view sheet, const std::function<HandlingResult(Position&)>& rewrite);
+
+    // Строит заново общие подвыражения после правки ссылок
+    void Reshare();
+
     std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // Упрощённое выражение для вычисления (константы свёрнуты и т. п.);
+    // nullptr, если упрощать нечего. root_expr_ хранится для печати, чтобы
+    // формула выводилась так, как её ввёл пользователь.
+    std::unique_ptr<ASTImpl::Expr> simplified_expr_;
+    // Выражение для вычисления из общих подвыражений пула (после Share)
+    std::unique_ptr<ASTImpl::Expr> shared_expr_;
+    ExpressionPool* pool_ = nullptr;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    std::forward_list<ExternalCell> external_cells_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
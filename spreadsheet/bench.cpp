@@ -0,0 +1,840 @@
+#include "bench_runner_p.h"
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+#include "workbook.h"
+#include "workload.h"
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+const int CELLS_PER_WRITE_BENCH = 10000;
+const int CHAIN_LENGTH = 1000;
+const int FAN_OUT = 10000;
+const int GRID_SIDE = 100;
+const std::string LOG_PATH = "spreadsheet_bench.log";
+
+std::string Ref(int row, int col) {
+    return Position{ row, col }.ToString();
+}
+
+// Счётчики движка, накопленные за замер, в пересчёте на одну запись или чтение
+void ReportStats(BenchContext& ctx, const Sheet& sheet) {
+#if SPREADSHEET_STATS
+    const SheetStats stats = sheet.GetStats();
+    const double reads = static_cast<double>(std::max<uint64_t>(stats.get_value_latency.Count(), 1));
+    ctx.SetCounter("stats.evaluations_per_read", stats.evaluations / reads);
+    ctx.SetCounter("stats.batch_evaluations_per_read", stats.batch_evaluations / reads);
+    ctx.SetCounter("stats.revalidations_per_read", stats.cache_revalidations / reads);
+    ctx.SetCounter("stats.shared_expression_hits_per_read", stats.shared_expression_hits / reads);
+    if (stats.cycle_checks > 0) {
+        ctx.SetCounter("stats.cycle_check_nodes_per_check",
+            static_cast<double>(stats.cycle_check_nodes_visited) / stats.cycle_checks);
+    }
+#endif
+}
+
+// Позиция i-й ячейки при раскладке по столбцам: после MAX_ROWS строк
+// раскладка продолжается в следующем столбце
+Position LinearPosition(int i) {
+    return { i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+}
+
+// A1 = 1, каждая следующая ячейка = предыдущая+1. Строится с начала: у новой
+// ячейки ещё нет зависимых, поэтому каждая проверка циклов обходит лишь её саму.
+void BuildChain(Sheet& sheet, int length) {
+    sheet.SetCell(LinearPosition(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet.SetCell(LinearPosition(i), "=" + LinearPosition(i - 1).ToString() + "+1");
+    }
+}
+
+// A1 - источник, B1..B{width} = A1*2
+void BuildFanOut(Sheet& sheet, int width) {
+    sheet.SetCell({ 0, 0 }, "1");
+    for (int i = 0; i < width; ++i) {
+        sheet.SetCell({ i, 1 }, "=A1*2");
+    }
+}
+
+// Квадрат side x side: чётные столбцы - числа, нечётные - формулы от соседей слева
+void BuildGrid(Sheet& sheet, int side) {
+    for (int i = 0; i < side; ++i) {
+        for (int j = 0; j < side; ++j) {
+            if (j % 2 == 0) {
+                sheet.SetCell({ i, j }, std::to_string(i * side + j));
+            }
+            else {
+                sheet.SetCell({ i, j }, "=" + Ref(i, j - 1) + "*2+" + Ref(i, j - 1) + "/3");
+            }
+        }
+    }
+}
+
+void BenchSetCell(BenchRunner& runner) {
+    auto bench = [&](const std::string& name, auto make_text) {
+        runner.Run(name, [&](BenchContext& ctx) {
+            std::unique_ptr<Sheet> sheet;
+            ctx.Measure(
+                CELLS_PER_WRITE_BENCH,
+                [&] {
+                    sheet = std::make_unique<Sheet>();
+                    sheet->SetCell({ 0, 0 }, "1");
+                    sheet->SetCell({ 0, 1 }, "2");
+                },
+                [&] {
+                    for (int i = 1; i <= CELLS_PER_WRITE_BENCH; ++i) {
+                        sheet->SetCell({ i, 0 }, make_text(i));
+                    }
+                });
+        });
+    };
+
+    bench("set_cell/text", [](int i) {
+        return "label " + std::to_string(i);
+    });
+    bench("set_cell/number", [](int i) {
+        return std::to_string(i * 0.5);
+    });
+    bench("set_cell/formula", [](int i) {
+        return "=" + Ref(0, 1) + "*2+" + Ref(i, 2);
+    });
+
+    // Формула, протянутая вниз на весь столбец: построчными SetCell
+    // (текст и разбор на каждую строку) и одним FillDown. У FillDown в
+    // отчёте - ускорение относительно SetCell, если замерялись оба.
+    const int fill_rows = Position::MAX_ROWS - 1;
+    double set_cell_ns = 0;
+    for (bool fill : { false, true }) {
+        runner.Run(fill ? "fill_down/fill_down" : "fill_down/set_cell", [fill, fill_rows, &set_cell_ns](BenchContext& ctx) {
+            std::unique_ptr<Sheet> sheet;
+            ctx.Measure(
+                fill_rows,
+                [&] {
+                    sheet = std::make_unique<Sheet>();
+                    sheet->SetCell({ 0, 0 }, "=B1*2+C1");
+                },
+                [&] {
+                    if (fill) {
+                        sheet->FillDown({ 0, 0 }, fill_rows);
+                        return;
+                    }
+                    for (int i = 1; i <= fill_rows; ++i) {
+                        sheet->SetCell({ i, 0 }, "=" + Ref(i, 1) + "*2+" + Ref(i, 2));
+                    }
+                });
+            if (!fill) {
+                set_cell_ns = ctx.MedianNsPerItem();
+            }
+            else if (set_cell_ns > 0) {
+                ctx.SetCounter("speedup_vs_set_cell", set_cell_ns / ctx.MedianNsPerItem());
+            }
+        });
+    }
+}
+
+void BenchGetValue(BenchRunner& runner) {
+    runner.Run("get_value/deep_chain", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildChain(sheet, CHAIN_LENGTH);
+        int version = 0;
+        ctx.SetCounter("chain_length", CHAIN_LENGTH);
+        sheet.ResetStats();
+        ctx.Measure(
+            CHAIN_LENGTH,
+            [&] {
+                sheet.SetCell({ 0, 0 }, std::to_string(++version));
+            },
+            [&] {
+                sheet.GetCell({ CHAIN_LENGTH - 1, 0 })->GetValue();
+            });
+        ReportStats(ctx, sheet);
+    });
+
+    // Холодное чтение конца цепочки разной длины: время на ячейку не должно
+    // расти с длиной, а длинные цепочки не должны переполнять стек
+    for (int length : { 1000, 10000, 100000, 200000 }) {
+        runner.Run("get_value/chain_" + std::to_string(length), [length](BenchContext& ctx) {
+            Sheet sheet;
+            BuildChain(sheet, length);
+            int version = 0;
+            ctx.SetCounter("chain_length", length);
+            ctx.Measure(
+                length,
+                [&] {
+                    sheet.SetCell({ 0, 0 }, std::to_string(++version));
+                },
+                [&] {
+                    sheet.GetCell(LinearPosition(length - 1))->GetValue();
+                });
+        });
+    }
+
+    runner.Run("get_value/deep_chain_profiled", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildChain(sheet, CHAIN_LENGTH);
+        sheet.Profiler().SetEnabled(true);
+        int version = 0;
+        ctx.Measure(
+            CHAIN_LENGTH,
+            [&] {
+                sheet.SetCell({ 0, 0 }, std::to_string(++version));
+            },
+            [&] {
+                sheet.GetCell({ CHAIN_LENGTH - 1, 0 })->GetValue();
+            });
+    });
+
+    runner.Run("get_value/deep_chain_cached", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildChain(sheet, CHAIN_LENGTH);
+        const CellInterface* last = sheet.GetCell({ CHAIN_LENGTH - 1, 0 });
+        last->GetValue();
+        ctx.Measure(1, [&] {
+            last->GetValue();
+        });
+    });
+
+    // Пересчёт формул с общим подвыражением после изменения его ячейки
+    runner.Run("get_value/shared_subexpression", [](BenchContext& ctx) {
+        Sheet sheet;
+        sheet.SetCell({ 0, 0 }, "1");
+        sheet.SetCell({ 0, 1 }, "2");
+        sheet.SetCell({ 0, 2 }, "3");
+        for (int i = 0; i < FAN_OUT; ++i) {
+            sheet.SetCell({ i, 3 }, "=(A1+B1)*C1/(A1-B1)+" + std::to_string(i));
+        }
+        int version = 0;
+        sheet.ResetStats();
+        ctx.Measure(
+            FAN_OUT,
+            [&] {
+                sheet.SetCell({ 0, 0 }, std::to_string(++version));
+            },
+            [&] {
+                for (int i = 0; i < FAN_OUT; ++i) {
+                    sheet.GetCell({ i, 3 })->GetValue();
+                }
+            });
+        ReportStats(ctx, sheet);
+    });
+
+    // Столбец протянутых вниз формул D{i} = A{i}*B{i}+C{i} на все строки листа.
+    // В варианте scalar формулы чередуются с равносильными C{i}+A{i}*B{i}:
+    // блоков одинаковых формул нет, и каждая вычисляется по отдельности.
+    for (bool batched : { true, false }) {
+        const std::string name = batched ? "get_value/fill_down" : "get_value/fill_down_scalar";
+        runner.Run(name, [batched](BenchContext& ctx) {
+            const int rows = Position::MAX_ROWS;
+            Sheet sheet;
+            for (int i = 0; i < rows; ++i) {
+                const std::string row = std::to_string(i + 1);
+                sheet.SetCell({ i, 0 }, std::to_string(i));
+                sheet.SetCell({ i, 1 }, std::to_string(i % 10));
+                sheet.SetCell({ i, 2 }, "0.5");
+                sheet.SetCell({ i, 3 }, batched || i % 2 == 0
+                    ? "=A" + row + "*B" + row + "+C" + row
+                    : "=C" + row + "+A" + row + "*B" + row);
+            }
+            int version = 0;
+            sheet.ResetStats();
+            ctx.Measure(
+                rows,
+                [&] {
+                    // Меняются входные данные всех строк
+                    ++version;
+                    for (int i = 0; i < rows; ++i) {
+                        sheet.SetCell({ i, 0 }, std::to_string(i + version));
+                    }
+                },
+                [&] {
+                    for (int i = 0; i < rows; ++i) {
+                        sheet.GetCell({ i, 3 })->GetValue();
+                    }
+                });
+            ReportStats(ctx, sheet);
+        });
+    }
+
+    // Формула выбирает дешёвую ветвь, а другая зависит от цепочки, которая
+    // меняется перед каждым чтением. IF не вычисляет цепочку ни при
+    // вычислении, ни при проверке кэша; сравнение - та же логика через
+    // умножение на флаг B1, которое вычисляет обе ветви.
+    for (const auto& [name, formula] : std::vector<std::pair<std::string, std::string>>{
+        { "if", "=IF(B1,A" + std::to_string(CHAIN_LENGTH) + ",C1)" },
+        { "flags", "=B1*A" + std::to_string(CHAIN_LENGTH) + "+(1-B1)*C1" } }) {
+        runner.Run("get_value/untaken_branch_" + name, [formula = formula](BenchContext& ctx) {
+            Sheet sheet;
+            BuildChain(sheet, CHAIN_LENGTH);
+            sheet.SetCell({ 0, 1 }, "0");
+            sheet.SetCell({ 0, 2 }, "1");
+            sheet.SetCell({ 0, 3 }, formula);
+            int version = 0;
+            ctx.SetCounter("chain_length", CHAIN_LENGTH);
+            sheet.ResetStats();
+            ctx.Measure(
+                1,
+                [&] {
+                    ++version;
+                    sheet.SetCell({ 0, 0 }, std::to_string(version));
+                    sheet.SetCell({ 0, 2 }, std::to_string(version));
+                },
+                [&] {
+                    sheet.GetCell({ 0, 3 })->GetValue();
+                });
+            ReportStats(ctx, sheet);
+        });
+    }
+
+    runner.Run("get_value/fan_out", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildFanOut(sheet, FAN_OUT);
+        int version = 0;
+        ctx.SetCounter("fan_out", FAN_OUT);
+        ctx.Measure(
+            FAN_OUT,
+            [&] {
+                sheet.SetCell({ 0, 0 }, std::to_string(++version));
+            },
+            [&] {
+                for (int i = 0; i < FAN_OUT; ++i) {
+                    sheet.GetCell({ i, 1 })->GetValue();
+                }
+            });
+    });
+}
+
+void BenchInvalidation(BenchRunner& runner) {
+    runner.Run("invalidation/fan_out", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildFanOut(sheet, FAN_OUT);
+        int version = 0;
+        ctx.SetCounter("dependents", FAN_OUT);
+        sheet.ResetStats();
+        ctx.Measure(1, [&] {
+            sheet.SetCell({ 0, 0 }, std::to_string(++version));
+        });
+        ReportStats(ctx, sheet);
+    });
+
+    // Запись в ячейку с миллионом транзитивно зависимых: A1 -> 1000 ячеек
+    // первого уровня -> по 1000 ячеек второго уровня на каждую
+    runner.Run("invalidation/million_dependents", [](BenchContext& ctx) {
+        const int width = 1000;
+        Sheet sheet;
+        sheet.SetCell({ 0, 0 }, "1");
+        for (int i = 0; i < width; ++i) {
+            const Position first = LinearPosition(i + 1);
+            sheet.SetCell(first, "=A1+1");
+            const std::string formula = "=" + first.ToString() + "*2";
+            for (int j = 0; j < width; ++j) {
+                sheet.SetCell(LinearPosition(width + 1 + i * width + j), formula);
+            }
+        }
+        int version = 0;
+        ctx.SetCounter("dependents", width + width * width);
+        ctx.Measure(1, [&] {
+            sheet.SetCell({ 0, 0 }, std::to_string(++version));
+        });
+    });
+
+    runner.Run("invalidation/deep_chain", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildChain(sheet, CHAIN_LENGTH);
+        int version = 0;
+        ctx.SetCounter("dependents", CHAIN_LENGTH - 1);
+        ctx.Measure(1, [&] {
+            sheet.SetCell({ 0, 0 }, std::to_string(++version));
+        });
+    });
+
+    // Запись с подпиской на изменения: B1 = A1*0 не меняется, и обход
+    // изменений на ней останавливается, FAN_OUT формул за ней не
+    // просматриваются. Сравнение - та же раскладка,
+    // где B1 = A1*2 и вся веерная часть вычисляется и сообщается заново.
+    for (const char* factor : { "0", "2" }) {
+        runner.Run(std::string("notifications/fan_out_behind_B1_A1x") + factor, [factor](BenchContext& ctx) {
+            Sheet sheet;
+            sheet.SetCell({ 0, 0 }, "1");
+            sheet.SetCell({ 0, 1 }, "=A1*" + std::string(factor));
+            for (int i = 0; i < FAN_OUT; ++i) {
+                sheet.SetCell({ i, 2 }, "=B1+" + std::to_string(i));
+            }
+            sheet.Recalculate(RecalcScheduler::Clock::now() + std::chrono::seconds(10));
+            size_t notified = 0;
+            sheet.Subscribe([&notified](const std::vector<Position>& changed) {
+                notified += changed.size();
+            });
+            // A1 уже равна 1: первая запись должна её изменить
+            int version = 1;
+            int64_t writes = 0;
+            ctx.SetCounter("dependents", FAN_OUT + 1);
+            ctx.Measure(1, [&] {
+                sheet.SetCell({ 0, 0 }, std::to_string(++version));
+                ++writes;
+            });
+            ctx.SetCounter("notified_cells_per_write", static_cast<double>(notified) / writes);
+        });
+    }
+
+    // Пересчёт после записи с бюджетом 1 мс на вызов: измеряется весь
+    // пересчёт, число вызовов показывает, на сколько порций он разбит
+    runner.Run("recalculate/fan_out_1ms_slices", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildFanOut(sheet, FAN_OUT);
+        sheet.Recalculate(RecalcScheduler::Clock::now() + std::chrono::seconds(10));
+        int version = 0;
+        int64_t calls = 0;
+        int64_t rounds = 0;
+        ctx.SetCounter("dependents", FAN_OUT);
+        ctx.Measure(1, [&] {
+            sheet.SetCell({ 0, 0 }, std::to_string(++version));
+            ++rounds;
+            do {
+                ++calls;
+            } while (!sheet.Recalculate(RecalcScheduler::Clock::now() + std::chrono::milliseconds(1)));
+        });
+        ctx.SetCounter("calls_per_recalculation", static_cast<double>(calls) / rounds);
+    });
+}
+
+void BenchCycleCheck(BenchRunner& runner) {
+    runner.Run("cycle_check/deep_chain", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildChain(sheet, CHAIN_LENGTH);
+        // Проверка обходит ячейки, зависящие от изменяемой: у A1 это вся цепочка
+        ctx.SetCounter("downstream_cells", CHAIN_LENGTH);
+        sheet.ResetStats();
+        ctx.Measure(1, [&] {
+            sheet.SetCell({ 0, 0 }, "=B1+1");
+        });
+        ReportStats(ctx, sheet);
+    });
+
+    runner.Run("cycle_check/detected", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildChain(sheet, CHAIN_LENGTH);
+        const std::string formula = "=" + Ref(CHAIN_LENGTH - 1, 0) + "+1";
+        ctx.Measure(1, [&] {
+            try {
+                sheet.SetCell({ 0, 0 }, formula);
+            } catch (const CircularDependencyException&) {
+            }
+        });
+    });
+}
+
+void BenchParseFormula(BenchRunner& runner) {
+    runner.Run("parse_formula/mixed", [](BenchContext& ctx) {
+        const std::vector<std::string> formulas = {
+            "1",
+            "A1",
+            "A1+B2*C3",
+            "(A1+B1)*(C1-D1)/2",
+            "-(-(A1*2)+3.5e2)/(B7-C9)",
+            "((((A1+A2)+A3)+A4)+A5)*((B1+B2)+(B3+B4))",
+            "XFD16384/AAA1-Z99+12.75*(Q3-R4)",
+        };
+        const int rounds = 200;
+        ctx.Measure(formulas.size() * rounds, [&] {
+            for (int r = 0; r < rounds; ++r) {
+                for (const auto& f : formulas) {
+                    ParseFormula(f);
+                }
+            }
+        });
+    });
+}
+
+void BenchPosition(BenchRunner& runner) {
+    std::vector<Position> positions;
+    for (int i = 0; i < 10000; ++i) {
+        positions.push_back({ (i * 7919) % Position::MAX_ROWS, (i * 104729) % Position::MAX_COLS });
+    }
+    std::vector<std::string> names;
+    for (const Position& p : positions) {
+        names.push_back(p.ToString());
+    }
+
+    runner.Run("position/to_string", [&](BenchContext& ctx) {
+        size_t total = 0;
+        ctx.Measure(positions.size(), [&] {
+            for (const Position& p : positions) {
+                total += p.ToString().size();
+            }
+        });
+        ctx.SetCounter("checksum", static_cast<double>(total));
+    });
+
+    runner.Run("position/from_string", [&](BenchContext& ctx) {
+        long long total = 0;
+        ctx.Measure(names.size(), [&] {
+            for (const std::string& name : names) {
+                total += Position::FromString(name).row;
+            }
+        });
+        ctx.SetCounter("checksum", static_cast<double>(total));
+    });
+}
+
+void BenchPrint(BenchRunner& runner) {
+    runner.Run("print_values/grid", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildGrid(sheet, GRID_SIDE);
+        ctx.Measure(GRID_SIDE * GRID_SIDE, [&] {
+            std::ostringstream out;
+            sheet.PrintValues(out);
+        });
+    });
+
+    // Формулы ссылаются на пустые ячейки далеко за пределами сетки: печать
+    // не должна проходить по ним
+    runner.Run("print_values/sparse_references", [](BenchContext& ctx) {
+        Sheet sheet;
+        for (int i = 0; i < GRID_SIDE; ++i) {
+            for (int j = 0; j < GRID_SIDE; ++j) {
+                sheet.SetCell({ i, j }, "=" + Ref(10000 + i * GRID_SIDE + j, j) + "+1");
+            }
+        }
+        const Size size = sheet.GetPrintableSize();
+        ctx.SetCounter("printable_cells", static_cast<double>(size.rows) * size.cols);
+        ctx.Measure(GRID_SIDE * GRID_SIDE, [&] {
+            std::ostringstream out;
+            sheet.PrintValues(out);
+        });
+    });
+
+    runner.Run("print_texts/grid", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildGrid(sheet, GRID_SIDE);
+        ctx.Measure(GRID_SIDE * GRID_SIDE, [&] {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+        });
+    });
+
+    // Таблицы, почти целиком состоящие из формул: текст каждой ячейки -
+    // каноническая запись формулы
+    runner.Run("print_texts/dag", [](BenchContext& ctx) {
+        Sheet sheet;
+        GenerateSheet(sheet, { SheetShape::RandomDag, GRID_SIDE * GRID_SIDE, 10, 10 });
+        const Size size = sheet.GetPrintableSize();
+        ctx.Measure(size.rows * size.cols, [&] {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+        });
+    });
+
+    runner.Run("print_texts/long_formulas", [](BenchContext& ctx) {
+        const int terms = 16;
+        Sheet sheet;
+        for (int i = 0; i < GRID_SIDE; ++i) {
+            sheet.SetCell({ i, 0 }, std::to_string(i));
+        }
+        for (int i = 0; i < GRID_SIDE; ++i) {
+            for (int j = 1; j < GRID_SIDE; ++j) {
+                std::string text = "=";
+                for (int k = 0; k < terms; ++k) {
+                    text += (k ? "+(" : "(") + Ref((i + k) % GRID_SIDE, 0) + "*" + std::to_string(k + 1) + ")";
+                }
+                sheet.SetCell({ i, j }, text);
+            }
+        }
+        ctx.Measure(GRID_SIDE * GRID_SIDE, [&] {
+            std::ostringstream out;
+            sheet.PrintTexts(out);
+        });
+    });
+
+    // Окно 200x50 в таблице из 250 тысяч ячеек: обходятся и вычисляются
+    // только ячейки окна
+    runner.Run("visit_range/viewport", [](BenchContext& ctx) {
+        const int rows = 5000;
+        const int cols = 50;
+        Sheet sheet;
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < cols; ++j) {
+                sheet.SetCell({ i, j }, j == 0 ? std::to_string(i) : "=" + Ref(i, j - 1) + "+1");
+            }
+        }
+        const Size window{ 200, 50 };
+        ctx.SetCounter("sheet_cells", rows * cols);
+        ctx.Measure(window.rows * window.cols, [&] {
+            double total = 0;
+            sheet.VisitRange({ rows / 2, 0 }, window, [&total](Position, const CellInterface& cell) {
+                const auto value = cell.GetValue();
+                if (std::holds_alternative<double>(value)) {
+                    total += std::get<double>(value);
+                }
+            });
+        });
+    });
+}
+
+void BenchStructure(BenchRunner& runner) {
+    // Вставка и удаление строки над всей сеткой: сдвигаются все ячейки,
+    // и у каждой формулы правятся ссылки
+    runner.Run("structure/insert_delete_row", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildGrid(sheet, GRID_SIDE);
+        ctx.SetCounter("moved_cells", GRID_SIDE * GRID_SIDE);
+        ctx.Measure(1, [&] {
+            sheet.InsertRows(0);
+            sheet.DeleteRows(0);
+        });
+    });
+    // Та же сетка, строка под ней: сдвигать нечего, и стоимость не должна
+    // зависеть от размера таблицы, в том числе с подписчиком на изменения
+    runner.Run("structure/insert_delete_last_row", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildGrid(sheet, GRID_SIDE);
+        sheet.Subscribe([](const std::vector<Position>&) {});
+        ctx.SetCounter("moved_cells", 0);
+        ctx.Measure(1, [&] {
+            sheet.InsertRows(GRID_SIDE);
+            sheet.DeleteRows(GRID_SIDE);
+        });
+    });
+    // Вставка столбца перед последним: сдвигается один столбец
+    runner.Run("structure/insert_delete_last_col", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildGrid(sheet, GRID_SIDE);
+        sheet.Subscribe([](const std::vector<Position>&) {});
+        ctx.SetCounter("moved_cells", GRID_SIDE);
+        ctx.Measure(1, [&] {
+            sheet.InsertCols(GRID_SIDE - 1);
+            sheet.DeleteCols(GRID_SIDE - 1);
+        });
+    });
+}
+
+void BenchUndo(BenchRunner& runner) {
+    // Отмена и повтор правки формулы в большой таблице: стоимость не должна
+    // зависеть от размера таблицы
+    runner.Run("undo/formula_edit", [](BenchContext& ctx) {
+        Sheet sheet;
+        BuildGrid(sheet, GRID_SIDE);
+        sheet.EnableUndo();
+        sheet.SetCell({ GRID_SIDE / 2, GRID_SIDE / 2 }, "=" + Ref(0, 0) + "*2+" + Ref(1, 1));
+        ctx.Measure(1, [&] {
+            sheet.Undo();
+            sheet.Redo();
+        });
+    });
+}
+
+// Правки вперемешку: числа в столбце A и формулы в столбце B, ссылающиеся на A
+void ApplyEdits(Sheet& sheet, int ops) {
+    for (int i = 0; i < ops; ++i) {
+        const int row = i / 2 % 1000;
+        if (i % 2 == 0) {
+            sheet.SetCell({ row, 0 }, std::to_string(i));
+        }
+        else {
+            sheet.SetCell({ row, 1 }, "=" + Ref(row, 0) + "*2+1");
+        }
+    }
+}
+
+void BenchOperationLog(BenchRunner& runner) {
+    using namespace std::chrono_literals;
+    struct DurabilitySetting {
+        std::string name;
+        size_t sync_every_ops;
+        std::chrono::milliseconds sync_interval;
+        int ops;
+    };
+    const std::vector<DurabilitySetting> settings = {
+        { "fsync_every_op", 1, 0ms, 500 },
+        { "fsync_every_64_ops", 64, 0ms, 20000 },
+        { "fsync_every_1024_ops", 1024, 0ms, 20000 },
+        { "fsync_every_10ms", 0, 10ms, 20000 },
+        { "fsync_every_100ms_or_4096_ops", 4096, 100ms, 20000 },
+    };
+
+    for (const auto& setting : settings) {
+        runner.Run("oplog/" + setting.name, [&](BenchContext& ctx) {
+            std::unique_ptr<Sheet> sheet;
+            ctx.Measure(
+                setting.ops,
+                [&] {
+                    sheet.reset();
+                    std::remove(LOG_PATH.c_str());
+                    sheet = std::make_unique<Sheet>();
+                    sheet->EnableOperationLog({ LOG_PATH, setting.sync_every_ops, setting.sync_interval });
+                },
+                [&] {
+                    ApplyEdits(*sheet, setting.ops);
+                    sheet->SyncOperationLog();
+                });
+            sheet.reset();
+        });
+    }
+
+    runner.Run("oplog/replay", [](BenchContext& ctx) {
+        const int ops = 20000;
+        std::remove(LOG_PATH.c_str());
+        {
+            Sheet sheet;
+            sheet.EnableOperationLog({ LOG_PATH, 0, 0ms });
+            ApplyEdits(sheet, ops);
+        }
+        ctx.Measure(ops, [&] {
+            Sheet restored;
+            restored.ReplayOperationLog(LOG_PATH);
+        });
+    });
+
+    std::remove(LOG_PATH.c_str());
+}
+
+// Память таблиц типичной формы: счётчики memory.* - байты на ячейку по видам
+// данных, по ним задаются бюджеты памяти. Замеряется сам вызов MemoryUsage.
+void BenchMemory(BenchRunner& runner) {
+    auto bench = [&runner](const std::string& name, int cells, auto build) {
+        runner.Run("memory/" + name, [cells, build](BenchContext& ctx) {
+            Sheet sheet;
+            build(sheet);
+            SheetMemoryUsage usage;
+            ctx.Measure(1, [&] {
+                usage = sheet.MemoryUsage();
+            });
+            const double per_cell = 1.0 / cells;
+            ctx.SetCounter("cells", cells);
+            ctx.SetCounter("memory.total_per_cell", usage.Total() * per_cell);
+            ctx.SetCounter("memory.cells_per_cell", usage.cells * per_cell);
+            ctx.SetCounter("memory.cell_index_per_cell", usage.cell_index * per_cell);
+            ctx.SetCounter("memory.text_per_cell", usage.text * per_cell);
+            ctx.SetCounter("memory.formulas_per_cell", usage.formulas * per_cell);
+            ctx.SetCounter("memory.dependents_per_cell", usage.dependents * per_cell);
+            ctx.SetCounter("memory.value_caches_per_cell", usage.value_caches * per_cell);
+        });
+    };
+
+    bench("numbers", GRID_SIDE * GRID_SIDE, [](Sheet& sheet) {
+        for (int i = 0; i < GRID_SIDE * GRID_SIDE; ++i) {
+            sheet.SetCell(LinearPosition(i), std::to_string(i));
+        }
+    });
+    bench("long_text", GRID_SIDE * GRID_SIDE, [](Sheet& sheet) {
+        for (int i = 0; i < GRID_SIDE * GRID_SIDE; ++i) {
+            sheet.SetCell(LinearPosition(i), "text value number " + std::to_string(i));
+        }
+    });
+    bench("grid", GRID_SIDE * GRID_SIDE, [](Sheet& sheet) {
+        BuildGrid(sheet, GRID_SIDE);
+    });
+    bench("fan_out", FAN_OUT + 1, [](Sheet& sheet) {
+        BuildFanOut(sheet, FAN_OUT);
+    });
+    bench("deep_chain", CHAIN_LENGTH, [](Sheet& sheet) {
+        BuildChain(sheet, CHAIN_LENGTH);
+    });
+}
+
+// Смешанные трассы чтений и записей над таблицами разных форм
+// (см. workload.h); замеряется время на операцию
+void BenchTrace(BenchRunner& runner) {
+    for (SheetShape shape : { SheetShape::Grid, SheetShape::RandomDag, SheetShape::Errors }) {
+        runner.Run("trace/" + std::string(ToString(shape)), [shape](BenchContext& ctx) {
+            Sheet sheet;
+            GenerateSheet(sheet, { shape, GRID_SIDE * GRID_SIDE, 10, 10 });
+            TraceOptions options;
+            options.operations = 10000;
+            options.area = sheet.GetPrintableSize();
+            const std::vector<TraceOperation> trace = GenerateTrace(options);
+            TraceTiming timing;
+            ctx.Measure(trace.size(), [&] {
+                timing = ReplayTrace(sheet, trace);
+            });
+            ctx.SetCounter("read_p99_ns", static_cast<double>(timing.read_latency.Percentile(0.99)));
+            ctx.SetCounter("write_p99_ns", static_cast<double>(timing.write_latency.Percentile(0.99)));
+        });
+    }
+}
+
+// Книга из независимых таблиц с общей таблицей исходных данных: каждая
+// таблица - столбец формул, читающих ячейку Data. Пересчёт после записи в
+// Data затрагивает все таблицы; сравнивается один поток и потоки по числу ядер.
+void BenchWorkbook(BenchRunner& runner) {
+    constexpr int SHEETS = 8;
+    constexpr int ROWS = 2000;
+    for (size_t threads : { size_t{ 1 }, size_t{ 0 } }) {
+        const std::string name = threads == 1 ? "workbook/recalculate_8_sheets_1_thread"
+                                              : "workbook/recalculate_8_sheets_all_threads";
+        runner.Run(name, [threads](BenchContext& ctx) {
+            Workbook book(threads);
+            Sheet& data = book.AddSheet("Data");
+            data.SetCell({ 0, 0 }, "1");
+            for (int s = 0; s < SHEETS; ++s) {
+                Sheet& sheet = book.AddSheet("S" + std::to_string(s));
+                for (int i = 0; i < ROWS; ++i) {
+                    sheet.SetCell({ i, 0 }, "=Data!A1*" + std::to_string(i) + "+" + std::to_string(s));
+                }
+            }
+            book.Recalculate();
+            int version = 0;
+            ctx.SetCounter("formulas", SHEETS * ROWS);
+            ctx.SetCounter("threads", static_cast<double>(threads == 0 ? std::thread::hardware_concurrency() : threads));
+            ctx.Measure(SHEETS * ROWS, [&] {
+                data.SetCell({ 0, 0 }, std::to_string(++version));
+                book.Recalculate();
+            });
+        });
+    }
+}
+}  // namespace
+
+// Использование: spreadsheet_bench [--filter=подстрока] [--out=файл.json] [--min-time=секунды]
+int main(int argc, char** argv) {
+    BenchOptions options;
+    std::string out_path;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value_of = [&](const std::string& key) {
+            return arg.rfind(key, 0) == 0 ? arg.substr(key.size()) : std::string();
+        };
+        if (arg.rfind("--filter=", 0) == 0) {
+            options.filter = value_of("--filter=");
+        }
+        else if (arg.rfind("--out=", 0) == 0) {
+            out_path = value_of("--out=");
+        }
+        else if (arg.rfind("--min-time=", 0) == 0) {
+            options.min_time = std::stod(value_of("--min-time="));
+        }
+        else {
+            std::cerr << "Unknown argument: " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    BenchRunner runner(options);
+    BenchSetCell(runner);
+    BenchGetValue(runner);
+    BenchInvalidation(runner);
+    BenchCycleCheck(runner);
+    BenchParseFormula(runner);
+    BenchPosition(runner);
+    BenchPrint(runner);
+    BenchStructure(runner);
+    BenchUndo(runner);
+    BenchOperationLog(runner);
+    BenchMemory(runner);
+    BenchTrace(runner);
+    BenchWorkbook(runner);
+
+    if (out_path.empty()) {
+        runner.ReportJson(std::cout);
+    }
+    else {
+        std::ofstream out(out_path);
+        runner.ReportJson(out);
+    }
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Самодостаточная обвязка для замеров производительности.
+// Каждый замер - это функция, которая готовит данные и вызывает
+// BenchContext::Measure для участка кода, время которого нужно измерить.
+// Результаты выводятся в JSON, чтобы их можно было сравнивать между запусками.
+
+struct BenchOptions {
+    // Запускаются только замеры, в имени которых есть эта подстрока
+    std::string filter;
+    // Минимальное суммарное измеренное время одного замера, в секундах
+    double min_time = 0.2;
+    // Ограничение на число повторов одного замера
+    int max_repetitions = 1000;
+};
+
+struct BenchResult {
+    std::string name;
+    int repetitions = 0;
+    uint64_t items_per_repetition = 0;
+    double min_ns_per_item = 0;
+    double median_ns_per_item = 0;
+    double mean_ns_per_item = 0;
+    std::map<std::string, double> counters;
+};
+
+class BenchContext {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit BenchContext(const BenchOptions& options, BenchResult& result)
+        : options_(options)
+        , result_(result) {
+    }
+
+    // Повторяет setup (без замера) и body (с замером), пока не наберётся
+    // options.min_time. items - число операций, выполняемых за один вызов body.
+    template <typename Setup, typename Body>
+    void Measure(uint64_t items, Setup setup, Body body) {
+        std::vector<double> samples;
+        double total = 0;
+        while (samples.empty()
+            || (total < options_.min_time
+                && static_cast<int>(samples.size()) < options_.max_repetitions)) {
+            setup();
+            const auto start = Clock::now();
+            body();
+            const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+            samples.push_back(elapsed);
+            total += elapsed;
+        }
+
+        std::sort(samples.begin(), samples.end());
+        const double to_ns = 1e9 / static_cast<double>(std::max<uint64_t>(items, 1));
+        result_.repetitions = static_cast<int>(samples.size());
+        result_.items_per_repetition = items;
+        result_.min_ns_per_item = samples.front() * to_ns;
+        result_.median_ns_per_item = samples[samples.size() / 2] * to_ns;
+        result_.mean_ns_per_item = total / static_cast<double>(samples.size()) * to_ns;
+    }
+
+    template <typename Body>
+    void Measure(uint64_t items, Body body) {
+        Measure(items, [] {}, body);
+    }
+
+    // Медиана последнего замера Measure, нс на операцию
+    double MedianNsPerItem() const {
+        return result_.median_ns_per_item;
+    }
+
+    // Дополнительная величина, попадающая в отчёт (например, размер данных)
+    void SetCounter(const std::string& name, double value) {
+        result_.counters[name] = value;
+    }
+
+private:
+    const BenchOptions& options_;
+    BenchResult& result_;
+};
+
+class BenchRunner {
+public:
+    explicit BenchRunner(BenchOptions options)
+        : options_(std::move(options)) {
+    }
+
+    void Run(const std::string& name, const std::function<void(BenchContext&)>& func) {
+        if (name.find(options_.filter) == std::string::npos) {
+            return;
+        }
+        BenchResult result;
+        result.name = name;
+        BenchContext context(options_, result);
+        func(context);
+        std::cerr << std::left << std::setw(48) << name << ' '
+            << std::right << std::setw(14) << std::fixed << std::setprecision(1)
+            << result.median_ns_per_item << " ns/item" << std::endl;
+        results_.push_back(std::move(result));
+    }
+
+    void ReportJson(std::ostream& out) const {
+        out << "{\n  \"benchmarks\": [";
+        bool first = true;
+        for (const BenchResult& r : results_) {
+            out << (first ? "\n" : ",\n");
+            first = false;
+            out << "    {\"name\": \"" << Escape(r.name) << "\""
+                << ", \"repetitions\": " << r.repetitions
+                << ", \"items_per_repetition\": " << r.items_per_repetition
+                << ", \"min_ns_per_item\": " << Number(r.min_ns_per_item)
+                << ", \"median_ns_per_item\": " << Number(r.median_ns_per_item)
+                << ", \"mean_ns_per_item\": " << Number(r.mean_ns_per_item)
+                << ", \"items_per_second\": "
+                << Number(r.median_ns_per_item > 0 ? 1e9 / r.median_ns_per_item : 0);
+            out << ", \"counters\": {";
+            bool first_counter = true;
+            for (const auto& [key, value] : r.counters) {
+                out << (first_counter ? "" : ", ") << '"' << Escape(key) << "\": " << Number(value);
+                first_counter = false;
+            }
+            out << "}}";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+    static std::string Escape(const std::string& s) {
+        std::string result;
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+            }
+            result += c;
+        }
+        return result;
+    }
+
+    static std::string Number(double value) {
+        // В JSON нет nan и inf: такие значения выводятся как null
+        if (!std::isfinite(value)) {
+            return "null";
+        }
+        std::ostringstream out;
+        out << std::setprecision(6) << value;
+        return out.str();
+    }
+
+    BenchOptions options_;
+    std::vector<BenchResult> results_;
+};
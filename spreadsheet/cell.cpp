@@ -1,131 +1,433 @@
 #include "cell.h"
 
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <iostream>
 #include <string>
 #include <optional>
-#include <queue>
+#include <utility>
+
+namespace {
+    // Предельная глубина вложенных вычислений формул в одном потоке.
+    // Каждый переход по ссылке стоит нескольких кадров стека
+    // (Formula::Evaluate, узлы выражения, Cell::GetValue), поэтому запас велик.
+    constexpr int MAX_EVALUATION_DEPTH = 256;
+
+    // Текущая глубина вложенных вычислений формул в потоке
+    thread_local int evaluation_depth = 0;
+
+    // Пакетное вычисление формул столбца: блоки короче MIN_COLUMN_BLOCK
+    // вычисляются по ячейкам, длиннее MAX_COLUMN_BLOCK - частями
+    constexpr size_t MIN_COLUMN_BLOCK = 8;
+    constexpr size_t MAX_COLUMN_BLOCK = 1024;
+
+    // Идёт ли в потоке пакетное вычисление. Вложенные блоки не начинаются:
+    // ячейка блока может косвенно зависеть от предыдущей ячейки того же
+    // блока (B2=A2*2, A2=B1+1), и тогда та вычисляется по отдельности.
+    thread_local bool in_column_block = false;
+
+    // Запрещено ли в потоке пакетное вычисление (см. SingleCellEvaluationScope)
+    thread_local int single_cell_scopes = 0;
+
+    // Куда записываются ячейки, прочитанные вычисляемой в потоке формулой
+    // с условными операциями; nullptr, если чтения не записываются
+    thread_local std::vector<CellId>* recorded_reads = nullptr;
+
+    // Запись чтений на время обновления формулы. Вложенные обновления
+    // ставят свою запись (или отключают её) и по выходе возвращают прежнюю.
+    class ReadRecordingScope {
+    public:
+        explicit ReadRecordingScope(std::vector<CellId>* reads)
+            : previous_(std::exchange(recorded_reads, reads)) {
+        }
 
-bool Cell::CircularDependencyCheck(const Cell* start,
-    const std::vector<Position>& references) const {
-    // Самоссылка считается циклом
-    for (const Position& ref : references) {
-        if (sheet_.GetCell(ref) == start) {
-            return true;
+        ~ReadRecordingScope() {
+            recorded_reads = previous_;
         }
-    }
 
-    std::vector<const CellInterface*> path;
-    path.push_back(start);
+        ReadRecordingScope(const ReadRecordingScope&) = delete;
+        ReadRecordingScope& operator=(const ReadRecordingScope&) = delete;
 
-    for (const Position& ref : references) {
-        const CellInterface* cur = sheet_.GetCell(ref);
-        if (cur == start) {
-            continue;
+    private:
+        std::vector<CellId>* previous_;
+    };
+
+    class ColumnBlockScope {
+    public:
+        ColumnBlockScope() {
+            in_column_block = true;
         }
-        // Запускаем DFS с depth = 1
-        if (DFS(start, cur, 1, path, sheet_)) {
-            return true;
+
+        ~ColumnBlockScope() {
+            in_column_block = false;
         }
-    }
 
-    return false;
-}
+        ColumnBlockScope(const ColumnBlockScope&) = delete;
+        ColumnBlockScope& operator=(const ColumnBlockScope&) = delete;
+    };
 
+    class EvaluationDepthScope {
+    public:
+        EvaluationDepthScope() {
+            ++evaluation_depth;
+        }
 
-void Cell::InvalidateDependentsCache() {
-    std::queue<const CellInterface*> q;
-    std::unordered_set<const CellInterface*> visited;
+        ~EvaluationDepthScope() {
+            --evaluation_depth;
+        }
 
-    q.push(this);
-    visited.insert(this);
+        EvaluationDepthScope(const EvaluationDepthScope&) = delete;
+        EvaluationDepthScope& operator=(const EvaluationDepthScope&) = delete;
+    };
+
+    // Совпадают ли значения для зависимых формул и подписчиков. 0 и -0
+    // равны, но печатаются по-разному, поэтому различаются
+    template <typename Value>
+    bool SameValue(const Value& lhs, const Value& rhs) {
+        const double* lhs_number = std::get_if<double>(&lhs);
+        const double* rhs_number = std::get_if<double>(&rhs);
+        if (lhs_number && rhs_number) {
+            return *lhs_number == *rhs_number && std::signbit(*lhs_number) == std::signbit(*rhs_number);
+        }
+        return lhs == rhs;
+    }
+}
 
-    while (!q.empty()) {
-        auto* current = q.front();
-        q.pop();
-        if (current) {
-            current->ClearCache();
+bool Cell::CircularDependencyCheck(const Cell* start, Span<const Position> references,
+    const std::vector<ExternalLink>& external_references) const {
+    SHEET_STATS(++sheet_.Stats().cycle_checks);
+
+    // Цикл появится, если start транзитивно достижим из какой-либо ячейки
+    // references. Обходим граф в обратную сторону - от start по зависимым
+    // ячейкам - и ищем среди них ячейки references. Обход итеративный, так
+    // что глубина цепочки зависимостей не ограничена стеком.
+    // Отметки и стек берутся из графа, так что проверка не выделяет память.
+    const CellGraph& graph = sheet_.Graph();
+    CellGraph::Marks targets(graph);
+    for (const Position& ref : references) {
+        if (const CellInterface* cell = sheet_.FindCell(ref)) {
+            targets.Mark(static_cast<const Cell*>(cell)->id_);
+        }
+    }
+    for (const ExternalLink& ref : external_references) {
+        if (const CellInterface* cell = ref.sheet->FindCell(ref.pos)) {
+            targets.Mark(static_cast<const Cell*>(cell)->id_);
+        }
+    }
+    if (targets.Count() == 0) {
+        return false;
+    }
+    // Самоссылка считается циклом
+    if (targets.IsMarked(start->id_)) {
+        return true;
+    }
 
-            for (const auto& dependent : static_cast<const Cell*>(current)->dependents_) {
-                if (visited.insert(dependent).second) {
-                    q.push(dependent);
-                }
+    CellGraph::Marks visited(graph);
+    std::vector<CellId>& stack = visited.Stack();
+    stack.push_back(start->id_);
+    visited.Mark(start->id_);
+    bool found = false;
+    while (!stack.empty() && !found) {
+        const CellId current = stack.back();
+        stack.pop_back();
+        for (const CellId dependent : graph.GetDependents(current)) {
+            if (targets.IsMarked(dependent)) {
+                found = true;
+                break;
+            }
+            if (visited.Mark(dependent)) {
+                stack.push_back(dependent);
             }
         }
     }
+
+    SHEET_STATS(sheet_.Stats().cycle_check_nodes_visited += visited.Count());
+    return found;
 }
 
+
 void Cell::Set(std::string text) {
+    SetImpl(std::move(text), /* check_cycles = */ true);
+}
+
+PastedCell Cell::Replace(std::string text) {
+    return SetImpl(std::move(text), /* check_cycles = */ true);
+}
+
+void Cell::SetUnchecked(std::string text) {
+    SetImpl(std::move(text), /* check_cycles = */ false);
+}
+
+PastedCell Cell::SetImpl(std::string text, bool check_cycles) {
+    // Новое содержимое строится заранее, чтобы при исключении ячейка не изменилась
+    std::unique_ptr<Impl> impl;
+    std::vector<ExternalLink> external_references;
     if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>();
-        references_.clear();
-        return;
+        impl = std::make_unique<EmptyImpl>();
+    }
+    else if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+        impl = std::make_unique<FormulaImpl>(text, sheet_, *this);
+        external_references = ResolveExternalReferences(*impl);
+        if (check_cycles && CircularDependencyCheck(this, impl->ReferencedCells(), external_references)) {
+            throw CircularDependencyException("CILCULAR DEPENDENCY FOUND");
+        }
+    }
+    else {
+        // Текст, в том числе экранированный "'" или состоящий из одного "="
+        impl = std::make_unique<TextImpl>(text, sheet_);
     }
 
-    if (text[0] == '\'') {
-        try {
-            auto temp = std::make_unique<TextImpl>(text, sheet_);
-            impl_ = std::move(temp);
+    const Span<const Position> refs = impl->ReferencedCells();
+    std::vector<Position> references(refs.begin(), refs.end());
+    // Зависимые формулы увидят новую ревизию при следующем чтении
+    return Assign(std::move(impl), std::move(references), std::move(external_references), sheet_.NextRevision());
+}
+
+PastedCell Cell::Assign(std::unique_ptr<Impl> impl, std::vector<Position> references,
+    std::vector<ExternalLink> external_references, uint64_t revision, bool link) {
+    // Прежние ссылки больше не действуют: иначе изменение ячейки, на которую
+    // формула ссылалась раньше, продолжало бы сбрасывать её кэш и мешало бы
+    // проверке циклов
+    UnlinkReferences();
+    sheet_.Memory() -= ContentMemoryUsage();
+    PastedCell old(pos_);
+    old.references = std::exchange(references_, std::move(references));
+    external_references_ = std::move(external_references);
+    // Отсечение по значению: если прежнее и новое содержимое - не формулы
+    // и значения совпадают, зависимые формулы не считают ячейку изменённой
+    const bool same_value = !dynamic_cast<const FormulaImpl*>(impl_.get())
+        && !dynamic_cast<const FormulaImpl*>(impl.get())
+        && SameValue(impl_->GetValue(), impl->GetValue());
+    std::swap(impl_, impl);
+    sheet_.Memory() += ContentMemoryUsage();
+    if (link) {
+        LinkReferences();
+    }
+    if (!same_value) {
+        changed_at_ = revision;
+    }
+
+    impl->MoveContentTo(old);
+    return old;
+}
+
+void Cell::Load(std::string text) {
+    sheet_.Memory() -= ContentMemoryUsage();
+    if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+        impl_ = std::make_unique<FormulaImpl>(text, sheet_, *this);
+        const Span<const Position> refs = impl_->ReferencedCells();
+        references_.assign(refs.begin(), refs.end());
+    }
+    else {
+        if (text.empty()) {
+            impl_ = std::make_unique<EmptyImpl>();
         }
-        catch (const std::exception&) {
-            throw;
+        else {
+            impl_ = std::make_unique<TextImpl>(text, sheet_);
         }
         references_.clear();
-        return;
     }
-     
-    // формульная ячейка
-    if (text.size() > 1 && text[0] == '=') {
-        // временный FormulaImpl, чтобы при броске ничего не менять
-        try {
-            auto temp = std::make_unique<FormulaImpl>(text, sheet_);
-            if (CircularDependencyCheck(this, temp->GetReferencedCells())) {
-                throw CircularDependencyException("CILCULAR DEPENDENCY FOUND");
-            }
-            impl_ = std::move(temp);
+    sheet_.Memory() += ContentMemoryUsage();
+}
+
+PastedCell Cell::CopyTo(Position target) const {
+    PastedCell pasted(target);
+    const auto* formula = dynamic_cast<const FormulaImpl*>(impl_.get());
+    if (!formula) {
+        pasted.text = impl_->GetText();
+        return pasted;
+    }
+
+    const int row_shift = target.row - pos_.row;
+    const int col_shift = target.col - pos_.col;
+    pasted.formula = formula->GetFormula().CloneWithOffset(row_shift, col_shift);
+    // Сдвиг сохраняет порядок ссылок; вышедшие за пределы таблицы стали #REF!
+    pasted.references.reserve(references_.size());
+    for (const Position& ref : references_) {
+        const Position shifted{ ref.row + row_shift, ref.col + col_shift };
+        if (shifted.IsValid()) {
+            pasted.references.push_back(shifted);
         }
-        catch (const std::exception&) {
-            // не меняем impl_ и зависимости
-            throw;
+    }
+    // Программа хранит смещения ссылок и у копии та же, если ссылки уцелели
+    if (pasted.references.size() == references_.size()) {
+        pasted.program = formula->GetProgram();
+    }
+    return pasted;
+}
+
+std::vector<PastedCell> Cell::CopyTo(const std::vector<Position>& targets) const {
+    std::vector<PastedCell> cells;
+    cells.reserve(targets.size());
+    const auto* formula = dynamic_cast<const FormulaImpl*>(impl_.get());
+    if (!formula) {
+        const std::string text = impl_->GetText();
+        for (const Position& target : targets) {
+            cells.emplace_back(target).text = text;
         }
-        
-        references_ = impl_->GetReferencedCells();
+        return cells;
+    }
 
-        for (const auto& p : references_) {
-            const auto cell = sheet_.GetCell(p);
-            if (!cell) {
-                sheet_.SetCell(p, "");
-            }
-            sheet_.GetCell(p)->AddDependence(this);
+    // Общее дерево не должно меняться вместе с формулой ячейки, поэтому
+    // копии делят его отдельную копию
+    const std::unique_ptr<FormulaInterface> source = ShareWithOffset(formula->GetFormula().CloneWithOffset(0, 0), 0, 0);
+    for (const Position& target : targets) {
+        PastedCell& pasted = cells.emplace_back(target);
+        pasted.formula = source->CloneWithOffset(target.row - pos_.row, target.col - pos_.col);
+        const Span<const Position> refs = pasted.formula->ReferencedCells();
+        pasted.references.assign(refs.begin(), refs.end());
+        if (pasted.references.size() == references_.size()) {
+            pasted.program = formula->GetProgram();
         }
+    }
+    return cells;
+}
 
-        InvalidateDependentsCache();
-        
-        return;
+PastedCell Cell::Paste(PastedCell&& pasted, uint64_t revision, bool link) {
+    std::unique_ptr<Impl> impl;
+    if (pasted.formula) {
+        impl = std::make_unique<FormulaImpl>(std::move(pasted.formula), std::move(pasted.program), sheet_, *this);
+    }
+    else if (pasted.text.empty()) {
+        impl = std::make_unique<EmptyImpl>();
+    }
+    else {
+        impl = std::make_unique<TextImpl>(pasted.text, sheet_);
     }
 
-    // ветка: только "=" не формула, а текст, или обычный текст без '=' в начале
-    try {
-        auto temp = std::make_unique<TextImpl>(text, sheet_);
-        impl_ = std::move(temp);
+    std::vector<ExternalLink> external_references = ResolveExternalReferences(*impl);
+    return Assign(std::move(impl), std::move(pasted.references), std::move(external_references), revision, link);
+}
+
+std::vector<Cell::ExternalLink> Cell::ResolveExternalReferences(const Impl& impl) const {
+    std::vector<ExternalLink> result;
+    for (const ExternalCell& ref : impl.ExternalReferences()) {
+        Sheet* sheet = sheet_.FindSheet(ref.sheet);
+        if (!sheet) {
+            throw FormulaException("UNKNOWN SHEET " + ref.sheet);
+        }
+        result.push_back({ sheet, ref.pos });
     }
-    catch (const std::exception&) {
-        throw;
+    return result;
+}
+
+void Cell::LinkReferences() {
+    for (const auto& p : references_) {
+        sheet_.LinkReference(p, *this);
+    }
+    for (const ExternalLink& link : external_references_) {
+        link.sheet->LinkReference(link.pos, *this);
+    }
+}
+
+void Cell::CollectReferenceEdges(std::vector<CellGraph::Edge>& edges,
+    const std::function<CellId(Sheet&, Position)>& node) const {
+    for (const auto& p : references_) {
+        edges.push_back({ node(sheet_, p), id_ });
+    }
+    for (const ExternalLink& link : external_references_) {
+        edges.push_back({ node(*link.sheet, link.pos), id_ });
+    }
+}
+
+void Cell::UnlinkReferences() {
+    for (const auto& p : references_) {
+        sheet_.UnlinkReference(p, *this);
+    }
+    for (const ExternalLink& link : external_references_) {
+        link.sheet->UnlinkReference(link.pos, *this);
+    }
+}
+
+void Cell::VisitReferencedCells(const std::function<void(const Cell&)>& visit) const {
+    const CellGraph& graph = sheet_.Graph();
+    for (const CellId ref : graph.GetReferences(id_)) {
+        if (const Cell* cell = graph.GetCell(ref)) {
+            visit(*cell);
+        }
     }
-    references_.clear();
 }
 
 CellInterface::Value Cell::GetValue() const {
+    SHEET_STATS_OUTERMOST_LATENCY(sheet_.Stats().get_value_latency);
+    if (recorded_reads) {
+        recorded_reads->push_back(id_);
+    }
     return impl_->GetValue();
 }
 
+CellInterface::Value Cell::PeekValue() const {
+    if (recorded_reads) {
+        recorded_reads->push_back(id_);
+    }
+    return impl_->PeekValue();
+}
+
 std::vector<Position> Cell::GetReferencedCells() const {
     return references_;
 }
 
+Span<const Position> Cell::ReferencedCells() const {
+    return references_;
+}
+
+void Cell::UpdateReferences(
+    const std::function<FormulaInterface::HandlingResult(FormulaInterface&)>& handle) {
+    auto* formula = dynamic_cast<FormulaImpl*>(impl_.get());
+    if (!formula) {
+        return;
+    }
+
+    const SheetMemoryUsage memory = ContentMemoryUsage();
+    const auto result = formula->UpdateReferences(handle);
+    if (result == FormulaInterface::HandlingResult::NothingChanged) {
+        return;
+    }
+    // Связи с оставшимися ячейками хранятся указателями и не меняются
+    sheet_.Memory() -= memory;
+    const Span<const Position> refs = impl_->ReferencedCells();
+    references_.assign(refs.begin(), refs.end());
+    external_references_.clear();
+    for (const ExternalCell& ref : impl_->ExternalReferences()) {
+        // Ссылки формул, загруженных из файла отдельной таблицы, не связаны
+        if (Sheet* sheet = sheet_.FindSheet(ref.sheet)) {
+            external_references_.push_back({ sheet, ref.pos });
+        }
+    }
+    sheet_.Memory() += ContentMemoryUsage();
+    if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+        changed_at_ = sheet_.NextRevision();
+    }
+}
+
+uint64_t Cell::GetChangedAt() const {
+    impl_->Refresh();
+    return changed_at_;
+}
+
+Cell::SingleCellEvaluationScope::SingleCellEvaluationScope() {
+    ++single_cell_scopes;
+}
+
+Cell::SingleCellEvaluationScope::~SingleCellEvaluationScope() {
+    --single_cell_scopes;
+}
+
 void Cell::AddDependence(const CellInterface* cell) {
-    dependents_.insert(cell);
+    sheet_.Graph().AddDependent(id_, static_cast<const Cell*>(cell)->id_);
+}
+
+void Cell::RemoveDependence(const CellInterface* cell) {
+    sheet_.Graph().RemoveDependent(id_, static_cast<const Cell*>(cell)->id_);
+}
+
+SheetMemoryUsage Cell::ContentMemoryUsage() const {
+    SheetMemoryUsage usage;
+    impl_->AddMemoryUsage(usage);
+    usage.formulas += references_.capacity() * sizeof(Position)
+        + external_references_.capacity() * sizeof(ExternalLink);
+    return usage;
 }
 
 void Cell::ClearCache() const {
@@ -140,6 +442,39 @@ std::string Cell::GetText() const {
     return impl_->GetText();
 }
 
+void Cell::PrintText(std::ostream& out) const {
+    impl_->PrintText(out);
+}
+
+Cell::Cell(Sheet& sheet, Position pos)
+    : Cell(sheet, pos, sheet.Graph().Add(nullptr)) {
+}
+
+Cell::Cell(Sheet& sheet, Position pos, CellId id)
+    : impl_(std::make_unique<EmptyImpl>()),
+    sheet_(sheet),
+    pos_(pos),
+    id_(id) {
+    sheet_.Graph().SetCell(id_, this);
+    SheetMemoryUsage& memory = sheet_.Memory();
+    memory.cells += sizeof(Cell);
+    memory += ContentMemoryUsage();
+}
+
+Cell::~Cell() {
+    SheetMemoryUsage& memory = sheet_.Memory();
+    memory.cells -= sizeof(Cell);
+    memory -= ContentMemoryUsage();
+    // Номер, перешедший к заглушке (см. Sheet::EraseCell), остаётся в графе
+    if (sheet_.Graph().GetCell(id_) == this) {
+        sheet_.Graph().Remove(id_);
+    }
+}
+
+void Cell::EmptyImpl::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.cells += sizeof(*this);
+}
+
 CellInterface::Value Cell::EmptyImpl::GetValue() const {
     return 0.0;
 }
@@ -148,14 +483,15 @@ std::string Cell::EmptyImpl::GetText() const {
     return std::string{};
 }
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const {
-    return {};
-}
-
 Cell::TextImpl::TextImpl(std::string_view text_parsed, Sheet& sheet)
     : value_(text_parsed), sheet_(sheet) {
 }
 
+void Cell::TextImpl::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.cells += sizeof(*this);
+    usage.text += StringHeapBytes(value_);
+}
+
 CellInterface::Value Cell::TextImpl::GetValue() const {
     if (value_[0] == '\'') {
         return value_.substr(1);
@@ -197,52 +533,323 @@ std::string Cell::TextImpl::GetText() const {
     return value_;
 }
 
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const {
-    return {};
+void Cell::TextImpl::MoveContentTo(PastedCell& content) {
+    content.text = std::move(value_);
 }
 
-Cell::FormulaImpl::FormulaImpl(std::string_view text_parsed, Sheet& sheet) try
-    : formula_(ParseFormula(std::string(text_parsed.substr(1)))), sheet_(sheet){
+Cell::FormulaImpl::FormulaImpl(std::string_view text_parsed, Sheet& sheet, const Cell& cell) try
+    : formula_(Parse(text_parsed, sheet)), sheet_(sheet), cell_(cell),
+    program_(formula_->CompileColumnProgram(cell.pos_, sheet.Expressions())) {
+    if (formula_->ReadsConditionally()) {
+        reads_ = std::make_unique<std::vector<CellId>>();
+    }
 }
 catch (const FormulaException&) {
     throw;
 }
 
+Cell::FormulaImpl::FormulaImpl(std::unique_ptr<FormulaInterface> formula,
+    std::shared_ptr<const ColumnProgram> program, Sheet& sheet, const Cell& cell)
+    : formula_(std::move(formula)), sheet_(sheet), cell_(cell), program_(std::move(program)) {
+    if (formula_->ReadsConditionally()) {
+        reads_ = std::make_unique<std::vector<CellId>>();
+    }
+}
+
+std::unique_ptr<FormulaInterface> Cell::FormulaImpl::Parse(std::string_view text_parsed, Sheet& sheet) {
+#if SPREADSHEET_STATS
+    const auto start = std::chrono::steady_clock::now();
+    auto formula = ParseFormula(std::string(text_parsed.substr(1)), &sheet.Expressions());
+    SheetStats& stats = sheet.Stats();
+    ++stats.formulas_parsed;
+    stats.parse_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return formula;
+#else
+    return ParseFormula(std::string(text_parsed.substr(1)), &sheet.Expressions());
+#endif
+}
+
 CellInterface::Value Cell::FormulaImpl::GetValue() const {
-    if (cache_) {
-        if (std::holds_alternative<double>(cache_.value())) {
-            return std::get<double>(cache_.value());
+    SHEET_STATS(IsUpToDate() ? ++sheet_.Stats().cache_hits : ++sheet_.Stats().cache_misses);
+    Refresh();
+    return GetCachedValue();
+}
+
+void Cell::FormulaImpl::Refresh() const {
+    if (IsUpToDate()) {
+        return;
+    }
+    if (evaluation_depth == 0) {
+        UpdateWithWorkStack();
+    }
+    else if (evaluation_depth >= MAX_EVALUATION_DEPTH) {
+        throw DeferredEvaluation{ this };
+    }
+    else {
+        Update();
+    }
+}
+
+void Cell::FormulaImpl::Update() const {
+    EvaluationDepthScope depth_scope;
+    // Ячейки, которые читает обновление (в том числе пакетное), - входы этой
+    // формулы, а не той, что её читает
+    ReadRecordingScope outer_reads_scope(nullptr);
+    const uint64_t revision = sheet_.GetRevision();
+    if (cache_ && !ReferencesChangedSince(cache_->verified_at)) {
+        SHEET_STATS(++sheet_.Stats().cache_revalidations);
+        cache_->verified_at = revision;
+        return;
+    }
+
+    if (program_ && !in_column_block && single_cell_scopes == 0 && UpdateColumnBlock()) {
+        return;
+    }
+
+    SHEET_STATS(++sheet_.Stats().evaluations);
+    ProfileScope profile_scope(sheet_.Profiler(), cell_.pos_);
+    FormulaInterface::Value value = FormulaError(FormulaError::Category::Value);
+    std::vector<CellId> reads;
+    {
+        ReadRecordingScope reads_scope(reads_ ? &reads : nullptr);
+        try {
+            value = formula_->Evaluate(sheet_);
         }
-        else if (std::holds_alternative<FormulaError>(cache_.value())) {
-            return std::get<FormulaError>(cache_.value());
+        catch (const FormulaError& er) {
+            value = er;
         }
     }
+    if (reads_) {
+        SaveReads(std::move(reads));
+    }
+    SetCache(std::move(value), revision);
+}
 
-    try {
-        auto eval_result = formula_->Evaluate(sheet_);
+void Cell::FormulaImpl::SaveReads(std::vector<CellId> reads) const {
+    // Чтение пустого места не проходит через ячейку, поэтому заглушки
+    // добавляются все: в какую бы ни превратилась ячейка, кэш это заметит
+    const CellGraph& graph = sheet_.Graph();
+    for (const CellId ref : graph.GetReferences(cell_.id_)) {
+        if (!graph.GetCell(ref)) {
+            reads.push_back(ref);
+        }
+    }
+    std::sort(reads.begin(), reads.end());
+    reads.erase(std::unique(reads.begin(), reads.end()), reads.end());
+    reads.shrink_to_fit();
+    SheetMemoryUsage& memory = sheet_.Memory();
+    memory.value_caches -= reads_->capacity() * sizeof(CellId);
+    *reads_ = std::move(reads);
+    memory.value_caches += reads_->capacity() * sizeof(CellId);
+}
 
-        cache_ = eval_result;
+bool Cell::FormulaImpl::UpdateColumnBlock() const {
+    if (program_->ReadsOwnColumn()) {
+        return false;
+    }
 
-        if (std::holds_alternative<double>(eval_result)) {
-            return std::get<double>(eval_result);
+    const Position origin = cell_.pos_;
+    std::vector<const FormulaImpl*> block{ this };
+    while (block.size() < MAX_COLUMN_BLOCK) {
+        const Position next{ origin.row + static_cast<int>(block.size()), origin.col };
+        if (next.row >= Position::MAX_ROWS) {
+            break;
         }
-        else if (std::holds_alternative<FormulaError>(eval_result)) {
-            return std::get<FormulaError>(eval_result);
+        const CellInterface* cell = sheet_.FindCell(next);
+        if (!cell) {
+            break;
         }
+        const auto* formula = dynamic_cast<const FormulaImpl*>(static_cast<const Cell*>(cell)->impl_.get());
+        if (!formula || formula->program_ != program_ || formula->IsUpToDate()) {
+            break;
+        }
+        block.push_back(formula);
+    }
+    if (block.size() < MIN_COLUMN_BLOCK) {
+        return false;
     }
-    catch (const FormulaError& er) {
-        return er;
+
+    SHEET_STATS({
+        SheetStats& stats = sheet_.Stats();
+        stats.evaluations += block.size();
+        stats.batch_evaluations += block.size();
+    });
+    ProfileScope profile_scope(sheet_.Profiler(), origin);
+
+    std::vector<std::variant<double, FormulaError>> values;
+    {
+        ColumnBlockScope block_scope;
+        values = program_->Evaluate(sheet_, origin, block.size());
     }
 
-    return FormulaError(FormulaError::Category::Value);
+    const uint64_t revision = sheet_.GetRevision();
+    for (size_t i = 0; i < block.size(); ++i) {
+        block[i]->SetCache(std::move(values[i]), revision);
+    }
+    return true;
+}
+
+void Cell::FormulaImpl::SetCache(FormulaInterface::Value value, uint64_t revision) const {
+    // Отсечение по значению: прежнее значение остаётся действительным для
+    // зависимых формул, и они лишь подтверждают свой кэш, не вычисляясь
+    if (cache_ && SameValue(cache_->value, value)) {
+        SHEET_STATS(++sheet_.Stats().unchanged_results);
+        cache_->verified_at = revision;
+        return;
+    }
+    cache_ = Cache{ std::move(value), revision };
+    cell_.changed_at_ = revision;
+}
+
+bool Cell::FormulaImpl::IsValueCurrent() const {
+    // То же условие, что проверяет Update, но без вычислений: кэш формулы
+    // действителен, если ячейки, на которые она ссылается, не менялись после
+    // его проверки, а их собственные формулы тоже действительны
+    std::vector<const FormulaImpl*> pending{ this };
+    std::unordered_set<const FormulaImpl*> visited{ this };
+    while (!pending.empty()) {
+        const FormulaImpl* formula = pending.back();
+        pending.pop_back();
+        if (!formula->cache_) {
+            return false;
+        }
+        if (formula->IsUpToDate()) {
+            continue;
+        }
+        bool changed = false;
+        formula->VisitInputs([&](const Cell& cell) {
+            if (cell.changed_at_ > formula->cache_->verified_at) {
+                changed = true;
+            }
+            const auto* ref_formula = dynamic_cast<const FormulaImpl*>(cell.impl_.get());
+            if (ref_formula && visited.insert(ref_formula).second) {
+                pending.push_back(ref_formula);
+            }
+        });
+        if (changed) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Cell::FormulaImpl::ReferencesChangedSince(uint64_t revision) const {
+    // Связи формулы берутся из графа, без поиска ячеек по позиции.
+    // Заглушка пуста с самого создания: когда в неё превращается очищенная
+    // ячейка, кэш зависимых формул сбрасывается (см. Sheet::EraseCell).
+    // Формула с условными операциями зависит лишь от прочитанного: пока оно
+    // не изменилось, вычисление выбрало бы те же ветви и дало бы то же.
+    const CellGraph& graph = sheet_.Graph();
+    auto changed = [&graph, revision](CellId ref) {
+        const Cell* cell = graph.GetCell(ref);
+        return cell && cell->GetChangedAt() > revision;
+    };
+    if (reads_) {
+        return std::any_of(reads_->begin(), reads_->end(), changed);
+    }
+    const CellGraph::EdgeRange references = graph.GetReferences(cell_.id_);
+    return std::any_of(references.begin(), references.end(), changed);
+}
+
+void Cell::FormulaImpl::VisitInputs(const std::function<void(const Cell&)>& visit) const {
+    if (!reads_) {
+        cell_.VisitReferencedCells(visit);
+        return;
+    }
+    const CellGraph& graph = sheet_.Graph();
+    for (const CellId ref : *reads_) {
+        if (const Cell* cell = graph.GetCell(ref)) {
+            visit(*cell);
+        }
+    }
+}
+
+void Cell::FormulaImpl::UpdateWithWorkStack() const {
+    std::vector<const FormulaImpl*> pending{ this };
+    while (!pending.empty()) {
+        const FormulaImpl* formula = pending.back();
+        if (formula->IsUpToDate()) {
+            pending.pop_back();
+            continue;
+        }
+        try {
+            formula->Update();
+            pending.pop_back();
+        }
+        catch (const DeferredEvaluation& deferred) {
+            // Ячейка на глубине MAX_EVALUATION_DEPTH: обновляем её отдельно,
+            // а затем повторяем прерванное обновление, которое возьмёт её из кэша
+            pending.push_back(deferred.formula);
+        }
+    }
+}
+
+CellInterface::Value Cell::FormulaImpl::GetCachedValue() const {
+    if (std::holds_alternative<double>(cache_->value)) {
+        return std::get<double>(cache_->value);
+    }
+    return std::get<FormulaError>(cache_->value);
 }
 
 std::string Cell::FormulaImpl::GetText() const {
-    return '=' + formula_->GetExpression();
+    return CachedText();
+}
+
+void Cell::FormulaImpl::PrintText(std::ostream& out) const {
+    out << CachedText();
+}
+
+const std::string& Cell::FormulaImpl::CachedText() const {
+    if (text_.empty()) {
+        text_ = '=' + formula_->GetExpression();
+        text_.shrink_to_fit();
+        sheet_.Memory().formulas += StringHeapBytes(text_);
+    }
+    return text_;
+}
+
+Span<const Position> Cell::FormulaImpl::ReferencedCells() const {
+    return formula_->ReferencedCells();
+}
+
+void Cell::FormulaImpl::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    usage.cells += sizeof(*this) - sizeof(cache_);
+    usage.value_caches += sizeof(cache_);
+    if (reads_) {
+        usage.value_caches += sizeof(*reads_) + reads_->capacity() * sizeof(CellId);
+    }
+    usage.formulas += formula_->MemoryUsage() + StringHeapBytes(text_);
+}
+
+Span<const ExternalCell> Cell::FormulaImpl::ExternalReferences() const {
+    return formula_->ExternalReferences();
+}
+
+CellInterface::Value Cell::FormulaImpl::PeekValue() const {
+    Refresh();
+    return GetCachedValue();
+}
+
+FormulaInterface::HandlingResult Cell::FormulaImpl::UpdateReferences(
+    const std::function<FormulaInterface::HandlingResult(FormulaInterface&)>& handle) {
+    const auto result = handle(*formula_);
+    if (result == FormulaInterface::HandlingResult::ReferencesChanged) {
+        cache_.reset();
+    }
+    if (result != FormulaInterface::HandlingResult::NothingChanged) {
+        // Память прежнего текста уже вычтена вызывающим Cell::UpdateReferences.
+        // Присваивание пустой строки оставило бы буфер, поэтому обмен.
+        std::string().swap(text_);
+    }
+    // Смещения ссылок зависят и от позиции самой ячейки, которая могла сдвинуться
+    program_ = formula_->CompileColumnProgram(cell_.pos_, sheet_.Expressions());
+    return result;
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
+void Cell::FormulaImpl::MoveContentTo(PastedCell& content) {
+    content.formula = std::move(formula_);
+    content.program = std::move(program_);
 }
 
 void Cell::FormulaImpl::InvalidateCache() const {
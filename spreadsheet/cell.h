@@ -2,32 +2,150 @@
 
 #include "common.h"
 #include "formula.h"
+#include "history.h"
 #include "sheet.h"
 
 #include <algorithm>
+#include <functional>
 #include <optional>
 
 class Cell : public CellInterface {
 public:
-    Cell(Sheet& sheet)
-        : impl_(std::make_unique<EmptyImpl>()),
-        sheet_(sheet){
-    }
-    ~Cell() = default;
+    Cell(Sheet& sheet, Position pos);
+    // Ячейка, которая занимает место заглушки id вместе с её зависимыми
+    Cell(Sheet& sheet, Position pos, CellId id);
+    ~Cell();
 
     void Set(std::string text) override;
 
+    // То же, что Set, но возвращает прежнее содержимое ячейки для отмены
+    // изменения
+    PastedCell Replace(std::string text);
+
+    // То же, что Set, но без проверки циклических зависимостей: формула
+    // уже была проверена ранее (например, при записи в журнал операций).
+    void SetUnchecked(std::string text);
+
+    // Задаёт содержимое без проверки циклов и регистрации зависимостей.
+    // Используется для заведомо корректных данных (например, при загрузке
+    // из файла); после загрузки всех ячеек нужно вызвать LinkReferences.
+    void Load(std::string text);
+
+    // Регистрирует ячейку как зависимую от ячеек, на которые она ссылается.
+    // Вместо отсутствующих ячеек ссылки запоминают заглушки (см.
+    // Sheet::LinkReference).
+    void LinkReferences();
+
     void Clear() override;
 
+    // Копирует содержимое ячейки для вставки в позицию target. Ссылки
+    // формулы сдвигаются на смещение target от ячейки без разбора текста.
+    PastedCell CopyTo(Position target) const;
+
+    // То же для нескольких позиций (заполнение вниз): копии формулы делят
+    // одно дерево выражения (см. ShareWithOffset)
+    std::vector<PastedCell> CopyTo(const std::vector<Position>& targets) const;
+
+    // Задаёт содержимое, скопированное CopyTo. Циклические зависимости не
+    // проверяются: таблица проверяет их сразу для всей вставки.
+    // revision - ревизия изменения, общая для всех ячеек вставки.
+    // Если link == false, зависимости не регистрируются: таблица добавляет
+    // их сразу для всей вставки (см. CollectReferenceEdges).
+    // Возвращает прежнее содержимое ячейки.
+    PastedCell Paste(PastedCell&& pasted, uint64_t revision, bool link = true);
+
+    // Дописывает в edges рёбра графа, которые зарегистрировал бы
+    // LinkReferences. Номер ячейки, на которую ссылается формула, даёт
+    // node (таблица и позиция).
+    void CollectReferenceEdges(std::vector<CellGraph::Edge>& edges,
+        const std::function<CellId(Sheet&, Position)>& node) const;
+
     Value GetValue() const override;
 
+    // Значение для формулы другой таблицы книги. В отличие от GetValue, не
+    // пополняет статистику таблицы: при параллельном пересчёте книги его
+    // читают формулы из других потоков.
+    Value PeekValue() const;
+
     std::vector<Position> GetReferencedCells() const override;
+    Span<const Position> ReferencedCells() const override;
+
+    // Передаёт в visit существующие ячейки, на которые ссылается ячейка,
+    // в том числе ячейки других таблиц книги. Заглушки пропускаются.
+    void VisitReferencedCells(const std::function<void(const Cell&)>& visit) const;
 
     void AddDependence(const CellInterface* cell) override;
 
+    void RemoveDependence(const CellInterface* cell) override;
+
+    // Пуста ли ячейка (например, в неё записан пустой текст)
+    bool IsEmpty() const {
+        return impl_->IsEmpty();
+    }
+
+    // Номер ячейки в графе зависимостей таблицы (см. Sheet::Graph)
+    CellId GetId() const {
+        return id_;
+    }
+
+    // Есть ли ячейки, ссылающиеся на текущую
+    bool HasDependents() const {
+        return !GetDependents().empty();
+    }
+
+    // Номера ячеек, которые ссылаются на текущую, в графе таблицы
+    CellGraph::EdgeRange GetDependents() const {
+        return sheet_.Graph().GetDependents(id_);
+    }
+
+    // Переносит ячейку на новую позицию при вставке и удалении строк и
+    // столбцов. Ссылки формул правятся отдельно, через UpdateReferences.
+    void MoveTo(Position pos) {
+        pos_ = pos;
+    }
+
+    // Правит ссылки формулы при вставке и удалении строк и столбцов:
+    // handle вызывает у формулы нужный Handle*-метод
+    void UpdateReferences(
+        const std::function<FormulaInterface::HandlingResult(FormulaInterface&)>& handle);
+
     void ClearCache() const override;
 
     std::string GetText() const override;
+    // Выводит текст ячейки в out без промежуточной строки
+    void PrintText(std::ostream& out) const;
+
+    Position GetPosition() const {
+        return pos_;
+    }
+
+    // Таблица, которой принадлежит ячейка
+    Sheet& GetSheet() const {
+        return sheet_;
+    }
+
+    // Ревизия таблицы, на которой значение ячейки последний раз изменилось.
+    // Значение формулы предварительно приводится к текущей ревизии.
+    uint64_t GetChangedAt() const;
+
+    // Актуально ли значение: GetValue вернёт его без вычисления формул.
+    // Ничего не вычисляет; стоимость - обход ячеек, от которых значение
+    // транзитивно зависит, до первой изменённой.
+    bool IsUpToDate() const {
+        return impl_->IsValueCurrent();
+    }
+
+    // Пока объект существует, формулы в текущем потоке вычисляются по
+    // одной, без пакетного вычисления столбцов: пакет может затронуть ячейки
+    // за пределами того, что поручено потоку (см. Workbook::Recalculate).
+    class SingleCellEvaluationScope {
+    public:
+        SingleCellEvaluationScope();
+        ~SingleCellEvaluationScope();
+
+        SingleCellEvaluationScope(const SingleCellEvaluationScope&) = delete;
+        SingleCellEvaluationScope& operator=(const SingleCellEvaluationScope&) = delete;
+    };
 
 private:
     class Impl;
@@ -36,18 +154,55 @@ private:
     // Ячейки, на которые ссылается текущая. Для формульной ячейки,
     // либо текстовой, которую можно интерпретировать как операнд
     std::vector<Position> references_;
-    // Ячейки, которые ссылаются на текущую
-    std::unordered_set<const CellInterface*> dependents_; 
+    // Ссылка на ячейку другой таблицы книги
+    struct ExternalLink {
+        Sheet* sheet;
+        Position pos;
+    };
+    // Ячейки других таблиц книги, на которые ссылается формула
+    std::vector<ExternalLink> external_references_;
 
     Sheet& sheet_;
+    Position pos_;
+    // Номер в графе зависимостей; связи с другими ячейками хранятся в графе
+    CellId id_;
+    // Ревизия таблицы, на которой значение ячейки последний раз изменилось.
+    // Для формулы обновляется при вычислении
+    mutable uint64_t changed_at_ = 0;
 
     class Impl {
     public:
         virtual ~Impl() = default;
         virtual CellInterface::Value GetValue() const = 0;
         virtual std::string GetText() const = 0;
-        virtual std::vector<Position> GetReferencedCells() const = 0;
+        // Ссылки содержимого без копирования (см. FormulaInterface::ReferencedCells)
+        virtual Span<const Position> ReferencedCells() const {
+            return {};
+        }
+        virtual Span<const ExternalCell> ExternalReferences() const {
+            return {};
+        }
+        // Значение без учёта в статистике таблицы
+        virtual CellInterface::Value PeekValue() const {
+            return GetValue();
+        }
         virtual void InvalidateCache() const = 0;
+        virtual void PrintText(std::ostream& out) const {
+            out << GetText();
+        }
+        // Приводит значение в соответствие с текущей ревизией таблицы
+        virtual void Refresh() const {}
+        // Переносит содержимое в content, когда ячейка получает новое
+        virtual void MoveContentTo(PastedCell& /* content */) {}
+        virtual bool IsEmpty() const {
+            return false;
+        }
+        // Значение не требует вычисления на текущей ревизии
+        virtual bool IsValueCurrent() const {
+            return true;
+        }
+        // Добавляет к usage память объекта содержимого, его текста и формулы
+        virtual void AddMemoryUsage(SheetMemoryUsage& usage) const = 0;
     };
 
     class EmptyImpl : public Impl {
@@ -56,9 +211,13 @@ private:
 
         std::string GetText() const override;
 
-        std::vector<Position> GetReferencedCells() const override;
-
         void InvalidateCache() const override {};
+
+        void AddMemoryUsage(SheetMemoryUsage& usage) const override;
+
+        bool IsEmpty() const override {
+            return true;
+        }
     };
 
     class TextImpl : public Impl {
@@ -70,10 +229,12 @@ private:
 
         std::string GetText() const override;
 
-        std::vector<Position> GetReferencedCells() const override;
-
         void InvalidateCache() const override {};
 
+        void MoveContentTo(PastedCell& content) override;
+
+        void AddMemoryUsage(SheetMemoryUsage& usage) const override;
+
     private:
         std::string value_;
         Sheet& sheet_;
@@ -81,27 +242,145 @@ private:
 
     class FormulaImpl : public Impl {
     public:
-        FormulaImpl(std::string_view text_parsed, Sheet& sheet);
+        FormulaImpl(std::string_view text_parsed, Sheet& sheet, const Cell& cell);
+        // Формула, уже разобранная и скомпилированная (например, скопированная)
+        FormulaImpl(std::unique_ptr<FormulaInterface> formula, std::shared_ptr<const ColumnProgram> program,
+            Sheet& sheet, const Cell& cell);
+
+        const FormulaInterface& GetFormula() const {
+            return *formula_;
+        }
+
+        const std::shared_ptr<const ColumnProgram>& GetProgram() const {
+            return program_;
+        }
 
         CellInterface::Value GetValue() const override;
 
+        // Текст формулы печатается по дереву при первом запросе и хранится
+        // до правки ссылок (см. UpdateReferences)
         std::string GetText() const override;
 
-        std::vector<Position> GetReferencedCells() const override;
+        void PrintText(std::ostream& out) const override;
+
+        Span<const Position> ReferencedCells() const override;
+
+        Span<const ExternalCell> ExternalReferences() const override;
+
+        CellInterface::Value PeekValue() const override;
 
         void InvalidateCache() const override;
 
+        void Refresh() const override;
+
+        bool IsValueCurrent() const override;
+
+        void MoveContentTo(PastedCell& content) override;
+
+        void AddMemoryUsage(SheetMemoryUsage& usage) const override;
+
+        // Применяет handle к формуле. Если ссылки стали #REF!, сбрасывает кэш;
+        // программа пакетного вычисления строится заново.
+        FormulaInterface::HandlingResult UpdateReferences(
+            const std::function<FormulaInterface::HandlingResult(FormulaInterface&)>& handle);
+
     private:
+        struct Cache {
+            FormulaInterface::Value value;
+            // Ревизия таблицы, на которой значение последний раз проверено
+            uint64_t verified_at;
+        };
+
+        bool IsUpToDate() const {
+            return cache_ && cache_->verified_at == sheet_.GetRevision();
+        }
+
+        // Проверяет кэш по ревизиям ячеек, на которые ссылается формула, и
+        // при необходимости вычисляет формулу заново. Если вложенные проверки
+        // ушли глубже MAX_EVALUATION_DEPTH, бросает DeferredEvaluation.
+        void Update() const;
+
+        // Обновляет значение с явным стеком работ: ячейки, отложенные из-за
+        // ограничения глубины, обновляются первыми, затем обновление повторяется.
+        // Так глубина стека вызовов ограничена при любой длине цепочки зависимостей.
+        void UpdateWithWorkStack() const;
+
+        // Вычисляет пакетом блок из этой и следующих ячеек столбца с той же
+        // программой (формулы, протянутые вниз), если блок достаточно велик.
+        // Возвращает false, если ячейку нужно вычислить по отдельности.
+        bool UpdateColumnBlock() const;
+
+        // Менялась ли после ревизии revision какая-либо ячейка, на которую
+        // ссылается формула. Такие ячейки предварительно обновляются.
+        bool ReferencesChangedSince(uint64_t revision) const;
+
+        // Передаёт в visit ячейки, от которых зависит кэшированное значение:
+        // все ссылки формулы либо, если она читает их по условию, те, что
+        // прочитало последнее вычисление
+        void VisitInputs(const std::function<void(const Cell&)>& visit) const;
+
+        CellInterface::Value GetCachedValue() const;
+
+        // Канонический текст "=выражение", напечатанный при необходимости
+        const std::string& CachedText() const;
+
+        // Запоминает ячейки, прочитанные вычислением формулы с условными
+        // операциями, вместе с заглушками среди её ссылок
+        void SaveReads(std::vector<CellId> reads) const;
+
+        // Запоминает вычисленное значение. Ревизия изменения ячейки
+        // сдвигается, только если значение отличается от прежнего.
+        void SetCache(FormulaInterface::Value value, uint64_t revision) const;
+
+        // Разбирает формулу, учитывая время разбора в статистике таблицы
+        static std::unique_ptr<FormulaInterface> Parse(std::string_view text_parsed, Sheet& sheet);
+
         std::unique_ptr<FormulaInterface> formula_;
         Sheet& sheet_;
-        // Кэш формульной ячейки, вычисляется в GetValue, 
-        // инвалидируется при изменении ячейки, от которой зависит экземпляр.
+        // Ячейка, которой принадлежит формула
+        const Cell& cell_;
+        // Кэш формульной ячейки, вычисляется в GetValue.
         // nullopt указывает на необходимость вычисления
-        mutable std::optional<FormulaInterface::Value> cache_;
+        mutable std::optional<Cache> cache_;
+        // Программа для пакетного вычисления, общая у одинаковых формул столбца
+        std::shared_ptr<const ColumnProgram> program_;
+        // Текст формулы; пустой, пока не запрошен
+        mutable std::string text_;
+        // Для формулы с условными операциями (FormulaInterface::ReadsConditionally) -
+        // номера ячеек, прочитанных последним вычислением, и заглушек среди
+        // ссылок; по ним проверяется кэш, так что ячейки невыбранных ветвей
+        // не вычисляются и при проверке. У остальных формул nullptr.
+        mutable std::unique_ptr<std::vector<CellId>> reads_;
     };
-    // Вспомогательная ф-я для инвалидации кэша всех зависимых ячеек
-    void InvalidateDependentsCache();
+    // Бросается, когда вложенное вычисление формул ушло слишком глубоко:
+    // ячейку нужно вычислить отдельно, начиная с пустого стека вызовов.
+    // Не является FormulaError и не перехватывается при вычислении формул.
+    struct DeferredEvaluation {
+        const FormulaImpl* formula;
+    };
+
+    // Возвращает прежнее содержимое ячейки
+    PastedCell SetImpl(std::string text, bool check_cycles);
+
+    // Заменяет содержимое и ссылки ячейки, перевязывая зависимости.
+    // Возвращает прежнее содержимое.
+    // Если link == false, новые зависимости не регистрируются (см. Paste).
+    PastedCell Assign(std::unique_ptr<Impl> impl, std::vector<Position> references,
+        std::vector<ExternalLink> external_references, uint64_t revision, bool link = true);
+
+    // Находит таблицы книги, на ячейки которых ссылается impl. Если таблицы
+    // с таким именем нет, бросает FormulaException.
+    std::vector<ExternalLink> ResolveExternalReferences(const Impl& impl) const;
+
+    // Удаляет текущую ячейку из зависимых у ячеек, на которые она ссылалась
+    void UnlinkReferences();
+
+    // Память содержимого и ссылок ячейки, которую она учитывает в счётчиках
+    // таблицы (см. Sheet::MemoryUsage): вычитается до изменения содержимого
+    // и прибавляется после него
+    SheetMemoryUsage ContentMemoryUsage() const;
 
     // Вспомогательная ф-я для поиска циклических зависимостей
-    bool CircularDependencyCheck(const Cell* start, const std::vector<Position>& references) const;
+    bool CircularDependencyCheck(const Cell* start, Span<const Position> references,
+        const std::vector<ExternalLink>& external_references) const;
 };
\ No newline at end of file
@@ -0,0 +1,260 @@
+#include "cellgraph.h"
+
+#include <algorithm>
+#include <numeric>
+
+namespace {
+    // Дельта сливается, когда в ней больше изменений, чем MIN_DELTA_EDGES
+    // и половина рёбер сжатой части: слияние стоит O(ячеек + рёбер), и его
+    // цена распределяется по изменениям
+    constexpr size_t MIN_DELTA_EDGES = 256;
+}
+
+size_t CellGraph::EdgeRange::size() const {
+    return std::distance(begin(), end());
+}
+
+CellGraph::EdgeRange CellGraph::Edges::Get(CellId id) const {
+    Span<const CellId> frozen;
+    if (id + size_t{ 1 } < offsets_.size()) {
+        frozen = { frozen_.data() + offsets_[id], offsets_[id + 1] - offsets_[id] };
+    }
+    Span<const CellId> added;
+    if (id < slots_.size() && slots_[id] != NO_SLOT) {
+        added = added_[slots_[id]];
+    }
+    return { frozen, added };
+}
+
+void CellGraph::Edges::Add(CellId from, CellId to) {
+    if (from >= slots_.size()) {
+        slots_.resize(from + size_t{ 1 }, NO_SLOT);
+    }
+    uint32_t& slot = slots_[from];
+    if (slot == NO_SLOT) {
+        if (free_slots_.empty()) {
+            slot = static_cast<uint32_t>(added_.size());
+            added_.emplace_back();
+        }
+        else {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+        }
+    }
+    added_[slot].push_back(to);
+    ++added_count_;
+}
+
+void CellGraph::Edges::Remove(CellId from, CellId to) {
+    // Сначала новые рёбра: их меньше, и недавно добавленное ребро скорее
+    // удалят снова. Порядок рёбер не важен: найденное заменяется последним.
+    if (from < slots_.size() && slots_[from] != NO_SLOT) {
+        std::vector<CellId>& added = added_[slots_[from]];
+        if (auto it = std::find(added.begin(), added.end(), to); it != added.end()) {
+            *it = added.back();
+            added.pop_back();
+            --added_count_;
+            if (added.empty()) {
+                std::vector<CellId>().swap(added);
+                free_slots_.push_back(slots_[from]);
+                slots_[from] = NO_SLOT;
+            }
+            return;
+        }
+    }
+    if (from + size_t{ 1 } < offsets_.size()) {
+        const auto begin = frozen_.begin() + offsets_[from];
+        const auto end = frozen_.begin() + offsets_[from + 1];
+        if (auto it = std::find(begin, end, to); it != end) {
+            *it = REMOVED;
+            ++removed_;
+        }
+    }
+}
+
+void CellGraph::Edges::Clear(CellId from) {
+    if (from + size_t{ 1 } < offsets_.size()) {
+        for (uint32_t i = offsets_[from]; i < offsets_[from + 1]; ++i) {
+            if (frozen_[i] != REMOVED) {
+                frozen_[i] = REMOVED;
+                ++removed_;
+            }
+        }
+    }
+    if (from < slots_.size() && slots_[from] != NO_SLOT) {
+        std::vector<CellId>& added = added_[slots_[from]];
+        added_count_ -= added.size();
+        std::vector<CellId>().swap(added);
+        free_slots_.push_back(slots_[from]);
+        slots_[from] = NO_SLOT;
+    }
+}
+
+void CellGraph::Edges::Compact(size_t count, Span<const std::pair<CellId, CellId>> extra) {
+    // Рёбра extra раскладываются по номерам подсчётом, без сортировки
+    std::vector<uint32_t> extra_offsets;
+    std::vector<CellId> extra_to(extra.size());
+    if (extra.size() > 0) {
+        extra_offsets.assign(count + 1, 0);
+        for (const auto& [from, to] : extra) {
+            ++extra_offsets[from + 1];
+        }
+        std::partial_sum(extra_offsets.begin(), extra_offsets.end(), extra_offsets.begin());
+        std::vector<uint32_t> next(extra_offsets.begin(), extra_offsets.end() - 1);
+        for (const auto& [from, to] : extra) {
+            extra_to[next[from]++] = to;
+        }
+    }
+
+    std::vector<uint32_t> offsets;
+    offsets.reserve(count + 1);
+    std::vector<CellId> frozen;
+    frozen.reserve(FrozenCount() + added_count_ + extra.size());
+    offsets.push_back(0);
+    for (CellId id = 0; id < count; ++id) {
+        for (CellId to : Get(id)) {
+            frozen.push_back(to);
+        }
+        if (!extra_offsets.empty()) {
+            frozen.insert(frozen.end(), extra_to.begin() + extra_offsets[id], extra_to.begin() + extra_offsets[id + 1]);
+        }
+        offsets.push_back(static_cast<uint32_t>(frozen.size()));
+    }
+    Reset();
+    offsets_ = std::move(offsets);
+    frozen_ = std::move(frozen);
+}
+
+void CellGraph::Edges::Reset() {
+    *this = Edges{};
+}
+
+size_t CellGraph::Edges::MemoryUsage() const {
+    size_t result = (offsets_.capacity() + slots_.capacity() + free_slots_.capacity()) * sizeof(uint32_t)
+        + frozen_.capacity() * sizeof(CellId)
+        + added_.capacity() * sizeof(std::vector<CellId>);
+    for (const std::vector<CellId>& added : added_) {
+        result += added.capacity() * sizeof(CellId);
+    }
+    return result;
+}
+
+CellId CellGraph::Add(Cell* cell) {
+    if (!free_.empty()) {
+        const CellId id = free_.back();
+        free_.pop_back();
+        cells_[id] = cell;
+        return id;
+    }
+    cells_.push_back(cell);
+    return static_cast<CellId>(cells_.size() - 1);
+}
+
+void CellGraph::Remove(CellId id) {
+    for (CellId dependent : dependents_.Get(id)) {
+        references_.Remove(dependent, id);
+    }
+    for (CellId ref : references_.Get(id)) {
+        dependents_.Remove(ref, id);
+    }
+    dependents_.Clear(id);
+    references_.Clear(id);
+    cells_[id] = nullptr;
+    free_.push_back(id);
+
+    if (CellCount() == 0) {
+        // Ячеек не осталось: память графа освобождается целиком
+        std::vector<Cell*>().swap(cells_);
+        std::vector<CellId>().swap(free_);
+        dependents_.Reset();
+        references_.Reset();
+        return;
+    }
+    MaybeCompact();
+}
+
+void CellGraph::AddDependent(CellId id, CellId dependent) {
+    dependents_.Add(id, dependent);
+    references_.Add(dependent, id);
+    MaybeCompact();
+}
+
+void CellGraph::AddDependents(const std::vector<Edge>& edges) {
+    if (DeltaEdgeCount() + edges.size() <= std::max(MIN_DELTA_EDGES, FrozenEdgeCount() / 2)) {
+        for (const Edge& edge : edges) {
+            dependents_.Add(edge.id, edge.dependent);
+            references_.Add(edge.dependent, edge.id);
+        }
+        return;
+    }
+    // Слияние всё равно случилось бы по ходу добавления: пачка сливается
+    // вместе с дельтой за один проход
+    std::vector<std::pair<CellId, CellId>> extra;
+    extra.reserve(edges.size());
+    for (const Edge& edge : edges) {
+        extra.emplace_back(edge.id, edge.dependent);
+    }
+    dependents_.Compact(cells_.size(), extra);
+    for (auto& [from, to] : extra) {
+        std::swap(from, to);
+    }
+    references_.Compact(cells_.size(), extra);
+}
+
+void CellGraph::RemoveDependent(CellId id, CellId dependent) {
+    dependents_.Remove(id, dependent);
+    references_.Remove(dependent, id);
+    MaybeCompact();
+}
+
+void CellGraph::Compact() {
+    dependents_.Compact(cells_.size());
+    references_.Compact(cells_.size());
+}
+
+void CellGraph::MaybeCompact() {
+    if (DeltaEdgeCount() > std::max(MIN_DELTA_EDGES, FrozenEdgeCount() / 2)) {
+        Compact();
+    }
+}
+
+size_t CellGraph::MemoryUsage() const {
+    return cells_.capacity() * sizeof(Cell*) + free_.capacity() * sizeof(CellId)
+        + dependents_.MemoryUsage() + references_.MemoryUsage();
+}
+
+CellGraph::Marks::Marks(const CellGraph& graph)
+    : graph_(graph) {
+    if (graph_.free_marks_.empty()) {
+        array_ = std::make_unique<Array>();
+    }
+    else {
+        array_ = std::move(graph_.free_marks_.back());
+        graph_.free_marks_.pop_back();
+    }
+    if (++array_->stamp == 0) {
+        // Номера обходов исчерпаны: старые отметки стираются явно
+        std::fill(array_->stamps.begin(), array_->stamps.end(), 0);
+        array_->stamp = 1;
+    }
+    if (array_->stamps.size() < graph_.cells_.size()) {
+        array_->stamps.resize(graph_.cells_.size(), 0);
+    }
+    array_->stack.clear();
+}
+
+CellGraph::Marks::~Marks() {
+    graph_.free_marks_.push_back(std::move(array_));
+}
+
+bool CellGraph::Marks::Mark(CellId id) {
+    if (id >= array_->stamps.size()) {
+        array_->stamps.resize(graph_.cells_.size(), 0);
+    }
+    if (array_->stamps[id] == array_->stamp) {
+        return false;
+    }
+    array_->stamps[id] = array_->stamp;
+    ++count_;
+    return true;
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+class Cell;
+
+// Номер ячейки в графе зависимостей
+using CellId = uint32_t;
+
+// Граф зависимостей ячеек. Ячейки получают плотные 32-битные номера, а
+// рёбра обоих направлений - ссылки ячейки и ячейки, ссылающиеся на неё, -
+// хранятся массивами номеров. Номера удалённых ячеек выдаются повторно,
+// так что массивы не растут от перезаписи таблицы. У таблиц книги граф
+// общий, как и счётчик ревизий: ссылки идут через таблицы.
+//
+// Рёбра лежат в сжатых строках (CSR): общий массив номеров и смещения
+// начала рёбер каждой ячейки. Изменения после сжатия идут в дельту:
+// новые рёбра - в небольшие списки ячеек, удалённые рёбра сжатой части
+// помечаются на месте. Compact сливает дельту со сжатой частью; таблица
+// вызывает его после массовой загрузки, а граф - сам, когда дельта
+// вырастает сравнимо со сжатой частью.
+class CellGraph {
+public:
+    // Рёбра одной ячейки: сжатая часть без удалённых и новые из дельты
+    class EdgeRange {
+    public:
+        class Iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = CellId;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const CellId*;
+            using reference = const CellId&;
+
+            const CellId& operator*() const {
+                return *current_;
+            }
+
+            Iterator& operator++() {
+                ++current_;
+                Skip();
+                return *this;
+            }
+
+            Iterator operator++(int) {
+                Iterator result = *this;
+                ++*this;
+                return result;
+            }
+
+            bool operator==(const Iterator& rhs) const {
+                return current_ == rhs.current_;
+            }
+
+            bool operator!=(const Iterator& rhs) const {
+                return current_ != rhs.current_;
+            }
+
+        private:
+            friend class EdgeRange;
+
+            Iterator(const CellId* current, bool in_frozen, const EdgeRange& range)
+                : current_(current)
+                , frozen_end_(range.frozen_.end())
+                , added_begin_(range.added_.empty() ? nullptr : range.added_.begin())
+                , in_frozen_(in_frozen) {
+                Skip();
+            }
+
+            // Пропускает удалённые рёбра и переходит от сжатой части к дельте
+            void Skip() {
+                if (!in_frozen_) {
+                    return;
+                }
+                while (current_ != frozen_end_ && *current_ == REMOVED) {
+                    ++current_;
+                }
+                if (current_ == frozen_end_ && added_begin_) {
+                    current_ = added_begin_;
+                    in_frozen_ = false;
+                }
+            }
+
+            const CellId* current_;
+            const CellId* frozen_end_;
+            // nullptr, если новых рёбер нет
+            const CellId* added_begin_;
+            bool in_frozen_;
+        };
+
+        EdgeRange(Span<const CellId> frozen, Span<const CellId> added)
+            : frozen_(frozen)
+            , added_(added) {
+        }
+
+        Iterator begin() const {
+            if (!frozen_.empty()) {
+                return Iterator(frozen_.begin(), true, *this);
+            }
+            return added_.empty() ? end() : Iterator(added_.begin(), false, *this);
+        }
+
+        Iterator end() const {
+            return added_.empty() ? Iterator(frozen_.end(), true, *this)
+                                  : Iterator(added_.end(), false, *this);
+        }
+
+        bool empty() const {
+            return begin() == end();
+        }
+
+        // Число рёбер; проходит по ним
+        size_t size() const;
+
+    private:
+        Span<const CellId> frozen_;
+        Span<const CellId> added_;
+    };
+
+    CellGraph() = default;
+
+    CellGraph(const CellGraph&) = delete;
+    CellGraph& operator=(const CellGraph&) = delete;
+    CellGraph(CellGraph&&) = default;
+    CellGraph& operator=(CellGraph&&) = default;
+
+    // Выдаёт номер ячейке cell. Номер с cell == nullptr - заглушка: место,
+    // на которое ссылаются формулы, но ячейки в нём нет (см. Sheet::LinkReference)
+    CellId Add(Cell* cell);
+    // Освобождает номер вместе со всеми рёбрами ячейки
+    void Remove(CellId id);
+
+    // Ячейка с номером id; nullptr у заглушки
+    Cell* GetCell(CellId id) const {
+        return cells_[id];
+    }
+
+    // Передаёт номер id вместе с рёбрами ячейке cell или, если cell ==
+    // nullptr, заглушке
+    void SetCell(CellId id, Cell* cell) {
+        cells_[id] = cell;
+    }
+
+    // Ячейки, ссылающиеся на id, в произвольном порядке. Действителен до
+    // следующего изменения графа.
+    EdgeRange GetDependents(CellId id) const {
+        return dependents_.Get(id);
+    }
+
+    // Ячейки, на которые ссылается id, в произвольном порядке
+    EdgeRange GetReferences(CellId id) const {
+        return references_.Get(id);
+    }
+
+    // Ребро "dependent ссылается на id". Каждое ребро добавляется один раз:
+    // повторы не отсекаются.
+    void AddDependent(CellId id, CellId dependent);
+    void RemoveDependent(CellId id, CellId dependent);
+
+    struct Edge {
+        CellId id;
+        CellId dependent;
+    };
+    // Добавляет рёбра пачкой (вставка диапазона). Пачка, сравнимая со
+    // сжатой частью, сливается с ней сразу, минуя дельту.
+    void AddDependents(const std::vector<Edge>& edges);
+
+    // Сливает дельту со сжатой частью
+    void Compact();
+
+    // Число рёбер сжатой части и изменений в дельте (новых и удалённых)
+    // по обоим направлениям
+    size_t FrozenEdgeCount() const {
+        return dependents_.FrozenCount() + references_.FrozenCount();
+    }
+    size_t DeltaEdgeCount() const {
+        return dependents_.DeltaCount() + references_.DeltaCount();
+    }
+
+    // Число ячеек и заглушек с номерами
+    size_t CellCount() const {
+        return cells_.size() - free_.size();
+    }
+
+    // Память графа в байтах
+    size_t MemoryUsage() const;
+
+    // Отметки ячеек на время одного обхода графа. Хранятся массивом по
+    // номеру ячейки вместе с номером обхода: новый обход снимает прежние
+    // отметки за O(1), а массив берётся из графа повторно, так что обход не
+    // выделяет память. Обходы могут быть вложенными.
+    class Marks {
+    public:
+        explicit Marks(const CellGraph& graph);
+        ~Marks();
+
+        Marks(const Marks&) = delete;
+        Marks& operator=(const Marks&) = delete;
+
+        // Отмечает id; false, если он уже отмечен
+        bool Mark(CellId id);
+
+        bool IsMarked(CellId id) const {
+            return id < array_->stamps.size() && array_->stamps[id] == array_->stamp;
+        }
+
+        // Число отмеченных ячеек
+        size_t Count() const {
+            return count_;
+        }
+
+        // Стек обхода, который переиспользуется вместе с отметками.
+        // В начале обхода пуст.
+        std::vector<CellId>& Stack() {
+            return array_->stack;
+        }
+
+    private:
+        struct Array {
+            std::vector<uint32_t> stamps;
+            uint32_t stamp = 0;
+            std::vector<CellId> stack;
+        };
+        friend class CellGraph;
+
+        const CellGraph& graph_;
+        std::unique_ptr<Array> array_;
+        size_t count_ = 0;
+    };
+
+private:
+    // Метка удалённого ребра в сжатой части
+    static constexpr CellId REMOVED = UINT32_MAX;
+
+    // Рёбра одного направления
+    class Edges {
+    public:
+        EdgeRange Get(CellId id) const;
+        void Add(CellId from, CellId to);
+        void Remove(CellId from, CellId to);
+        // Удаляет все рёбра from
+        void Clear(CellId from);
+        // Сливает дельту и рёбра extra (откуда, куда) со сжатой частью;
+        // count - граница номеров ячеек
+        void Compact(size_t count, Span<const std::pair<CellId, CellId>> extra = {});
+        // Забывает все рёбра и освобождает память
+        void Reset();
+
+        size_t FrozenCount() const {
+            return frozen_.size() - removed_;
+        }
+        size_t DeltaCount() const {
+            return added_count_ + removed_;
+        }
+        size_t MemoryUsage() const;
+
+    private:
+        static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+        // Сжатая часть: рёбра номера i - frozen_[offsets_[i]..offsets_[i + 1])
+        std::vector<uint32_t> offsets_;
+        std::vector<CellId> frozen_;
+        size_t removed_ = 0;
+        // Дельта: номер списка новых рёбер у каждого номера ячейки (NO_SLOT,
+        // если новых рёбер нет) и сами списки
+        std::vector<uint32_t> slots_;
+        std::vector<std::vector<CellId>> added_;
+        std::vector<uint32_t> free_slots_;
+        size_t added_count_ = 0;
+    };
+
+    // Сливает дельту, если она выросла сравнимо со сжатой частью
+    void MaybeCompact();
+
+    std::vector<Cell*> cells_;
+    // Освобождённые номера
+    std::vector<CellId> free_;
+    Edges dependents_;
+    Edges references_;
+    // Массивы отметок, не занятые обходами
+    mutable std::vector<std::unique_ptr<Marks::Array>> free_marks_;
+};
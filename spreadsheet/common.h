@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -8,6 +9,53 @@
 #include <variant>
 #include <vector>
 
+// Непрерывный диапазон элементов, которыми span не владеет (как std::span
+// из C++20). Действителен, пока жив и не меняется владелец элементов.
+template <typename T>
+class Span {
+public:
+    Span() = default;
+
+    Span(T* data, size_t size)
+        : data_(data)
+        , size_(size) {
+    }
+
+    template <typename Container>
+    Span(Container& container)
+        : data_(container.data())
+        , size_(container.size()) {
+    }
+
+    T* begin() const {
+        return data_;
+    }
+
+    T* end() const {
+        return data_ + size_;
+    }
+
+    T* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    T& operator[](size_t index) const {
+        return data_[index];
+    }
+
+private:
+    T* data_ = nullptr;
+    size_t size_ = 0;
+};
+
 // Позиция ячейки. Индексация с нуля.
 struct Position {
     int row = 0;
@@ -88,6 +136,26 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Исключение, выбрасываемое при попытке вставить строки или столбцы, если
+// ячейки таблицы после сдвига вышли бы за допустимые пределы
+class TableTooBigException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Исключение, выбрасываемое при попытке добавить в книгу таблицу с
+// некорректным или уже занятым именем
+class InvalidSheetNameException : public std::invalid_argument {
+public:
+    using std::invalid_argument::invalid_argument;
+};
+
+// Исключение, выбрасываемое при ошибке чтения или записи файла таблицы
+class SheetFileException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -113,12 +181,19 @@ public:
     // Указывает зависимость ячейки от другой
     virtual void AddDependence(const CellInterface* cell) = 0;
 
+    // Снимает зависимость, добавленную AddDependence
+    virtual void RemoveDependence(const CellInterface* cell) = 0;
+
     virtual void ClearCache() const = 0;
 
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Тот же список без копирования: действителен до следующего изменения
+    // ячейки. Для обходов графа зависимостей, которые не должны выделять память.
+    virtual Span<const Position> ReferencedCells() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -149,6 +224,12 @@ public:
     virtual const CellInterface* GetCell(Position pos) const = 0;
     virtual CellInterface* GetCell(Position pos) = 0;
 
+    // Ячейка pos, если она задана. В отличие от GetCell, не создаёт объекта
+    // для пустой ячейки: так формулы читают значения ячеек.
+    virtual const CellInterface* FindCell(Position pos) const {
+        return GetCell(pos);
+    }
+
     // Очищает ячейку.
     // Последующий вызов GetCell() для этой ячейки вернёт либо nullptr, либо
     // объект с пустым текстом.
@@ -165,13 +246,20 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
-};
-// Алгоритм поиска циклических зависимостей
-bool DFS(const CellInterface* start,
-    const CellInterface* cur,
-    int depth,
-    std::vector<const CellInterface*>& path,
-    const SheetInterface& sheet);
 
+    // Значение ячейки pos таблицы sheet_name из той же книги, для ссылок
+    // вида Sheet2!A1 в формулах. У отдельной таблицы других таблиц нет.
+    virtual CellInterface::Value GetExternalValue(std::string_view /* sheet_name */, Position /* pos */) const {
+        return FormulaError(FormulaError::Category::Ref);
+    }
+};
 // Создаёт готовую к работе пустую таблицу.
-std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
+std::unique_ptr<SheetInterface> CreateSheet();
+
+// Сохраняет непустые ячейки таблицы в файл.
+void SaveSheet(const SheetInterface& sheet, const std::string& path);
+
+// Открывает таблицу из файла, созданного SaveSheet. Файл отображается в
+// память, а ячейки и их формулы создаются лишь при первом обращении к ним
+// (или к зависящим от них ячейкам) через GetCell/GetValue.
+std::unique_ptr<SheetInterface> OpenSheet(const std::string& path);
\ No newline at end of file
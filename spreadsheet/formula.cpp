@@ -8,15 +8,57 @@
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, const FormulaError& fe) {
-    return output << "#ARITHM!";
+    switch (fe.GetCategory()) {
+    case FormulaError::Category::Ref:
+        return output << "#REF!";
+    case FormulaError::Category::Value:
+        return output << "#VALUE!";
+    case FormulaError::Category::Arithmetic:
+        return output << "#ARITHM!";
+    }
+    return output;
 }
-Formula::Formula(std::string expression) try
+Formula::Formula(std::string expression, ExpressionPool* pool) try
     :ast_(ParseFormulaAST(expression)) {
+    if (pool) {
+        ast_.Share(*pool);
+    }
+    CollectReferences();
 }
 catch (const std::exception&) {
     throw FormulaException("INCORRECT FORMULA");
 }
 
+Formula::Formula(FormulaAST ast)
+    : ast_(std::move(ast)) {
+    CollectReferences();
+}
+
+void Formula::CollectReferences() {
+    // Ссылки на удалённые ячейки (#REF!) не учитываются
+    referenced_.clear();
+    for (const Position& pos : ast_.GetCells()) {
+        if (pos.IsValid()) {
+            referenced_.push_back(pos);
+        }
+    }
+    std::sort(referenced_.begin(), referenced_.end());
+    referenced_.erase(std::unique(referenced_.begin(), referenced_.end()), referenced_.end());
+    referenced_.shrink_to_fit();
+
+    external_referenced_.clear();
+    for (const ExternalCell& cell : ast_.GetExternalCells()) {
+        if (cell.pos.IsValid()) {
+            external_referenced_.push_back(cell);
+        }
+    }
+    std::sort(external_referenced_.begin(), external_referenced_.end());
+    external_referenced_.erase(
+        std::unique(external_referenced_.begin(), external_referenced_.end()),
+        external_referenced_.end());
+    external_referenced_.shrink_to_fit();
+}
+
 FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet) const {
     double result = 0.0;
     try {
@@ -35,19 +77,209 @@ std::string Formula::GetExpression() const {
 }
 
 std::vector<Position> Formula::GetReferencedCells() const {
-    const std::forward_list<Position>& cells = ast_.GetCells();
-    std::vector<Position> result;
-    std::unordered_set<Position> seen;
+    return referenced_;
+}
 
-    for (const auto& x : cells) {
-        if (seen.insert(x).second) {  // если элемент новый
-            result.push_back(x);
-        }
+std::vector<ExternalCell> Formula::GetExternalReferences() const {
+    return external_referenced_;
+}
+
+Span<const Position> Formula::ReferencedCells() const {
+    return referenced_;
+}
+
+Span<const ExternalCell> Formula::ExternalReferences() const {
+    return external_referenced_;
+}
+
+bool Formula::ReadsConditionally() const {
+    return ast_.ReadsConditionally();
+}
+
+Formula::HandlingResult Formula::HandleInsertedRows(int before, int count, std::string_view sheet) {
+    const HandlingResult result = ast_.HandleInsertedRows(before, count, sheet);
+    if (result != HandlingResult::NothingChanged) {
+        CollectReferences();
+    }
+    return result;
+}
+
+Formula::HandlingResult Formula::HandleInsertedCols(int before, int count, std::string_view sheet) {
+    const HandlingResult result = ast_.HandleInsertedCols(before, count, sheet);
+    if (result != HandlingResult::NothingChanged) {
+        CollectReferences();
+    }
+    return result;
+}
+
+Formula::HandlingResult Formula::HandleDeletedRows(int first, int count, std::string_view sheet) {
+    const HandlingResult result = ast_.HandleDeletedRows(first, count, sheet);
+    if (result != HandlingResult::NothingChanged) {
+        CollectReferences();
+    }
+    return result;
+}
+
+Formula::HandlingResult Formula::HandleDeletedCols(int first, int count, std::string_view sheet) {
+    const HandlingResult result = ast_.HandleDeletedCols(first, count, sheet);
+    if (result != HandlingResult::NothingChanged) {
+        CollectReferences();
+    }
+    return result;
+}
+
+std::unique_ptr<FormulaInterface> Formula::CloneWithOffset(int row_shift, int col_shift) const {
+    return std::make_unique<Formula>(ast_.Offset(row_shift, col_shift));
+}
+
+std::shared_ptr<const ColumnProgram> Formula::CompileColumnProgram(
+    Position origin, ExpressionPool& pool) const {
+    return ast_.CompileColumnProgram(origin, pool);
+}
+
+size_t Formula::MemoryUsage() const {
+    return sizeof(*this) - sizeof(ast_) + ast_.MemoryUsage()
+        + referenced_.capacity() * sizeof(Position)
+        + external_referenced_.capacity() * sizeof(ExternalCell);
+}
+
+OffsetFormula::OffsetFormula(std::shared_ptr<const FormulaInterface> source, int row_shift, int col_shift)
+    : source_(std::move(source))
+    , row_shift_(row_shift)
+    , col_shift_(col_shift)
+    , source_memory_(source_->MemoryUsage()) {
+    ShiftReferences(source_->ReferencedCells(), source_->ExternalReferences());
+}
+
+OffsetFormula::OffsetFormula(const OffsetFormula& base, int row_shift, int col_shift)
+    : source_(base.source_)
+    , row_shift_(row_shift)
+    , col_shift_(col_shift)
+    , source_memory_(base.source_memory_) {
+    ShiftReferences(base.referenced_, base.external_referenced_);
+    row_shift_ += base.row_shift_;
+    col_shift_ += base.col_shift_;
+}
+
+void OffsetFormula::ShiftReferences(Span<const Position> refs, Span<const ExternalCell> external_refs) {
+    // Сдвиг сохраняет порядок ссылок; выход за пределы таблицы проверен
+    // заранее (см. CloneWithOffset)
+    referenced_.reserve(refs.size());
+    for (const Position& pos : refs) {
+        referenced_.push_back({ pos.row + row_shift_, pos.col + col_shift_ });
+    }
+    external_referenced_.reserve(external_refs.size());
+    for (const ExternalCell& cell : external_refs) {
+        external_referenced_.push_back({ cell.sheet, { cell.pos.row + row_shift_, cell.pos.col + col_shift_ } });
     }
+}
+
+FormulaInterface& OffsetFormula::Materialized() const {
+    if (!copy_) {
+        copy_ = source_->CloneWithOffset(row_shift_, col_shift_);
+    }
+    return *copy_;
+}
+
+FormulaInterface::Value OffsetFormula::Evaluate(const SheetInterface& sheet) const {
+    return Materialized().Evaluate(sheet);
+}
 
+std::string OffsetFormula::GetExpression() const {
+    return Materialized().GetExpression();
+}
+
+std::vector<Position> OffsetFormula::GetReferencedCells() const {
+    const Span<const Position> refs = ReferencedCells();
+    return { refs.begin(), refs.end() };
+}
+
+std::vector<ExternalCell> OffsetFormula::GetExternalReferences() const {
+    const Span<const ExternalCell> refs = ExternalReferences();
+    return { refs.begin(), refs.end() };
+}
+
+Span<const Position> OffsetFormula::ReferencedCells() const {
+    return source_ ? Span<const Position>(referenced_) : copy_->ReferencedCells();
+}
+
+Span<const ExternalCell> OffsetFormula::ExternalReferences() const {
+    return source_ ? Span<const ExternalCell>(external_referenced_) : copy_->ExternalReferences();
+}
+
+bool OffsetFormula::ReadsConditionally() const {
+    return source_ ? source_->ReadsConditionally() : copy_->ReadsConditionally();
+}
+
+OffsetFormula::HandlingResult OffsetFormula::Handle(
+    const std::function<HandlingResult(FormulaInterface&)>& handle) {
+    const HandlingResult result = handle(Materialized());
+    // Поправленное дерево больше не совпадает со сдвинутым общим
+    if (result != HandlingResult::NothingChanged) {
+        source_.reset();
+        referenced_ = {};
+        external_referenced_ = {};
+    }
     return result;
 }
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+OffsetFormula::HandlingResult OffsetFormula::HandleInsertedRows(int before, int count, std::string_view sheet) {
+    return Handle([&](FormulaInterface& formula) {
+        return formula.HandleInsertedRows(before, count, sheet);
+    });
+}
+
+OffsetFormula::HandlingResult OffsetFormula::HandleInsertedCols(int before, int count, std::string_view sheet) {
+    return Handle([&](FormulaInterface& formula) {
+        return formula.HandleInsertedCols(before, count, sheet);
+    });
+}
+
+OffsetFormula::HandlingResult OffsetFormula::HandleDeletedRows(int first, int count, std::string_view sheet) {
+    return Handle([&](FormulaInterface& formula) {
+        return formula.HandleDeletedRows(first, count, sheet);
+    });
+}
+
+OffsetFormula::HandlingResult OffsetFormula::HandleDeletedCols(int first, int count, std::string_view sheet) {
+    return Handle([&](FormulaInterface& formula) {
+        return formula.HandleDeletedCols(first, count, sheet);
+    });
+}
+
+std::unique_ptr<FormulaInterface> OffsetFormula::CloneWithOffset(int row_shift, int col_shift) const {
+    if (!source_) {
+        return copy_->CloneWithOffset(row_shift, col_shift);
+    }
+    const auto valid = [&](Position pos) {
+        return Position{ pos.row + row_shift, pos.col + col_shift }.IsValid();
+    };
+    if (!std::all_of(referenced_.begin(), referenced_.end(), valid)
+        || !std::all_of(external_referenced_.begin(), external_referenced_.end(),
+            [&](const ExternalCell& cell) { return valid(cell.pos); })) {
+        return source_->CloneWithOffset(row_shift_ + row_shift, col_shift_ + col_shift);
+    }
+    return std::make_unique<OffsetFormula>(*this, row_shift, col_shift);
+}
+
+std::shared_ptr<const ColumnProgram> OffsetFormula::CompileColumnProgram(
+    Position origin, ExpressionPool& pool) const {
+    // Программа хранит смещения ссылок от ячейки и у общей формулы та же
+    if (source_) {
+        return source_->CompileColumnProgram({ origin.row - row_shift_, origin.col - col_shift_ }, pool);
+    }
+    return copy_->CompileColumnProgram(origin, pool);
+}
+
+size_t OffsetFormula::MemoryUsage() const {
+    return source_ ? source_memory_ : copy_->MemoryUsage();
+}
+
+std::unique_ptr<FormulaInterface> ShareWithOffset(
+    std::shared_ptr<const FormulaInterface> source, int row_shift, int col_shift) {
+    return OffsetFormula(std::move(source), 0, 0).CloneWithOffset(row_shift, col_shift);
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, ExpressionPool* pool) {
+    return std::make_unique<Formula>(std::move(expression), pool);
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "common.h"
 #include "FormulaAST.h"
 
+#include <functional>
 #include <memory>
 #include <vector>
 
@@ -10,12 +11,17 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Сравнения =, <>, <, <=, >, >= (истина - 1, ложь - 0): A1<=B1
+// * Условные функции IF(условие,да[,нет]), AND(...), OR(...),
+//   IFERROR(значение,запасное): IF(A1>0,B1,C1). Аргументы вычисляются лишь
+//   при необходимости.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
+    using HandlingResult = FormulaAST::HandlingResult;
 
     virtual ~FormulaInterface() = default;
 
@@ -35,12 +41,53 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Ссылки на ячейки других таблиц книги (Sheet2!A1), отсортированные и без
+    // повторов. Ссылки, ставшие #REF!, не входят.
+    virtual std::vector<ExternalCell> GetExternalReferences() const = 0;
+
+    // Те же списки без копирования. Они строятся один раз при разборе и
+    // после правки ссылок; span действителен до следующей правки формулы.
+    virtual Span<const Position> ReferencedCells() const = 0;
+    virtual Span<const ExternalCell> ExternalReferences() const = 0;
+
+    // Читает ли вычисление лишь часть ссылок, в зависимости от значений
+    // (формула с IF, AND, OR, IFERROR; см. FormulaAST::ReadsConditionally)
+    virtual bool ReadsConditionally() const = 0;
+
+    // Правят ссылки формулы после вставки count строк (столбцов) перед
+    // строкой (столбцом) before или удаления count строк (столбцов), начиная
+    // с first. Ссылки на удалённые ячейки становятся #REF!. Формула не
+    // разбирается заново. Если задано sheet, строки вставлены в другую
+    // таблицу книги с этим именем, и правятся лишь ссылки на неё.
+    virtual HandlingResult HandleInsertedRows(int before, int count = 1, std::string_view sheet = {}) = 0;
+    virtual HandlingResult HandleInsertedCols(int before, int count = 1, std::string_view sheet = {}) = 0;
+    virtual HandlingResult HandleDeletedRows(int first, int count = 1, std::string_view sheet = {}) = 0;
+    virtual HandlingResult HandleDeletedCols(int first, int count = 1, std::string_view sheet = {}) = 0;
+
+    // Копия формулы, перенесённой на row_shift строк и col_shift столбцов:
+    // все ссылки сдвигаются на то же смещение (как при копировании ячейки).
+    // Ссылки, вышедшие за пределы таблицы, становятся #REF!.
+    virtual std::unique_ptr<FormulaInterface> CloneWithOffset(int row_shift, int col_shift) const = 0;
+
+    // Программа пакетного вычисления формулы, записанной в ячейку origin,
+    // вместе с такими же формулами соседних строк (см. ColumnProgram).
+    // Одинаковые программы берутся из пула, поэтому их можно сравнивать
+    // по указателю. nullptr, если формулу нельзя вычислять пакетно.
+    virtual std::shared_ptr<const ColumnProgram> CompileColumnProgram(
+        Position origin, ExpressionPool& pool) const = 0;
+
+    // Память, занятая формулой, в байтах (см. FormulaAST::MemoryUsage)
+    virtual size_t MemoryUsage() const = 0;
 };
 
 namespace {
     class Formula : public FormulaInterface {
     public:
-        explicit Formula(std::string expression);
+        // Если передан pool, формула вычисляется через общие подвыражения пула
+        explicit Formula(std::string expression, ExpressionPool* pool = nullptr);
+        // Формула из готового дерева, без разбора текста
+        explicit Formula(FormulaAST ast);
 
         Value Evaluate(const SheetInterface& sheet) const override;
 
@@ -48,11 +95,106 @@ namespace {
 
         std::vector<Position> GetReferencedCells() const override;
 
+        std::vector<ExternalCell> GetExternalReferences() const override;
+
+        Span<const Position> ReferencedCells() const override;
+        Span<const ExternalCell> ExternalReferences() const override;
+
+        bool ReadsConditionally() const override;
+
+        HandlingResult HandleInsertedRows(int before, int count = 1, std::string_view sheet = {}) override;
+        HandlingResult HandleInsertedCols(int before, int count = 1, std::string_view sheet = {}) override;
+        HandlingResult HandleDeletedRows(int first, int count = 1, std::string_view sheet = {}) override;
+        HandlingResult HandleDeletedCols(int first, int count = 1, std::string_view sheet = {}) override;
+
+        std::unique_ptr<FormulaInterface> CloneWithOffset(int row_shift, int col_shift) const override;
+
+        std::shared_ptr<const ColumnProgram> CompileColumnProgram(
+            Position origin, ExpressionPool& pool) const override;
+
+        size_t MemoryUsage() const override;
+
     private:
+        // Перестраивает списки ссылок по дереву
+        void CollectReferences();
+
         FormulaAST ast_;
+        // Действительные ссылки дерева, отсортированные и без повторов
+        std::vector<Position> referenced_;
+        std::vector<ExternalCell> external_referenced_;
+    };
+
+    // Копия формулы source, перенесённая на row_shift строк и col_shift
+    // столбцов (см. ShareWithOffset). Дерево выражения не копируется: копия
+    // хранит лишь сдвинутые списки ссылок. Своё дерево строится при первой
+    // надобности - для вычисления, текста или правки ссылок.
+    class OffsetFormula : public FormulaInterface {
+    public:
+        OffsetFormula(std::shared_ptr<const FormulaInterface> source, int row_shift, int col_shift);
+        // Копия base, перенесённая ещё на row_shift строк и col_shift столбцов.
+        // Ссылки base должны остаться в пределах таблицы.
+        OffsetFormula(const OffsetFormula& base, int row_shift, int col_shift);
+
+        Value Evaluate(const SheetInterface& sheet) const override;
+
+        std::string GetExpression() const override;
+
+        std::vector<Position> GetReferencedCells() const override;
+
+        std::vector<ExternalCell> GetExternalReferences() const override;
+
+        Span<const Position> ReferencedCells() const override;
+        Span<const ExternalCell> ExternalReferences() const override;
+
+        bool ReadsConditionally() const override;
+
+        HandlingResult HandleInsertedRows(int before, int count = 1, std::string_view sheet = {}) override;
+        HandlingResult HandleInsertedCols(int before, int count = 1, std::string_view sheet = {}) override;
+        HandlingResult HandleDeletedRows(int first, int count = 1, std::string_view sheet = {}) override;
+        HandlingResult HandleDeletedCols(int first, int count = 1, std::string_view sheet = {}) override;
+
+        std::unique_ptr<FormulaInterface> CloneWithOffset(int row_shift, int col_shift) const override;
+
+        std::shared_ptr<const ColumnProgram> CompileColumnProgram(
+            Position origin, ExpressionPool& pool) const override;
+
+        size_t MemoryUsage() const override;
+
+    private:
+        // Сдвигает ссылки на row_shift строк и col_shift столбцов
+        void ShiftReferences(Span<const Position> refs, Span<const ExternalCell> external_refs);
+
+        // Своё дерево формулы, построенное из общего
+        FormulaInterface& Materialized() const;
+        // Правит ссылки своего дерева; если они изменились, общая формула
+        // больше не нужна
+        HandlingResult Handle(const std::function<HandlingResult(FormulaInterface&)>& handle);
+
+        // Общая формула; nullptr после правки ссылок, когда формула
+        // целиком представлена своим деревом
+        std::shared_ptr<const FormulaInterface> source_;
+        int row_shift_ = 0;
+        int col_shift_ = 0;
+        // Память общей формулы: копия занимает столько же, сколько
+        // отдельная формула, и счётчики памяти не зависят от того, построено
+        // ли своё дерево
+        size_t source_memory_ = 0;
+        mutable std::unique_ptr<FormulaInterface> copy_;
+        std::vector<Position> referenced_;
+        std::vector<ExternalCell> external_referenced_;
     };
 }
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+// Если передан pool, одинаковые подвыражения разных формул вычисляются
+// один раз (см. ExpressionPool).
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, ExpressionPool* pool = nullptr);
+
+// Копия формулы source, перенесённая на row_shift строк и col_shift столбцов,
+// как CloneWithOffset, но с общим деревом выражения: так заполнение вниз
+// копирует одну формулу во много ячеек, не строя дерево для каждой. Если
+// какая-то ссылка выходит за пределы таблицы, копия строится сразу.
+// CloneWithOffset такой копии тоже делит дерево source.
+std::unique_ptr<FormulaInterface> ShareWithOffset(
+    std::shared_ptr<const FormulaInterface> source, int row_shift, int col_shift);
\ No newline at end of file
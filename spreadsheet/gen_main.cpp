@@ -0,0 +1,115 @@
+#include "sheet.h"
+#include "storage.h"
+#include "workload.h"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Генератор синтетических нагрузок: строит таблицу заданной формы и, при
+// необходимости, трассу операций, которую воспроизводит с замером времени.
+//
+// Использование: spreadsheet_gen --shape=chain|fan_out|fan_in|grid|dag|labels|errors
+//     [--size=N] [--width=N] [--depth=N] [--seed=N]
+//     [--out=файл таблицы] [--print]
+//     [--ops=N] [--reads=доля] [--trace-out=файл] [--replay=файл трассы]
+int main(int argc, char** argv) {
+    WorkloadOptions options;
+    TraceOptions trace_options;
+    trace_options.operations = 0;
+    std::string out_path;
+    std::string trace_out_path;
+    std::string replay_path;
+    bool print = false;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            auto value_of = [&](const std::string& key) {
+                return arg.rfind(key, 0) == 0 ? arg.substr(key.size()) : std::string();
+            };
+            if (arg.rfind("--shape=", 0) == 0) {
+                const auto shape = ParseSheetShape(value_of("--shape="));
+                if (!shape) {
+                    std::cerr << "Unknown shape: " << arg << std::endl;
+                    return 1;
+                }
+                options.shape = *shape;
+            }
+            else if (arg.rfind("--size=", 0) == 0) {
+                options.size = std::stoi(value_of("--size="));
+            }
+            else if (arg.rfind("--width=", 0) == 0) {
+                options.width = std::stoi(value_of("--width="));
+            }
+            else if (arg.rfind("--depth=", 0) == 0) {
+                options.depth = std::stoi(value_of("--depth="));
+            }
+            else if (arg.rfind("--seed=", 0) == 0) {
+                options.seed = static_cast<uint32_t>(std::stoul(value_of("--seed=")));
+                trace_options.seed = options.seed;
+            }
+            else if (arg.rfind("--out=", 0) == 0) {
+                out_path = value_of("--out=");
+            }
+            else if (arg == "--print") {
+                print = true;
+            }
+            else if (arg.rfind("--ops=", 0) == 0) {
+                trace_options.operations = std::stoul(value_of("--ops="));
+            }
+            else if (arg.rfind("--reads=", 0) == 0) {
+                trace_options.read_fraction = std::stod(value_of("--reads="));
+            }
+            else if (arg.rfind("--trace-out=", 0) == 0) {
+                trace_out_path = value_of("--trace-out=");
+            }
+            else if (arg.rfind("--replay=", 0) == 0) {
+                replay_path = value_of("--replay=");
+            }
+            else {
+                std::cerr << "Unknown argument: " << arg << std::endl;
+                return 1;
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Invalid argument value: " << e.what() << std::endl;
+        return 1;
+    }
+
+    Sheet sheet;
+    GenerateSheet(sheet, options);
+    if (!out_path.empty()) {
+        WriteSheetFile(sheet, out_path);
+    }
+    if (print) {
+        sheet.PrintTexts(std::cout);
+    }
+
+    std::vector<TraceOperation> trace;
+    if (!replay_path.empty()) {
+        std::ifstream in(replay_path);
+        if (!in) {
+            std::cerr << "Cannot open trace: " << replay_path << std::endl;
+            return 1;
+        }
+        try {
+            trace = ReadTrace(in);
+        }
+        catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+    else if (trace_options.operations > 0) {
+        trace_options.area = sheet.GetPrintableSize();
+        trace = GenerateTrace(trace_options);
+    }
+    if (!trace_out_path.empty()) {
+        std::ofstream out(trace_out_path);
+        WriteTrace(out, trace);
+    }
+    if (!trace.empty()) {
+        std::cerr << ReplayTrace(sheet, trace);
+    }
+}
@@ -0,0 +1,74 @@
+#include "history.h"
+
+#include <utility>
+
+namespace {
+    // Оценка памяти разобранной формулы: дерево выражения и список ссылок
+    constexpr size_t FORMULA_BYTES = 128;
+    constexpr size_t FORMULA_BYTES_PER_REFERENCE = 64;
+}
+
+size_t PastedCell::EstimateBytes() const {
+    size_t bytes = sizeof(PastedCell) + text.capacity() + references.capacity() * sizeof(Position);
+    if (formula) {
+        bytes += FORMULA_BYTES + references.size() * FORMULA_BYTES_PER_REFERENCE;
+    }
+    return bytes;
+}
+
+std::string PastedCell::GetText() const {
+    return formula ? FORMULA_SIGN + formula->GetExpression() : text;
+}
+
+UndoHistory::UndoHistory(UndoOptions options)
+    : options_(options) {
+}
+
+size_t UndoHistory::EstimateBytes(const Entry& entry) {
+    size_t bytes = 0;
+    for (const PastedCell& cell : entry) {
+        bytes += cell.EstimateBytes();
+    }
+    return bytes;
+}
+
+void UndoHistory::Record(Entry entry) {
+    redo_.clear();
+    if (EstimateBytes(entry) > options_.max_entry_bytes) {
+        // Без этой записи более ранние изменения отменить нельзя
+        undo_.clear();
+        return;
+    }
+    PushUndo(std::move(entry));
+}
+
+UndoHistory::Entry UndoHistory::PopUndo() {
+    Entry entry = std::move(undo_.back());
+    undo_.pop_back();
+    return entry;
+}
+
+void UndoHistory::PushRedo(Entry entry) {
+    redo_.push_back(std::move(entry));
+}
+
+UndoHistory::Entry UndoHistory::PopRedo() {
+    Entry entry = std::move(redo_.back());
+    redo_.pop_back();
+    return entry;
+}
+
+void UndoHistory::PushUndo(Entry entry) {
+    if (options_.max_entries == 0) {
+        return;
+    }
+    if (undo_.size() == options_.max_entries) {
+        undo_.pop_front();
+    }
+    undo_.push_back(std::move(entry));
+}
+
+void UndoHistory::Clear() {
+    undo_.clear();
+    redo_.clear();
+}
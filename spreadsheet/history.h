@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Содержимое ячейки, отделённое от неё: копия для вставки в позицию pos
+// (CopyRange, FillDown) или прежнее содержимое ячейки для отмены изменения.
+// Формула хранится разобранной, поэтому вставка не разбирает текст заново.
+struct PastedCell {
+    explicit PastedCell(Position pos)
+        : pos(pos) {
+    }
+
+    Position pos;
+    // Текст ячейки; для формулы не используется
+    std::string text;
+    // Формула со ссылками, уже сдвинутыми к pos
+    std::unique_ptr<FormulaInterface> formula;
+    std::shared_ptr<const ColumnProgram> program;
+    // Ячейки, на которые ссылается формула (отсортированы, без повторов)
+    std::vector<Position> references;
+
+    bool IsEmpty() const {
+        return !formula && text.empty();
+    }
+
+    // Текст, который вернёт GetText ячейки после вставки
+    std::string GetText() const;
+
+    // Приблизительный объём памяти, занятой содержимым, в байтах
+    size_t EstimateBytes() const;
+};
+
+// Параметры истории изменений
+struct UndoOptions {
+    // Сколько последних изменений можно отменить
+    size_t max_entries = 100;
+    // Предел памяти одной записи, в байтах. Изменение, которое больше
+    // (например, вставка огромного диапазона), не записывается, а более
+    // ранние изменения отменить уже нельзя.
+    size_t max_entry_bytes = 16 << 20;
+};
+
+// История изменений таблицы для Undo/Redo. Запись хранит лишь прежнее
+// содержимое изменённых ячеек (обратную дельту) в порядке изменения, так
+// что отмена стоит столько же, сколько само изменение.
+class UndoHistory {
+public:
+    using Entry = std::vector<PastedCell>;
+
+    explicit UndoHistory(UndoOptions options);
+
+    // Записывает изменение; отменённые изменения повторить уже нельзя
+    void Record(Entry entry);
+
+    bool CanUndo() const {
+        return !undo_.empty();
+    }
+
+    bool CanRedo() const {
+        return !redo_.empty();
+    }
+
+    // Последнее изменение для отмены. Содержимое ячеек, которое заменила
+    // отмена, передаётся в PushRedo.
+    Entry PopUndo();
+    void PushRedo(Entry entry);
+
+    // Последнее отменённое изменение для повтора. Содержимое ячеек,
+    // которое заменил повтор, передаётся в PushUndo.
+    Entry PopRedo();
+    void PushUndo(Entry entry);
+
+    // Забывает все изменения (например, после вставки строк)
+    void Clear();
+
+private:
+    static size_t EstimateBytes(const Entry& entry);
+
+    UndoOptions options_;
+    std::deque<Entry> undo_;
+    std::vector<Entry> redo_;
+};
@@ -1,6 +1,19 @@
+#include "cell.h"
 #include "common.h"
 #include "formula.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "workbook.h"
+#include "workload.h"
+
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -14,15 +27,6 @@ inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
 
-inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
-    std::visit(
-        [&](const auto& x) {
-            output << x;
-        },
-        value);
-    return output;
-}
-
 namespace {
 std::string ToString(FormulaError::Category category) {
     return std::string(FormulaError(category).ToString());
@@ -347,6 +351,1576 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestFormulaSimplification() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "2");
+    sheet->SetCell("B2"_pos, "5");
+    sheet->SetCell("C4"_pos, "7");
+
+    auto check = [&](Position pos, const std::string& text, const std::string& expected_text,
+                     CellInterface::Value expected) {
+        sheet->SetCell(pos, text);
+        ASSERT_EQUAL(sheet->GetCell(pos)->GetText(), expected_text);
+        ASSERT_EQUAL(sheet->GetCell(pos)->GetValue(), expected);
+    };
+
+    // Текст формулы не зависит от упрощений при вычислении
+    check("D1"_pos, "=A1*(60*60*24)", "=A1*60*60*24", CellInterface::Value(172800.0));
+    check("D2"_pos, "=+-+B2", "=+-+B2", CellInterface::Value(-5.0));
+    check("D3"_pos, "=(1+2)/3*C4", "=(1+2)/3*C4", CellInterface::Value(7.0));
+    check("D4"_pos, "=--A1-0", "=--A1-0", CellInterface::Value(2.0));
+
+    // Ошибки сохраняются
+    check("E1"_pos, "=1/0", "=1/0", CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    check("E2"_pos, "=A1/(1-1)", "=A1/(1-1)", CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+    sheet->SetCell("F1"_pos, "text");
+    check("E3"_pos, "=F1*1", "=F1*1", CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+    // Упрощённая формула следит за изменениями ячеек
+    sheet->SetCell("C4"_pos, "10");
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(10.0));
+}
+
+void TestSharedSubexpressions() {
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "1");
+    sheet.SetCell("C1"_pos, "2");
+    sheet.SetCell("D1"_pos, "3");
+    for (int i = 0; i < 10; ++i) {
+        sheet.SetCell({ i, 4 }, "=(B1+C1)*D1+" + std::to_string(i));
+    }
+    // (B1+C1), (B1+C1)*D1 и десять различных формул
+    ASSERT_EQUAL(sheet.Expressions().GetSize(), 12u);
+    ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetText(), "=(B1+C1)*D1+2");
+
+    sheet.ResetStats();
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQUAL(sheet.GetCell({ i, 4 })->GetValue(), CellInterface::Value(9.0 + i));
+    }
+#if SPREADSHEET_STATS
+    // Общее подвыражение вычислено один раз на десять формул
+    ASSERT_EQUAL(sheet.GetStats().shared_expression_hits, 9u);
+#endif
+
+    sheet.SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT_EQUAL(sheet.GetCell("E10"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    for (int i = 0; i < 10; ++i) {
+        sheet.ClearCell({ i, 4 });
+    }
+    ASSERT_EQUAL(sheet.Expressions().GetSize(), 0u);
+}
+
+void TestColumnBatchEvaluation() {
+    const int rows = 100;
+    Sheet sheet;
+    for (int i = 0; i < rows; ++i) {
+        sheet.SetCell({ i, 0 }, std::to_string(i));
+        sheet.SetCell({ i, 1 }, std::to_string(i % 7));
+        sheet.SetCell({ i, 2 }, "=A" + std::to_string(i + 1) + "*B" + std::to_string(i + 1) + "+1");
+        sheet.SetCell({ i, 3 }, "=A" + std::to_string(i + 1) + "/B" + std::to_string(i + 1));
+    }
+    sheet.SetCell("A5"_pos, "abc");
+    sheet.SetCell("B9"_pos, "=1/0");
+    sheet.SetCell("A12"_pos, "");
+
+    sheet.ResetStats();
+    for (int i = 0; i < rows; ++i) {
+        const double a = i == 4 || i == 11 ? 0.0 : i;
+        const double b = i % 7;
+        auto c = sheet.GetCell({ i, 2 })->GetValue();
+        auto d = sheet.GetCell({ i, 3 })->GetValue();
+        if (i == 4) {
+            ASSERT_EQUAL(c, CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+            ASSERT_EQUAL(d, CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        }
+        else if (i == 8) {
+            ASSERT_EQUAL(c, CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+            ASSERT_EQUAL(d, CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        }
+        else {
+            ASSERT_EQUAL(c, CellInterface::Value(a * b + 1));
+            if (b == 0) {
+                ASSERT_EQUAL(d, CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+            }
+            else {
+                ASSERT_EQUAL(d, CellInterface::Value(a / b));
+            }
+        }
+    }
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(sheet.GetStats().batch_evaluations, 2u * rows);
+#endif
+
+    sheet.SetCell("A3"_pos, "10");
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(21.0));
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    // Строки зависят друг от друга через соседний столбец: E{i} = F{i-1}+1, F{i} = E{i}*2
+    sheet.SetCell("E1"_pos, "1");
+    sheet.SetCell("F1"_pos, "=E1*2");
+    for (int i = 1; i < rows; ++i) {
+        sheet.SetCell({ i, 4 }, "=F" + std::to_string(i) + "+1");
+        sheet.SetCell({ i, 5 }, "=E" + std::to_string(i + 1) + "*2");
+    }
+    double expected = 2;
+    for (int i = 1; i < rows; ++i) {
+        expected = (expected + 1) * 2;
+    }
+    ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell({ rows - 1, 5 })->GetValue(), CellInterface::Value(expected));
+}
+
+void TestShortCircularReferences() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1");
+
+    bool caught = false;
+    try {
+        sheet->SetCell("B1"_pos, "=A1+1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "");
+
+    // После смены формулы прежняя ссылка не создаёт ложного цикла
+    sheet->SetCell("A1"_pos, "=C1");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestDependenciesAfterRewrite() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1*10");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    // Очищенная ячейка, на которую ссылаются, по-прежнему сбрасывает кэш зависимых
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    // Формула, переставшая ссылаться на ячейку, больше от неё не зависит
+    sheet->SetCell("A2"_pos, "=B1*10");
+    sheet->SetCell("A1"_pos, "=A2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+}
+
+void TestDeepChainEvaluation() {
+    // Цепочка длиннее MAX_ROWS продолжается в следующих столбцах
+    const int length = 100000;
+    auto chain = [](int i) {
+        return Position{ i % Position::MAX_ROWS, i / Position::MAX_ROWS };
+    };
+    Sheet sheet;
+    sheet.SetCell(chain(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet.SetCell(chain(i), "=" + chain(i - 1).ToString() + "+1");
+    }
+    const CellInterface* last = sheet.GetCell(chain(length - 1));
+    ASSERT_EQUAL(last->GetValue(), CellInterface::Value(double(length)));
+
+    sheet.SetCell(chain(0), "2");
+    ASSERT_EQUAL(last->GetValue(), CellInterface::Value(double(length + 1)));
+}
+
+void TestSaveAndOpenSheet() {
+    const std::string path = "spreadsheet_test.sheet";
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "2");
+        sheet->SetCell("A2"_pos, "=A1*3");
+        sheet->SetCell("B3"_pos, "=A2+A1");
+        sheet->SetCell("C1"_pos, "'=text");
+        sheet->SetCell("D4"_pos, "=E9");
+        SaveSheet(*sheet, path);
+    }
+
+    auto sheet = OpenSheet(path);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{4, 4}));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(8.0));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "=A1*3");
+    ASSERT_EQUAL(std::get<std::string>(sheet->GetCell("C1"_pos)->GetValue()), "=text");
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+
+    // Подгруженные ячейки участвуют в инвалидации и проверке циклов
+    sheet->SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(20.0));
+    bool caught = false;
+    try {
+        sheet->SetCell("A1"_pos, "=B3");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "5");
+
+    sheet->ClearCell("C1"_pos);
+    ASSERT(sheet->GetCell("C1"_pos) == nullptr);
+    sheet->ClearCell("D4"_pos);
+    ASSERT(sheet->GetCell("D4"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{3, 2}));
+
+    std::remove(path.c_str());
+}
+
+void TestInsertDeleteRowsCols() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "=A1+A2");
+    sheet.SetCell("B1"_pos, "=A3*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    sheet.InsertRows(1, 2);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "2");
+    ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=A1+A4");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A5*10");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 2 }));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    // Кэш после сдвига проверяется по новым позициям
+    sheet.SetCell("A4"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(60.0));
+    sheet.SetCell("A2"_pos, "100");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(60.0));
+
+    sheet.InsertCols(0);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B5*10");
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=B1+B4");
+    ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+
+    sheet.DeleteCols(0);
+    sheet.DeleteRows(1, 2);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=A1+A2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A3*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(60.0));
+
+    // Ссылки на удалённые ячейки становятся #REF!
+    sheet.DeleteRows(1);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1+#REF!");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetReferencedCells(), std::vector<Position>{ "A1"_pos });
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A2*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    sheet.SetCell("A2"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+
+    sheet.SetCell({ Position::MAX_ROWS - 1, 0 }, "last");
+    try {
+        sheet.InsertRows(0);
+        ASSERT(false);
+    } catch (const TableTooBigException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A2*10");
+    try {
+        sheet.DeleteRows(-1);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // Вставка и удаление попадают в журнал операций
+    const std::string path = "spreadsheet_structure_test.log";
+    std::remove(path.c_str());
+    std::ostringstream expected;
+    {
+        Sheet logged;
+        logged.EnableOperationLog({ path, 1, std::chrono::milliseconds(0) });
+        logged.SetCell("A1"_pos, "1");
+        logged.SetCell("B2"_pos, "=A1+C3");
+        logged.InsertRows(1);
+        logged.InsertCols(1, 2);
+        logged.DeleteRows(0);
+        logged.PrintTexts(expected);
+    }
+    Sheet restored;
+    restored.ReplayOperationLog(path);
+    std::ostringstream texts;
+    restored.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), expected.str());
+    ASSERT_EQUAL(restored.GetCell("D2"_pos)->GetText(), "=#REF!+E3");
+    std::remove(path.c_str());
+
+    // В таблице из файла создаются только сдвигаемые ячейки; ссылки
+    // остальных правятся, когда их создают позже
+    const std::string sheet_path = "spreadsheet_structure_test.sheet";
+    {
+        Sheet saved;
+        saved.SetCell("A1"_pos, "1");
+        saved.SetCell("A2"_pos, "=A5+C1");
+        saved.SetCell("A5"_pos, "3");
+        saved.SetCell("C1"_pos, "=A5*2");
+        saved.SetCell("C3"_pos, "7");
+        saved.SetCell("E1"_pos, "=C3");
+        SaveSheet(saved, sheet_path);
+    }
+    auto open = [&sheet_path] {
+        return std::make_unique<Sheet>(std::make_unique<MappedSheetFile>(sheet_path));
+    };
+    {
+        auto opened = open();
+        opened->InsertRows(2);
+        ASSERT_EQUAL(opened->GetCell("A6"_pos)->GetText(), "3");
+        ASSERT(opened->GetCell("A5"_pos) == nullptr);
+        ASSERT_EQUAL(opened->GetCell("A2"_pos)->GetText(), "=A6+C1");
+        ASSERT_EQUAL(opened->GetCell("A2"_pos)->GetValue(), CellInterface::Value(9.0));
+        ASSERT_EQUAL(opened->GetCell("E1"_pos)->GetText(), "=C4");
+        ASSERT_EQUAL(opened->GetPrintableSize(), (Size{ 6, 5 }));
+        opened->SetCell("A6"_pos, "4");
+        ASSERT_EQUAL(opened->GetCell("A2"_pos)->GetValue(), CellInterface::Value(12.0));
+    }
+    {
+        auto opened = open();
+        opened->DeleteCols(1);
+        ASSERT_EQUAL(opened->GetCell("A2"_pos)->GetText(), "=A5+B1");
+        ASSERT_EQUAL(opened->GetCell("D1"_pos)->GetText(), "=B3");
+        ASSERT(opened->GetCell("E1"_pos) == nullptr);
+        ASSERT_EQUAL(opened->GetCell("A2"_pos)->GetValue(), CellInterface::Value(9.0));
+        ASSERT_EQUAL(opened->GetPrintableSize(), (Size{ 5, 4 }));
+    }
+    {
+        auto opened = open();
+        opened->DeleteRows(4);
+        ASSERT_EQUAL(opened->GetCell("A2"_pos)->GetText(), "=#REF!+C1");
+        ASSERT_EQUAL(opened->GetCell("C1"_pos)->GetText(), "=#REF!*2");
+        ASSERT_EQUAL(opened->GetPrintableSize(), (Size{ 3, 5 }));
+
+        // Текст с #REF! разбирается обратно: таблица сохраняется и открывается,
+        // а формулу можно задать её же текстом
+        const std::string resaved_path = sheet_path + ".ref";
+        SaveSheet(*opened, resaved_path);
+        {
+            auto reopened = OpenSheet(resaved_path);
+            ASSERT_EQUAL(reopened->GetCell("A2"_pos)->GetText(), "=#REF!+C1");
+            ASSERT_EQUAL(reopened->GetCell("A2"_pos)->GetValue(),
+                CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+            ASSERT(reopened->GetCell("A2"_pos)->GetReferencedCells() == std::vector{ "C1"_pos });
+        }
+        std::remove(resaved_path.c_str());
+        opened->SetCell("C1"_pos, opened->GetCell("C1"_pos)->GetText());
+        ASSERT_EQUAL(opened->GetCell("C1"_pos)->GetText(), "=#REF!*2");
+        ASSERT(opened->GetCell("C1"_pos)->GetReferencedCells().empty());
+    }
+    std::remove(sheet_path.c_str());
+
+    // Общие подвыражения, вычисленные до вставки, относятся к прежним
+    // ячейкам: после сдвига формула не берёт их значение
+    Sheet shared;
+    for (int i = 0; i < 10; ++i) {
+        const std::string n = std::to_string(i + 10);
+        const std::string next = std::to_string(i + 11);
+        shared.SetCell({ i + 9, 1 }, std::to_string(i));
+        shared.SetCell({ i + 9, 2 }, std::to_string(i * i));
+        shared.SetCell({ i, 16 + i }, "=(B" + n + "+C" + n + ")*3");
+        shared.SetCell({ i, 6 + i }, "=(B" + next + "+C" + next + ")*2");
+    }
+    for (int i = 0; i < 10; ++i) {
+        shared.GetCell({ i, 6 + i })->GetValue();
+    }
+    shared.InsertRows(0);
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQUAL(shared.GetCell({ i + 1, 16 + i })->GetValue(), CellInterface::Value((i + i * i) * 3.0));
+    }
+}
+void TestCopyRangeAndFillDown() {
+    Sheet sheet;
+    const int rows = 50;
+    for (int i = 0; i < rows; ++i) {
+        sheet.SetCell({ i, 0 }, std::to_string(i + 1));
+    }
+    sheet.SetCell("B1"_pos, "=A1*2+C1");
+    sheet.SetCell("D1"_pos, "=B50");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    sheet.ResetStats();
+    sheet.FillDown("B1"_pos, rows - 1);
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(sheet.GetStats().formulas_parsed, 0u);
+#endif
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=A2*2+C2");
+    ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetText(), "=A50*2+C50");
+    ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetReferencedCells(), (std::vector{ "A50"_pos, "C50"_pos }));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(100.0));
+    for (int i = 0; i < rows; ++i) {
+        ASSERT_EQUAL(sheet.GetCell({ i, 1 })->GetValue(), CellInterface::Value(2.0 * (i + 1)));
+    }
+#if SPREADSHEET_STATS
+    ASSERT(sheet.GetStats().batch_evaluations > 0);
+#endif
+    sheet.SetCell("C50"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(101.0));
+
+    // Пересекающиеся прямоугольники копируются как есть до вставки
+    sheet.CopyRange("A1"_pos, { 2, 2 }, "B2"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=B2*2+D2");
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=B3*2+D3");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    // Ссылки за пределами таблицы становятся #REF!, пустые ячейки очищают назначение
+    sheet.SetCell("F5"_pos, "=E1+G9");
+    sheet.SetCell("H1"_pos, "text");
+    sheet.CopyRange("F5"_pos, { 1, 3 }, "F1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), "=#REF!+G5");
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT(sheet.GetCell("H1"_pos) == nullptr);
+
+    // Вставка, замыкающая цикл через существующие ячейки, не меняет таблицу
+    sheet.SetCell("K1"_pos, "=L1");
+    sheet.SetCell("L2"_pos, "=K2+1");
+    sheet.SetCell("K2"_pos, "7");
+    try {
+        sheet.CopyRange("K1"_pos, { 1, 1 }, "K2"_pos);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("K2"_pos)->GetText(), "7");
+    ASSERT_EQUAL(sheet.GetCell("L2"_pos)->GetValue(), CellInterface::Value(8.0));
+    try {
+        sheet.FillDown("K1"_pos, Position::MAX_ROWS);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // Копии формулы при заполнении вниз делят одно дерево выражения; своё
+    // дерево строится у копии, ссылки которой правятся
+    Sheet shared;
+    shared.EnableUndo();
+    shared.SetCell("A1"_pos, "=B1+C1*2");
+    shared.SetCell("B3"_pos, "1");
+    shared.SetCell("C4"_pos, "2");
+    shared.FillDown("A1"_pos, 4);
+    ASSERT_EQUAL(shared.GetCell("A4"_pos)->GetText(), "=B4+C4*2");
+    ASSERT_EQUAL(shared.GetCell("A4"_pos)->GetReferencedCells(), (std::vector{ "B4"_pos, "C4"_pos }));
+    ASSERT_EQUAL(shared.GetCell("A3"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(shared.GetCell("A4"_pos)->GetValue(), CellInterface::Value(4.0));
+    shared.SetCell("C3"_pos, "3");
+    ASSERT_EQUAL(shared.GetCell("A3"_pos)->GetValue(), CellInterface::Value(7.0));
+    ASSERT(shared.Undo());
+    ASSERT(shared.Undo());
+    ASSERT(shared.GetCell("A2"_pos) == nullptr);
+    ASSERT(shared.Redo());
+    ASSERT_EQUAL(shared.GetCell("A5"_pos)->GetText(), "=B5+C5*2");
+    ASSERT_EQUAL(shared.GetCell("A4"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    // Смещения копии копии складываются
+    shared.CopyRange("A4"_pos, { 1, 1 }, "E2"_pos);
+    ASSERT_EQUAL(shared.GetCell("E2"_pos)->GetText(), "=F2+G2*2");
+    shared.InsertRows(0);
+    ASSERT_EQUAL(shared.GetCell("A5"_pos)->GetText(), "=B5+C5*2");
+    ASSERT_EQUAL(shared.GetCell("A5"_pos)->GetValue(), CellInterface::Value(4.0));
+    shared.DeleteCols(1);
+    ASSERT_EQUAL(shared.GetCell("D3"_pos)->GetText(), "=E3+F3*2");
+    ASSERT_EQUAL(shared.GetCell("A5"_pos)->GetText(), "=#REF!+B5*2");
+    ASSERT_EQUAL(shared.GetCell("A5"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+    // Копия, ссылки которой вышли бы за пределы таблицы, строится сразу
+    const Position last_but_one{ Position::MAX_ROWS - 2, 0 };
+    shared.SetCell(last_but_one, "=B" + std::to_string(Position::MAX_ROWS));
+    shared.FillDown(last_but_one, 1);
+    ASSERT_EQUAL(shared.GetCell({ Position::MAX_ROWS - 1, 0 })->GetText(), "=#REF!");
+
+    // Память копий учитывается так же, как у отдельных формул
+    const Size size = shared.GetPrintableSize();
+    for (int i = 0; i < size.rows; ++i) {
+        for (int j = 0; j < size.cols; ++j) {
+            shared.ClearCell({ i, j });
+        }
+    }
+    ASSERT_EQUAL(shared.MemoryUsage().formulas, 0u);
+    ASSERT_EQUAL(shared.MemoryUsage().cells, 0u);
+}
+
+void TestUndoRedo() {
+    Sheet sheet;
+    ASSERT(!sheet.Undo());
+    sheet.EnableUndo();
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+B1");
+    sheet.SetCell("A1"_pos, "5");
+    try {
+        sheet.SetCell("B1"_pos, "=A2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    sheet.ResetStats();
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT(sheet.Undo());
+    // Пустая ячейка, созданная для ссылки формулы, убирается вместе с формулой
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT(sheet.Undo());
+    ASSERT(!sheet.Undo());
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+
+    ASSERT(sheet.Redo());
+    ASSERT(sheet.Redo());
+    ASSERT(sheet.Redo());
+    ASSERT(!sheet.Redo());
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1+B1");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet.SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(7.0));
+#if SPREADSHEET_STATS
+    // Отмена и повтор не разбирают формулы заново
+    ASSERT_EQUAL(sheet.GetStats().formulas_parsed, 0u);
+#endif
+
+    // Новое изменение отменённые изменения не повторит
+    ASSERT(sheet.Undo());
+    sheet.ClearCell("A1"_pos);
+    ASSERT(!sheet.Redo());
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5");
+
+    // Вставка диапазона отменяется целиком
+    sheet.CopyRange("A1"_pos, { 2, 1 }, "C1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=C1+D1");
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("C2"_pos) == nullptr);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+
+    // Структурные изменения очищают историю
+    sheet.InsertRows(0);
+    ASSERT(!sheet.Undo());
+
+    // Ограничения на число записей и размер записи
+    Sheet limited;
+    limited.EnableUndo({ 2, 4096 });
+    limited.SetCell("A1"_pos, "1");
+    limited.SetCell("A2"_pos, "2");
+    limited.SetCell("A3"_pos, "3");
+    ASSERT(limited.Undo());
+    ASSERT(limited.Undo());
+    ASSERT(!limited.Undo());
+    ASSERT_EQUAL(limited.GetCell("A1"_pos)->GetText(), "1");
+    limited.SetCell("B1"_pos, "=A1*2");
+    limited.FillDown("B1"_pos, 1000);
+    ASSERT_EQUAL(limited.GetCell("B1001"_pos)->GetText(), "=A1001*2");
+    ASSERT(!limited.Undo());
+}
+
+void TestVisitRange() {
+    Sheet sheet;
+    sheet.SetCell("B2"_pos, "1");
+    sheet.SetCell("D2"_pos, "=B2*10");
+    sheet.SetCell("C3"_pos, "text");
+    sheet.SetCell("A3"_pos, "left");
+    sheet.SetCell("E3"_pos, "right");
+    sheet.SetCell("C5"_pos, "=1/0");
+    sheet.SetCell("C9"_pos, "=Z99+1");
+    sheet.SetCell("C20"_pos, "below");
+
+    auto visit_all = [&sheet](Position top_left, Size size) {
+        std::vector<Position> visited;
+        sheet.VisitRange(top_left, size, [&visited](Position pos, const CellInterface& cell) {
+            visited.push_back(pos);
+            ASSERT(!cell.GetText().empty());
+        });
+        return visited;
+    };
+
+    sheet.ResetStats();
+    ASSERT_EQUAL(visit_all("B2"_pos, { 10, 3 }),
+                 (std::vector{ "B2"_pos, "D2"_pos, "C3"_pos, "C5"_pos, "C9"_pos }));
+#if SPREADSHEET_STATS
+    // Значения не вычисляются, пока их не запросят
+    ASSERT_EQUAL(sheet.GetStats().evaluations, 0u);
+#endif
+    std::vector<CellInterface::Value> values;
+    sheet.VisitRange("B2"_pos, { 1, 3 }, [&values](Position, const CellInterface& cell) {
+        values.push_back(cell.GetValue());
+    });
+    ASSERT_EQUAL(values, (std::vector<CellInterface::Value>{ 1.0, 10.0 }));
+    // Пустая Z99, созданная для ссылки формулы, не выдаётся
+    ASSERT(visit_all("Z99"_pos, { 1, 1 }).empty());
+    ASSERT(visit_all("A1"_pos, { 0, 5 }).empty());
+    try {
+        visit_all("A1"_pos, { Position::MAX_ROWS + 1, 1 });
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // Ячейки таблицы из файла подгружаются только для прямоугольника
+    const std::string path = "spreadsheet_visit_test.sheet";
+    SaveSheet(sheet, path);
+    {
+        Sheet opened(std::make_unique<MappedSheetFile>(path));
+        std::vector<Position> visited;
+        opened.VisitRange("C1"_pos, { 9, 1 }, [&visited](Position pos, const CellInterface&) {
+            visited.push_back(pos);
+        });
+        ASSERT_EQUAL(visited, (std::vector{ "C3"_pos, "C5"_pos, "C9"_pos }));
+        ASSERT(opened.GetCell("C20"_pos) != nullptr);
+    }
+    std::remove(path.c_str());
+}
+
+void TestRecalculateWithDeadline() {
+    using Clock = RecalcScheduler::Clock;
+    Sheet sheet;
+    // Цепочка A1 <- A2 <- ... <- A100 и отдельная формула C1
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 1; i < 100; ++i) {
+        sheet.SetCell({ i, 0 }, "=A" + std::to_string(i) + "+1");
+    }
+    sheet.SetCell("C1"_pos, "=A1*2");
+    ASSERT(sheet.IsUpToDate("A1"_pos));
+    ASSERT(sheet.IsUpToDate("Z99"_pos));
+    ASSERT(!sheet.IsUpToDate("A100"_pos));
+
+    ASSERT(sheet.Recalculate(Clock::now() + std::chrono::seconds(10)));
+    ASSERT(sheet.IsUpToDate("A100"_pos));
+    ASSERT(sheet.IsUpToDate("C1"_pos));
+#if SPREADSHEET_STATS
+    sheet.ResetStats();
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A100"_pos)->GetValue()), 100.0);
+    ASSERT_EQUAL(sheet.GetStats().evaluations, 0u);
+#endif
+
+    // Изменение устаревает только зависимые формулы
+    sheet.SetCell("A50"_pos, "0");
+    ASSERT(sheet.IsUpToDate("C1"_pos));
+    ASSERT(sheet.IsUpToDate("A49"_pos));
+    ASSERT(!sheet.IsUpToDate("A51"_pos));
+    ASSERT(!sheet.IsUpToDate("A100"_pos));
+
+    // Истёкший срок: ничего не вычисляется, следующий вызов продолжает
+    ASSERT(!sheet.Recalculate(Clock::now()));
+    ASSERT(!sheet.IsUpToDate("A100"_pos));
+    ASSERT(sheet.Recalculate(Clock::now() + std::chrono::seconds(10)));
+    ASSERT(sheet.IsUpToDate("A100"_pos));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A100"_pos)->GetValue()), 50.0);
+
+    // Наблюдаемая ячейка пересчитывается первой, вместе с тем, от чего
+    // зависит; каждый вызов продвигает пересчёт даже с истёкшим сроком
+    sheet.Observe("A40"_pos);
+    sheet.SetCell("A1"_pos, "10");
+    ASSERT(!sheet.Recalculate(Clock::now()));
+    ASSERT(sheet.IsUpToDate("A40"_pos));
+    ASSERT(!sheet.IsUpToDate("A45"_pos));
+    int calls = 1;
+    while (!sheet.Recalculate(Clock::now())) {
+        ++calls;
+    }
+    ASSERT(calls > 1);
+    ASSERT(sheet.IsUpToDate("A100"_pos));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A40"_pos)->GetValue()), 49.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A100"_pos)->GetValue()), 50.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 20.0);
+
+    // Невыполненная часть плана сдвигается вместе со строками
+    sheet.Unobserve("A40"_pos);
+    sheet.SetCell("A1"_pos, "20");
+    ASSERT(!sheet.Recalculate(Clock::now()));
+    sheet.InsertRows(0);
+    ASSERT(!sheet.IsUpToDate("A41"_pos));
+    sheet.SetCell("A2"_pos, "5");
+    ASSERT(sheet.Recalculate(Clock::now() + std::chrono::seconds(10)));
+    ASSERT(sheet.IsUpToDate("A41"_pos));
+    ASSERT(sheet.IsUpToDate("A101"_pos));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A41"_pos)->GetValue()), 44.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A101"_pos)->GetValue()), 50.0);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C2"_pos)->GetValue()), 10.0);
+}
+
+void TestWorkbook() {
+    Workbook book(2);
+    Sheet& data = book.AddSheet("Data");
+    Sheet& report = book.AddSheet("Report");
+    ASSERT_EQUAL(book.GetSheet("Report"), &report);
+    ASSERT(book.GetSheet("Missing") == nullptr);
+
+    data.SetCell("A1"_pos, "2");
+    report.SetCell("A1"_pos, "=Data!A1*2");
+    report.SetCell("B1"_pos, "=A1+Data!B1");
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), "=Data!A1*2");
+    ASSERT_EQUAL(std::get<double>(report.GetCell("A1"_pos)->GetValue()), 4.0);
+    ASSERT_EQUAL(std::get<double>(report.GetCell("B1"_pos)->GetValue()), 4.0);
+
+    // Изменение ячейки одной таблицы видно формулам другой
+    data.SetCell("A1"_pos, "5");
+    data.SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(report.GetCell("B1"_pos)->GetValue()), 11.0);
+
+    // Циклы через несколько таблиц запрещены, таблица при этом не меняется
+    try {
+        data.SetCell("A1"_pos, "=Report!A1");
+        ASSERT(false);
+    }
+    catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(data.GetCell("A1"_pos)->GetText(), "5");
+
+    try {
+        report.SetCell("C1"_pos, "=Missing!A1");
+        ASSERT(false);
+    }
+    catch (const FormulaException&) {
+    }
+    Sheet standalone;
+    try {
+        standalone.SetCell("A1"_pos, "=Data!A1");
+        ASSERT(false);
+    }
+    catch (const FormulaException&) {
+    }
+
+    // Вставка и удаление строк правят ссылки других таблиц
+    data.InsertRows(0);
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), "=Data!A2*2");
+    ASSERT_EQUAL(std::get<double>(report.GetCell("A1"_pos)->GetValue()), 10.0);
+    report.CopyRange("A1"_pos, { 1, 1 }, "A2"_pos);
+    ASSERT_EQUAL(report.GetCell("A2"_pos)->GetText(), "=Data!A3*2");
+    data.DeleteRows(1);
+    ASSERT_EQUAL(report.GetCell("A1"_pos)->GetText(), "=#REF!*2");
+    ASSERT(std::get<FormulaError>(report.GetCell("A1"_pos)->GetValue()).GetCategory()
+        == FormulaError::Category::Ref);
+
+    // Пересчёт книги: цепочки через обе таблицы в обе стороны
+    Sheet& extra = book.AddSheet("Extra_2");
+    for (int i = 0; i < 50; ++i) {
+        const std::string row = std::to_string(i + 1);
+        data.SetCell({ i, 3 }, std::to_string(i));
+        report.SetCell({ i, 3 }, "=Data!D" + row + "*10");
+        extra.SetCell({ i, 0 }, "=Report!D" + row + "+Data!D" + row);
+        data.SetCell({ i, 4 }, "=Extra_2!A" + row + "+1");
+    }
+    book.Recalculate();
+    for (const auto& sheet : book.GetSheets()) {
+        sheet->VisitRange({ 0, 0 }, { Position::MAX_ROWS, Position::MAX_COLS },
+            [&sheet](Position pos, const CellInterface&) {
+                ASSERT(sheet->IsUpToDate(pos));
+            });
+    }
+    ASSERT_EQUAL(std::get<double>(data.GetCell("E50"_pos)->GetValue()), 540.0);
+    data.SetCell("D50"_pos, "0");
+    ASSERT(!data.IsUpToDate("E50"_pos));
+    book.Recalculate();
+    ASSERT(data.IsUpToDate("E50"_pos));
+    ASSERT(extra.IsUpToDate("A50"_pos));
+    ASSERT_EQUAL(std::get<double>(data.GetCell("E50"_pos)->GetValue()), 1.0);
+
+    for (const char* name : { "", "1st", "A B", "Data" }) {
+        try {
+            book.AddSheet(name);
+            ASSERT(false);
+        }
+        catch (const InvalidSheetNameException&) {
+        }
+    }
+}
+
+void TestValueCutoffAndChangeNotifications() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*0");
+    sheet.SetCell("C1"_pos, "=B1+1");
+    sheet.SetCell("D1"_pos, "=A1+1");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 1.0);
+
+    // B1 даёт прежнее значение: C1 лишь подтверждает кэш
+#if SPREADSHEET_STATS
+    sheet.ResetStats();
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 1.0);
+    ASSERT_EQUAL(sheet.GetStats().evaluations, 1u);
+    ASSERT_EQUAL(sheet.GetStats().unchanged_results, 1u);
+#endif
+
+    std::vector<std::vector<Position>> notifications;
+    const size_t subscription = sheet.Subscribe([&notifications](const std::vector<Position>& changed) {
+        notifications.push_back(changed);
+    });
+#if SPREADSHEET_STATS
+    sheet.ResetStats();
+#endif
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(notifications.size(), 1u);
+    ASSERT_EQUAL(notifications.back(), (std::vector<Position>{ "A1"_pos, "D1"_pos }));
+    ASSERT(sheet.IsUpToDate("D1"_pos));
+#if SPREADSHEET_STATS
+    // Обход изменений останавливается на B1, давшей прежнее значение:
+    // кэш C1 за ней даже не проверяется
+    ASSERT_EQUAL(sheet.GetStats().cache_revalidations, 0u);
+#endif
+
+    // Формулы, которые до подписки не вычислялись, сравниваются со значением
+    // на момент подписки, а не считаются изменившимися при первом вычислении
+    {
+        Sheet fresh;
+        fresh.SetCell("A1"_pos, "1");
+        fresh.SetCell("B1"_pos, "=A1*0");
+        fresh.SetCell("C1"_pos, "=B1");
+        std::vector<Position> changed;
+        fresh.Subscribe([&changed](const std::vector<Position>& positions) {
+            changed = positions;
+        });
+        fresh.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(changed, std::vector{ "A1"_pos });
+    }
+
+    // 0 и -0 печатаются по-разному: смена знака нуля - изменение
+    {
+        Sheet zero;
+        zero.SetCell("A1"_pos, "=C1*1");
+        zero.SetCell("B1"_pos, "=A1");
+        ASSERT(!std::signbit(std::get<double>(zero.GetCell("B1"_pos)->GetValue())));
+        std::vector<Position> changed;
+        zero.Subscribe([&changed](const std::vector<Position>& positions) {
+            changed = positions;
+        });
+        zero.SetCell("A1"_pos, "=-C1");
+        ASSERT_EQUAL(changed, (std::vector{ "A1"_pos, "B1"_pos }));
+        ASSERT(std::signbit(std::get<double>(zero.GetCell("B1"_pos)->GetValue())));
+        zero.SetCell("C1"_pos, "0");
+        zero.SetCell("D1"_pos, "=C1");
+        zero.GetCell("D1"_pos)->GetValue();
+        zero.SetCell("C1"_pos, "-0");
+        ASSERT_EQUAL(changed, (std::vector{ "A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos }));
+        ASSERT(std::signbit(std::get<double>(zero.GetCell("D1"_pos)->GetValue())));
+    }
+
+    // Та же величина другим текстом - не изменение
+    sheet.SetCell("A1"_pos, "3.0");
+    ASSERT_EQUAL(notifications.size(), 1u);
+
+    {
+        Sheet::ChangeBatch batch(sheet);
+        sheet.SetCell("A2"_pos, "1");
+        sheet.SetCell("A1"_pos, "4");
+        sheet.CopyRange("D1"_pos, { 1, 1 }, "D2"_pos);
+        ASSERT_EQUAL(notifications.size(), 1u);
+    }
+    ASSERT_EQUAL(notifications.size(), 2u);
+    ASSERT_EQUAL(notifications.back(),
+        (std::vector<Position>{ "A1"_pos, "D1"_pos, "A2"_pos, "D2"_pos }));
+
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(notifications.back(), (std::vector<Position>{ "A2"_pos, "D2"_pos }));
+
+    // Сдвиг ячеек без изменения значений не сообщается
+    ASSERT_EQUAL(notifications.size(), 3u);
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(notifications.size(), 3u);
+    sheet.SetCell("A2"_pos, "5");
+    ASSERT_EQUAL(notifications.back(), (std::vector<Position>{ "A2"_pos, "D2"_pos }));
+
+    sheet.Unsubscribe(subscription);
+    sheet.SetCell("A2"_pos, "6");
+    ASSERT_EQUAL(notifications.size(), 4u);
+
+    // Удаление строки сообщает лишь о формулах, ссылавшихся на её ячейки
+    sheet.SetCell("A5"_pos, "=D2");
+    notifications.clear();
+    sheet.Subscribe([&notifications](const std::vector<Position>& changed) {
+        notifications.push_back(changed);
+    });
+    sheet.DeleteRows(1);
+    ASSERT_EQUAL(notifications.size(), 1u);
+    ASSERT_EQUAL(notifications.back(), std::vector{ "A4"_pos });
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=#REF!");
+}
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    const SheetMemoryUsage empty = sheet.MemoryUsage();
+    ASSERT_EQUAL(empty.cells, 0u);
+    ASSERT_EQUAL(empty.text + empty.formulas + empty.dependents + empty.value_caches, 0u);
+
+    const std::string long_text(100, 'x');
+    for (int i = 0; i < 10; ++i) {
+        sheet.SetCell({ i, 0 }, long_text);
+        sheet.SetCell({ i, 1 }, "=A" + std::to_string(i + 1) + "+C1*2");
+    }
+    const SheetMemoryUsage filled = sheet.MemoryUsage();
+    ASSERT(filled.cells > 0);
+    ASSERT(filled.cell_index > empty.cell_index);
+    ASSERT(filled.text >= 10 * long_text.size());
+    ASSERT(filled.formulas > 0);
+    ASSERT(filled.dependents > 0);
+    ASSERT(filled.value_caches > 0);
+    ASSERT_EQUAL(filled.Total(), filled.cells + filled.cell_index + filled.text + filled.formulas
+        + filled.dependents + filled.value_caches);
+
+    // Счётчики поддерживаются при всех изменениях: после очистки таблицы
+    // от ячеек ничего не остаётся
+    sheet.InsertRows(0, 2);
+    sheet.CopyRange("A3"_pos, { 10, 2 }, "D3"_pos);
+    sheet.DeleteCols(0);
+    sheet.SetCell("B3"_pos, "short");
+    for (int row = 0; row < 12; ++row) {
+        for (int col = 0; col < 5; ++col) {
+            sheet.ClearCell({ row, col });
+        }
+    }
+    const SheetMemoryUsage cleared = sheet.MemoryUsage();
+    ASSERT_EQUAL(cleared.cells, 0u);
+    ASSERT_EQUAL(cleared.text, 0u);
+    ASSERT_EQUAL(cleared.formulas, 0u);
+    ASSERT_EQUAL(cleared.dependents, 0u);
+    ASSERT_EQUAL(cleared.value_caches, 0u);
+}
+
+void TestWorkloadGenerator() {
+    auto texts = [](const WorkloadOptions& options) {
+        Sheet sheet;
+        GenerateSheet(sheet, options);
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    };
+    WorkloadOptions dag{ SheetShape::RandomDag, 200, 8, 5, 7 };
+    ASSERT_EQUAL(texts(dag), texts(dag));
+    WorkloadOptions other_seed = dag;
+    other_seed.seed = 8;
+    ASSERT(texts(dag) != texts(other_seed));
+
+    Sheet chain;
+    GenerateSheet(chain, { SheetShape::Chain, 100 });
+    ASSERT_EQUAL(std::get<double>(chain.GetCell("A100"_pos)->GetValue()), 100.0);
+
+    // 64 числа сворачиваются суммами по 4: 64 -> 16 -> 4 -> 1
+    Sheet fan_in;
+    GenerateSheet(fan_in, { SheetShape::FanIn, 64, 4 });
+    ASSERT_EQUAL(fan_in.GetPrintableSize(), (Size{ 64, 4 }));
+    ASSERT_EQUAL(std::get<double>(fan_in.GetCell("D1"_pos)->GetValue()), 2016.0);
+
+    Sheet errors;
+    GenerateSheet(errors, { SheetShape::Errors, 400, 8, 3 });
+    bool has_error = false;
+    errors.VisitRange({ 0, 3 }, { Position::MAX_ROWS, 1 }, [&has_error](Position, const CellInterface& cell) {
+        has_error = has_error || std::holds_alternative<FormulaError>(cell.GetValue());
+    });
+    ASSERT(has_error);
+
+    for (SheetShape shape : { SheetShape::Chain, SheetShape::FanOut, SheetShape::FanIn, SheetShape::Grid,
+             SheetShape::RandomDag, SheetShape::Labels, SheetShape::Errors }) {
+        ASSERT(ParseSheetShape(ToString(shape)) == shape);
+    }
+    ASSERT(!ParseSheetShape("spiral"));
+
+    // Трасса воспроизводится одинаково после записи и чтения
+    Sheet grid;
+    GenerateSheet(grid, { SheetShape::Grid, 400, 4 });
+    TraceOptions trace_options;
+    trace_options.operations = 500;
+    trace_options.area = grid.GetPrintableSize();
+    const std::vector<TraceOperation> trace = GenerateTrace(trace_options);
+    std::ostringstream written;
+    WriteTrace(written, trace);
+    std::istringstream in(written.str());
+    const std::vector<TraceOperation> read = ReadTrace(in);
+    std::ostringstream rewritten;
+    WriteTrace(rewritten, read);
+    ASSERT_EQUAL(rewritten.str(), written.str());
+    std::ostringstream regenerated;
+    WriteTrace(regenerated, GenerateTrace(trace_options));
+    ASSERT_EQUAL(regenerated.str(), written.str());
+
+    const TraceTiming timing = ReplayTrace(grid, read);
+    ASSERT_EQUAL(timing.reads + timing.writes, trace.size());
+    ASSERT_EQUAL(timing.rejected, 0u);
+    ASSERT_EQUAL(timing.read_latency.Count(), timing.reads);
+
+    std::istringstream malformed("R A1\nX A1\n");
+    try {
+        ReadTrace(malformed);
+        ASSERT(false);
+    }
+    catch (const std::invalid_argument&) {
+    }
+}
+
+void TestReferencedCellsSpan() {
+    auto to_vector = [](Span<const Position> refs) {
+        return std::vector<Position>(refs.begin(), refs.end());
+    };
+
+    // Ссылки отсортированы и без повторов уже после разбора
+    auto formula = ParseFormula("C3+A1*B2+A1+C3");
+    ASSERT_EQUAL(to_vector(formula->ReferencedCells()), (std::vector{"A1"_pos, "B2"_pos, "C3"_pos}));
+    // Повторный вызов отдаёт те же элементы без копирования
+    ASSERT(formula->ReferencedCells().data() == formula->ReferencedCells().data());
+
+    // Ссылки, ставшие #REF!, пропадают из списка, сдвинутые - пересортированы
+    formula->HandleDeletedRows(1);
+    ASSERT_EQUAL(to_vector(formula->ReferencedCells()), (std::vector{"A1"_pos, "C2"_pos}));
+    ASSERT_EQUAL(formula->GetReferencedCells(), to_vector(formula->ReferencedCells()));
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1+A2+B1");
+    const CellInterface* cell = sheet->GetCell("A1"_pos);
+    ASSERT_EQUAL(to_vector(cell->ReferencedCells()), (std::vector{"B1"_pos, "A2"_pos}));
+    ASSERT(sheet->GetCell("B1"_pos)->ReferencedCells().empty());
+    sheet->SetCell("A1"_pos, "text");
+    ASSERT(cell->ReferencedCells().empty());
+}
+
+void TestCachedFormulaText() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=  (A1 + A1) * 2 + A1 * 3 + A1 / 4 + A1 - 5");
+    const std::string canonical = "=(A1+A1)*2+A1*3+A1/4+A1-5";
+    const size_t before = sheet.Memory().formulas;
+
+    // Текст печатается один раз и учитывается в памяти формул
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), canonical);
+    const size_t cached = sheet.Memory().formulas;
+    ASSERT(cached > before);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), canonical);
+    ASSERT_EQUAL(sheet.Memory().formulas, cached);
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), "1\t" + canonical + "\n");
+
+    // После сдвига ссылок текст печатается заново
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=(A2+A2)*2+A2*3+A2/4+A2-5");
+    sheet.InsertCols(0);
+    sheet.ClearCell("C2"_pos);
+    sheet.ClearCell("B2"_pos);
+    ASSERT_EQUAL(sheet.Memory().formulas, 0u);
+}
+
+void TestCellGraph() {
+    CellGraph graph;
+    const CellId a = graph.Add(nullptr);
+    const CellId b = graph.Add(nullptr);
+    const CellId c = graph.Add(nullptr);
+    ASSERT_EQUAL(a, 0u);
+    ASSERT_EQUAL(c, 2u);
+    graph.AddDependent(a, b);
+    graph.AddDependent(a, c);
+    graph.RemoveDependent(a, b);
+    ASSERT_EQUAL(graph.GetDependents(a).size(), 1u);
+    ASSERT_EQUAL(*graph.GetDependents(a).begin(), c);
+    // Номер удалённой ячейки выдаётся снова, без прежних рёбер
+    graph.Remove(a);
+    ASSERT_EQUAL(graph.Add(nullptr), a);
+    ASSERT(graph.GetDependents(a).empty());
+
+    // Отметки нового обхода не видят прежних; вложенные обходы независимы
+    {
+        CellGraph::Marks marks(graph);
+        ASSERT(marks.Mark(b));
+        ASSERT(!marks.Mark(b));
+        CellGraph::Marks nested(graph);
+        ASSERT(!nested.IsMarked(b));
+        ASSERT_EQUAL(marks.Count(), 1u);
+    }
+    {
+        CellGraph::Marks marks(graph);
+        ASSERT(!marks.IsMarked(b));
+        ASSERT(marks.Stack().empty());
+    }
+
+    // Рёбра таблицы - номера ячеек в её графе
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "=A1");
+    sheet.SetCell("B2"_pos, "=A1*2");
+    const auto* a1 = static_cast<const Cell*>(sheet.GetCell("A1"_pos));
+    std::vector<Position> dependents;
+    for (const CellId id : a1->GetDependents()) {
+        dependents.push_back(sheet.Graph().GetCell(id)->GetPosition());
+    }
+    std::sort(dependents.begin(), dependents.end());
+    ASSERT_EQUAL(dependents, (std::vector{ "B1"_pos, "B2"_pos }));
+    sheet.SetCell("B2"_pos, "2");
+    ASSERT_EQUAL(a1->GetDependents().size(), 1u);
+    bool caught = false;
+    try {
+        sheet.SetCell("A1"_pos, "=B1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestCellGraphCompaction() {
+    auto sorted = [](CellGraph::EdgeRange edges) {
+        std::vector<CellId> result(edges.begin(), edges.end());
+        std::sort(result.begin(), result.end());
+        return result;
+    };
+
+    CellGraph graph;
+    for (int i = 0; i < 4; ++i) {
+        graph.Add(nullptr);
+    }
+    graph.AddDependent(0, 1);
+    graph.AddDependent(0, 2);
+    graph.AddDependent(1, 3);
+    ASSERT_EQUAL(graph.FrozenEdgeCount(), 0u);
+    ASSERT_EQUAL(graph.DeltaEdgeCount(), 6u);
+
+    // После сжатия рёбра те же, а дельта пуста
+    graph.Compact();
+    ASSERT_EQUAL(graph.FrozenEdgeCount(), 6u);
+    ASSERT_EQUAL(graph.DeltaEdgeCount(), 0u);
+    ASSERT_EQUAL(sorted(graph.GetDependents(0)), (std::vector<CellId>{ 1, 2 }));
+    ASSERT_EQUAL(sorted(graph.GetReferences(3)), (std::vector<CellId>{ 1 }));
+
+    // Изменения после сжатия видны сразу: удалённое ребро сжатой части
+    // пропускается, новое берётся из дельты
+    graph.RemoveDependent(0, 1);
+    graph.AddDependent(0, 3);
+    ASSERT_EQUAL(sorted(graph.GetDependents(0)), (std::vector<CellId>{ 2, 3 }));
+    ASSERT_EQUAL(sorted(graph.GetReferences(3)), (std::vector<CellId>{ 0, 1 }));
+    ASSERT(graph.GetReferences(1).empty());
+    ASSERT_EQUAL(graph.DeltaEdgeCount(), 4u);
+
+    // Удаление ячейки снимает её рёбра в обоих направлениях
+    graph.Remove(1);
+    ASSERT_EQUAL(sorted(graph.GetReferences(3)), (std::vector<CellId>{ 0 }));
+    graph.Compact();
+    ASSERT_EQUAL(graph.FrozenEdgeCount(), 4u);
+    ASSERT_EQUAL(sorted(graph.GetDependents(0)), (std::vector<CellId>{ 2, 3 }));
+
+    // Таблица после массовых записей сливает дельту сама, и ответы не
+    // меняются
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int i = 1; i < 5000; ++i) {
+        sheet.SetCell({ i, 0 }, "=A" + std::to_string(i) + "+1");
+    }
+    const CellGraph& sheet_graph = sheet.Graph();
+    ASSERT(sheet_graph.FrozenEdgeCount() > 0);
+    ASSERT(sheet_graph.DeltaEdgeCount() < sheet_graph.FrozenEdgeCount());
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({ 4999, 0 })->GetValue()), 5000.0);
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell({ 4999, 0 })->GetValue()), 5001.0);
+    bool caught = false;
+    try {
+        sheet.SetCell("A1"_pos, "=A5000");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    // Граф пустой таблицы не занимает памяти
+    for (int i = 0; i < 5000; ++i) {
+        sheet.ClearCell({ i, 0 });
+    }
+    ASSERT_EQUAL(sheet.MemoryUsage().dependents, 0u);
+}
+
+void TestPlaceholderReferences() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=Z9999+1");
+    // Ячейка, на которую лишь ссылаются, не создаётся и не расширяет таблицу
+    const size_t cells = sheet.MemoryUsage().cells;
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 1.0);
+    ASSERT_EQUAL(sheet.MemoryUsage().cells, cells);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+    // По запросу она пуста и тоже не попадает в таблицу
+    CellInterface* placeholder = sheet.GetCell("Z9999"_pos);
+    ASSERT_EQUAL(placeholder->GetText(), "");
+    ASSERT(placeholder->GetReferencedCells().empty());
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "1\n");
+
+    // Запись превращает заглушку в ячейку вместе с зависимыми
+    sheet.SetCell("Z9999"_pos, "5");
+    ASSERT(sheet.GetCell("Z9999"_pos) == placeholder);
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 6.0);
+    bool caught = false;
+    try {
+        sheet.SetCell("Z9999"_pos, "=A1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // Очищенная ячейка снова становится заглушкой, формула это видит
+    sheet.ClearCell("Z9999"_pos);
+    ASSERT_EQUAL(sheet.GetCell("Z9999"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 1.0);
+
+    // Неудачная запись в заглушку её не материализует
+    caught = false;
+    try {
+        sheet.SetCell("Z9999"_pos, "=A1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("Z9999"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+
+    // Заглушки сдвигаются вместе со строками
+    sheet.SetCell("B1"_pos, "=C5*2");
+    ASSERT(sheet.GetCell("C5"_pos)->GetText().empty());
+    sheet.InsertRows(2);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=C6*2");
+    ASSERT(sheet.GetCell("C5"_pos) == nullptr);
+    ASSERT(sheet.GetCell("C6"_pos)->GetText().empty());
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 2 }));
+    sheet.SetCell("C6"_pos, "4");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 8.0);
+    sheet.ClearCell("C6"_pos);
+    sheet.DeleteRows(5);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=#REF!*2");
+
+    // С последней ссылкой заглушка удаляется
+    sheet.ClearCell("A1"_pos);
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet.Graph().CellCount(), 0u);
+    ASSERT(sheet.GetCell("Z9999"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.MemoryUsage().cells, 0u);
+
+    // Заглушка в другой таблице книги
+    Workbook book(1);
+    Sheet& data = book.AddSheet("Data");
+    Sheet& report = book.AddSheet("Report");
+    report.SetCell("A1"_pos, "=Data!C3+1");
+    ASSERT_EQUAL(data.GetPrintableSize(), (Size{ 0, 0 }));
+    std::vector<Position> changed;
+    report.Subscribe([&changed](const std::vector<Position>& positions) {
+        changed = positions;
+    });
+    data.SetCell("C3"_pos, "2");
+    ASSERT_EQUAL(changed, std::vector{ "A1"_pos });
+    ASSERT_EQUAL(std::get<double>(report.GetCell("A1"_pos)->GetValue()), 3.0);
+    changed.clear();
+    data.ClearCell("C3"_pos);
+    ASSERT_EQUAL(changed, std::vector{ "A1"_pos });
+    ASSERT_EQUAL(std::get<double>(report.GetCell("A1"_pos)->GetValue()), 1.0);
+}
+
+void TestConditionalFormulas() {
+    Sheet sheet;
+    auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+
+    // Сравнения дают 1 или 0 и связывают слабее арифметики
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "3");
+    sheet.SetCell("C1"_pos, "=A1+1>=B1");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(1.0));
+    sheet.SetCell("C2"_pos, "=(A1<>B1)*10+(A1=B1)");
+    ASSERT_EQUAL(value("C2"_pos), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=(A1<>B1)*10+(A1=B1)");
+    sheet.SetCell("C3"_pos, "=A1<(B1<A1)");
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "=A1<(B1<A1)");
+    ASSERT_EQUAL(value("C3"_pos), CellInterface::Value(0.0));
+
+    // Невыбранные аргументы не вычисляются, так что их ошибки не мешают
+    sheet.SetCell("D1"_pos, "=IF(A1>B1,1/0,B1-A1)");
+    ASSERT_EQUAL(value("D1"_pos), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=IF(A1>B1,1/0,B1-A1)");
+    sheet.SetCell("D2"_pos, "=AND(A1>5,1/0)+OR(A1,1/0)*2");
+    ASSERT_EQUAL(value("D2"_pos), CellInterface::Value(2.0));
+    sheet.SetCell("D3"_pos, "=IFERROR(A1/(B1-3),-1)+IF(A1=0,5)");
+    ASSERT_EQUAL(value("D3"_pos), CellInterface::Value(-1.0));
+    sheet.SetCell("D4"_pos, "=IF(1,A1,B1)*AND(1,0,A1)");
+    ASSERT_EQUAL(value("D4"_pos), CellInterface::Value(0.0));
+
+    bool caught = false;
+    for (const std::string text : { "=SUM(A1)", "=IF(A1)", "=IFERROR(A1,B1,C1)", "=IF(A1,B1" }) {
+        caught = false;
+        try {
+            sheet.SetCell("E1"_pos, text);
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+
+    // Ссылки формулы - все ветви, но вычисляется лишь выбранная
+    sheet.SetCell("A2"_pos, "1");
+    sheet.SetCell("F1"_pos, "=A1*2");
+    sheet.SetCell("G1"_pos, "=A1*3");
+    sheet.SetCell("H1"_pos, "=IF(A2,F1,G1)");
+    ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetReferencedCells(),
+        (std::vector<Position>{ "F1"_pos, "G1"_pos, "A2"_pos }));
+    sheet.ResetStats();
+    ASSERT_EQUAL(value("H1"_pos), CellInterface::Value(4.0));
+    ASSERT(!sheet.IsUpToDate("G1"_pos));
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(sheet.GetStats().evaluations, 2u);
+#endif
+
+    // Проверка кэша тоже не вычисляет невыбранную ветвь
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ResetStats();
+    ASSERT(!sheet.IsUpToDate("H1"_pos));
+    ASSERT_EQUAL(value("H1"_pos), CellInterface::Value(10.0));
+    ASSERT(!sheet.IsUpToDate("G1"_pos));
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(sheet.GetStats().evaluations, 2u);
+#endif
+
+    // Смена условия переключает ветвь, изменённую, пока она не читалась
+    sheet.SetCell("G1"_pos, "=A1*100");
+    ASSERT(sheet.IsUpToDate("H1"_pos));
+    sheet.SetCell("A2"_pos, "0");
+    ASSERT_EQUAL(value("H1"_pos), CellInterface::Value(500.0));
+
+    // Пустая ячейка выбранной ветви: запись в неё видна формуле
+    sheet.SetCell("H2"_pos, "=IF(A2,0,Z100)");
+    ASSERT_EQUAL(value("H2"_pos), CellInterface::Value(0.0));
+    sheet.SetCell("Z100"_pos, "7");
+    ASSERT_EQUAL(value("H2"_pos), CellInterface::Value(7.0));
+    sheet.ClearCell("Z100"_pos);
+    ASSERT_EQUAL(value("H2"_pos), CellInterface::Value(0.0));
+
+    // Сравнения в протянутых формулах вычисляются пакетом
+    const int rows = 32;
+    for (int i = 0; i < rows; ++i) {
+        const std::string row = std::to_string(i + 10);
+        sheet.SetCell({ i + 9, 0 }, std::to_string(i % 3));
+        sheet.SetCell({ i + 9, 1 }, "1");
+        sheet.SetCell({ i + 9, 2 }, "=A" + row + ">B" + row);
+    }
+    sheet.ResetStats();
+    for (int i = 0; i < rows; ++i) {
+        ASSERT_EQUAL(value({ i + 9, 2 }), CellInterface::Value(i % 3 > 1 ? 1.0 : 0.0));
+    }
+#if SPREADSHEET_STATS
+    ASSERT_EQUAL(sheet.GetStats().batch_evaluations, static_cast<uint64_t>(rows));
+#endif
+}
+
+void TestOperationLogReplay() {
+    const std::string path = "spreadsheet_test.log";
+    std::remove(path.c_str());
+
+    std::ostringstream expected;
+    {
+        Sheet sheet;
+        sheet.EnableOperationLog({ path, 2, std::chrono::milliseconds(0) });
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*A2");
+        try {
+            sheet.SetCell("A1"_pos, "=A3");
+        } catch (const CircularDependencyException&) {
+        }
+        sheet.SetCell("B1"_pos, "temp");
+        sheet.ClearCell("B1"_pos);
+        sheet.SetCell("A1"_pos, "3");
+        // Вставка и отмена записывают текст формулы, в том числе с #REF!
+        sheet.EnableUndo();
+        sheet.SetCell("D2"_pos, "=C1+B3");
+        sheet.CopyRange("D2"_pos, { 1, 1 }, "C1"_pos);
+        sheet.SetCell("C1"_pos, "5");
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=#REF!+A2");
+        sheet.PrintTexts(expected);
+    }
+    {
+        // Оборванная запись в конце журнала отбрасывается
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out << "\x10\x00";
+    }
+
+    Sheet restored;
+    restored.ReplayOperationLog(path);
+    std::ostringstream texts;
+    restored.PrintTexts(texts);
+    ASSERT_EQUAL(texts.str(), expected.str());
+    ASSERT_EQUAL(restored.GetCell("A3"_pos)->GetValue(), CellInterface::Value(16.0));
+    ASSERT_EQUAL(restored.GetCell("C1"_pos)->GetValue(),
+        CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+
+    // Дозапись продолжается после отрезанного хвоста
+    restored.EnableOperationLog({ path, 1, std::chrono::milliseconds(0) });
+    restored.SetCell("C1"_pos, "=A3/4");
+    restored.DisableOperationLog();
+
+    Sheet again;
+    again.ReplayOperationLog(path);
+    ASSERT_EQUAL(again.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    std::remove(path.c_str());
+}
+
+void TestOperationLogRejectedWrites() {
+    const std::string path = "spreadsheet_test.log";
+    std::remove(path.c_str());
+    {
+        Sheet sheet;
+        sheet.EnableOperationLog({ path, 1, std::chrono::milliseconds(0) });
+        sheet.SetCell("A1"_pos, "=B1");
+        // Запись делается до изменения, но отвергнутое изменение её убирает
+        try {
+            sheet.SetCell("B1"_pos, "=A1");
+        } catch (const CircularDependencyException&) {
+        }
+        try {
+            sheet.SetCell("B2"_pos, "=1+");
+        } catch (const FormulaException&) {
+        }
+        try {
+            sheet.InsertRows(0, Position::MAX_ROWS);
+        } catch (const TableTooBigException&) {
+        }
+        sheet.FillDown("A1"_pos, 2);
+        sheet.SetCell("B1"_pos, "2");
+    }
+
+    std::vector<std::string> texts;
+    OperationLog::Replay(path, [&texts](const OperationLog::Record& record) {
+        texts.emplace_back(record.text);
+    });
+    ASSERT_EQUAL(texts, (std::vector<std::string>{ "=B1", "=B2", "=B3", "2" }));
+
+    Sheet restored;
+    restored.ReplayOperationLog(path);
+    ASSERT_EQUAL(restored.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(restored.GetCell("A3"_pos)->GetText(), "=B3");
+
+    std::remove(path.c_str());
+}
+
+void TestOperationLogWriteFailure() {
+#ifndef _WIN32
+    const std::string path = "spreadsheet_test.log";
+    std::remove(path.c_str());
+
+    Sheet sheet;
+    sheet.EnableUndo();
+    sheet.EnableOperationLog({ path, 1, std::chrono::milliseconds(0) });
+    std::vector<Position> notified;
+    sheet.Subscribe([&notified](const std::vector<Position>& changed) {
+        notified.insert(notified.end(), changed.begin(), changed.end());
+    });
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    notified.clear();
+
+    // Файл журнала не может расти: сброс записи на диск не удаётся, но
+    // изменение уже сделано целиком - подписчики о нём знают, его можно отменить
+    rlimit saved_limit;
+    ASSERT(getrlimit(RLIMIT_FSIZE, &saved_limit) == 0);
+    const auto saved_handler = std::signal(SIGXFSZ, SIG_IGN);
+    rlimit limit = saved_limit;
+    limit.rlim_cur = 1;
+    ASSERT(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+    bool thrown = false;
+    try {
+        sheet.SetCell("A1"_pos, "5");
+    } catch (const SheetFileException&) {
+        thrown = true;
+    }
+    setrlimit(RLIMIT_FSIZE, &saved_limit);
+    std::signal(SIGXFSZ, saved_handler);
+
+    ASSERT(thrown);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5");
+    ASSERT_EQUAL(notified, (std::vector{ "A1"_pos, "B1"_pos }));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    // Дальнейшие записи журнал отвергает до изменения таблицы
+    try {
+        sheet.SetCell("A1"_pos, "6");
+        ASSERT(false);
+    } catch (const SheetFileException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5");
+
+    sheet.DisableOperationLog();
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+
+    std::vector<std::string> texts;
+    OperationLog::Replay(path, [&texts](const OperationLog::Record& record) {
+        texts.emplace_back(record.text);
+    });
+    ASSERT_EQUAL(texts, (std::vector<std::string>{ "1", "=A1*2" }));
+    std::remove(path.c_str());
+#endif
+}
+
+void TestSheetStats() {
+#if SPREADSHEET_STATS
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+
+    SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.formulas_parsed, 2u);
+    ASSERT_EQUAL(stats.writes, 3u);
+    ASSERT_EQUAL(stats.cycle_checks, 2u);
+
+    sheet.ResetStats();
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.GetCell("A3"_pos)->GetValue();
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.evaluations, 2u);
+    ASSERT_EQUAL(stats.cache_misses, 2u);
+    ASSERT_EQUAL(stats.cache_hits, 1u);
+    // Вложенный GetValue ячейки A2 не учитывается отдельно
+    ASSERT_EQUAL(stats.get_value_latency.Count(), 2u);
+
+    // Запись не трогает зависимые ячейки: их кэш проверяется при чтении
+    sheet.ResetStats();
+    sheet.SetCell("A1"_pos, "5");
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.set_cell_latency.Count(), 1u);
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(12.0));
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.evaluations, 2u);
+    ASSERT_EQUAL(stats.cache_revalidations, 0u);
+
+    // После записи в постороннюю ячейку кэш подтверждается без вычислений
+    sheet.ResetStats();
+    sheet.SetCell("B1"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(12.0));
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.evaluations, 0u);
+    ASSERT_EQUAL(stats.cache_revalidations, 2u);
+#endif
+}
+
+void TestEvaluationProfiler() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+    sheet.SetCell("B3"_pos, "=A2+A3");
+
+    sheet.Profiler().SetEnabled(true);
+    sheet.GetCell("B3"_pos)->GetValue();
+    sheet.Profiler().SetEnabled(false);
+
+    auto hottest = sheet.Profiler().GetHottestCells(10);
+    ASSERT_EQUAL(hottest.size(), 3u);
+    for (const auto& profile : hottest) {
+        ASSERT_EQUAL(profile.calls, 1u);
+        ASSERT(profile.exclusive_ns <= profile.inclusive_ns);
+    }
+    ASSERT_EQUAL(sheet.Profiler().GetHottestCells(1).size(), 1u);
+
+    // Стеки идут от внешней ячейки к вложенной
+    std::ostringstream folded;
+    sheet.Profiler().PrintFoldedStacks(folded);
+    const std::string stacks = folded.str();
+    ASSERT(stacks.find("B3;A2 ") != std::string::npos || stacks.find("B3;A3;A2 ") != std::string::npos);
+
+    sheet.Profiler().Reset();
+    sheet.SetCell("A1"_pos, "2");
+    sheet.GetCell("B3"_pos)->GetValue();
+    ASSERT(sheet.Profiler().GetHottestCells(10).empty());
+}
 }  // namespace
 
 int main() {
@@ -370,4 +1944,31 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestFormulaSimplification);
+    RUN_TEST(tr, TestSharedSubexpressions);
+    RUN_TEST(tr, TestColumnBatchEvaluation);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestCopyRangeAndFillDown);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestVisitRange);
+    RUN_TEST(tr, TestRecalculateWithDeadline);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestValueCutoffAndChangeNotifications);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestWorkloadGenerator);
+    RUN_TEST(tr, TestReferencedCellsSpan);
+    RUN_TEST(tr, TestCachedFormulaText);
+    RUN_TEST(tr, TestCellGraph);
+    RUN_TEST(tr, TestCellGraphCompaction);
+    RUN_TEST(tr, TestPlaceholderReferences);
+    RUN_TEST(tr, TestConditionalFormulas);
+    RUN_TEST(tr, TestShortCircularReferences);
+    RUN_TEST(tr, TestDependenciesAfterRewrite);
+    RUN_TEST(tr, TestDeepChainEvaluation);
+    RUN_TEST(tr, TestSaveAndOpenSheet);
+    RUN_TEST(tr, TestOperationLogReplay);
+    RUN_TEST(tr, TestOperationLogRejectedWrites);
+    RUN_TEST(tr, TestOperationLogWriteFailure);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestEvaluationProfiler);
 }
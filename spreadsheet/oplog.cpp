@@ -0,0 +1,281 @@
+#include "oplog.h"
+
+#include "storage.h"
+
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    constexpr size_t RECORD_HEADER_SIZE = 2 * sizeof(uint32_t);
+    constexpr size_t PAYLOAD_FIXED_SIZE = sizeof(uint8_t) + 2 * sizeof(int32_t);
+
+    std::array<uint32_t, 256> MakeCrcTable() {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        return table;
+    }
+
+    uint32_t Crc32(const char* data, size_t size) {
+        static const std::array<uint32_t, 256> table = MakeCrcTable();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFFu] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    template <typename T>
+    void PutRaw(std::string& out, T value) {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        out.append(bytes, sizeof(T));
+    }
+
+    template <typename T>
+    T GetRaw(const char* data) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+#ifdef _WIN32
+    int OpenForAppend(const std::string& path) {
+        return ::_open(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY,
+            _S_IREAD | _S_IWRITE);
+    }
+    int TruncateFile(int fd, size_t size) {
+        return ::_chsize(fd, static_cast<long>(size));
+    }
+    int SyncFile(int fd) {
+        return ::_commit(fd);
+    }
+    long WriteSome(int fd, const char* data, size_t size) {
+        return ::_write(fd, data, static_cast<unsigned>(size));
+    }
+    void CloseFile(int fd) {
+        ::_close(fd);
+    }
+#else
+    int OpenForAppend(const std::string& path) {
+        return ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+    int TruncateFile(int fd, size_t size) {
+        return ::ftruncate(fd, static_cast<off_t>(size));
+    }
+    int SyncFile(int fd) {
+        return ::fsync(fd);
+    }
+    long WriteSome(int fd, const char* data, size_t size) {
+        return static_cast<long>(::write(fd, data, size));
+    }
+    void CloseFile(int fd) {
+        ::close(fd);
+    }
+#endif
+
+    bool WriteAll(int fd, const std::string& data) {
+        size_t written = 0;
+        while (written < data.size()) {
+            long n = WriteSome(fd, data.data() + written, data.size() - written);
+            if (n <= 0) {
+                return false;
+            }
+            written += static_cast<size_t>(n);
+        }
+        return true;
+    }
+}
+
+OperationLog::OperationLog(OperationLogOptions options)
+    : options_(std::move(options)) {
+    // Хвост после сбоя мог остаться недописанным: отрезаем его, чтобы
+    // новые записи не оказались за повреждённой
+    const size_t valid_size = Replay(options_.path, [](const Record&) {});
+
+    fd_ = OpenForAppend(options_.path);
+    if (fd_ < 0) {
+        throw SheetFileException("CANNOT OPEN OPERATION LOG " + options_.path);
+    }
+    if (TruncateFile(fd_, valid_size) != 0) {
+        CloseFile(fd_);
+        throw SheetFileException("CANNOT TRUNCATE OPERATION LOG " + options_.path);
+    }
+
+    if (options_.sync_interval.count() > 0) {
+        syncer_ = std::thread([this] { SyncLoop(); });
+    }
+}
+
+OperationLog::~OperationLog() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    if (syncer_.joinable()) {
+        syncer_.join();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    FlushLocked(lock);
+    CloseFile(fd_);
+}
+
+void OperationLog::AppendSet(Position pos, std::string_view text) {
+    Append(OpType::Set, pos, text);
+}
+
+void OperationLog::AppendClear(Position pos) {
+    Append(OpType::Clear, pos, {});
+}
+
+void OperationLog::AppendStructural(OpType type, int first, int count) {
+    Append(type, { first, count }, {});
+}
+
+void OperationLog::Sync() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    FlushLocked(lock);
+    if (failed_) {
+        throw SheetFileException("CANNOT WRITE OPERATION LOG " + options_.path);
+    }
+}
+
+void OperationLog::Append(OpType type, Position pos, std::string_view text) {
+    std::string payload;
+    payload.reserve(PAYLOAD_FIXED_SIZE + text.size());
+    PutRaw(payload, static_cast<uint8_t>(type));
+    PutRaw(payload, static_cast<int32_t>(pos.row));
+    PutRaw(payload, static_cast<int32_t>(pos.col));
+    payload.append(text);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (failed_) {
+        throw SheetFileException("CANNOT WRITE OPERATION LOG " + options_.path);
+    }
+
+    PutRaw(buffer_, static_cast<uint32_t>(payload.size()));
+    PutRaw(buffer_, Crc32(payload.data(), payload.size()));
+    buffer_ += payload;
+    ++staged_ops_;
+}
+
+void OperationLog::Commit() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    committed_bytes_ = buffer_.size();
+    pending_ops_ += std::exchange(staged_ops_, 0);
+}
+
+void OperationLog::SyncIfDue() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (options_.sync_every_ops > 0 && pending_ops_ >= options_.sync_every_ops) {
+        FlushLocked(lock);
+        if (failed_) {
+            throw SheetFileException("CANNOT WRITE OPERATION LOG " + options_.path);
+        }
+    }
+}
+
+void OperationLog::Abort() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    buffer_.resize(committed_bytes_);
+    staged_ops_ = 0;
+}
+
+void OperationLog::FlushLocked(std::unique_lock<std::mutex>& lock) {
+    // Сброс предыдущей пачки мог начаться в фоновом потоке
+    while (flushing_) {
+        flushed_.wait(lock);
+    }
+    if (committed_bytes_ == 0) {
+        return;
+    }
+
+    // Пока пачка пишется на диск, новые записи копятся в свежем буфере.
+    // Неподтверждённые записи остаются в нём.
+    std::string batch;
+    if (committed_bytes_ == buffer_.size()) {
+        batch.swap(buffer_);
+    }
+    else {
+        batch.assign(buffer_, 0, committed_bytes_);
+        buffer_.erase(0, committed_bytes_);
+    }
+    committed_bytes_ = 0;
+    pending_ops_ = 0;
+    flushing_ = true;
+
+    lock.unlock();
+    const bool ok = WriteAll(fd_, batch) && SyncFile(fd_) == 0;
+    lock.lock();
+
+    flushing_ = false;
+    if (!ok) {
+        failed_ = true;
+    }
+    flushed_.notify_all();
+}
+
+void OperationLog::SyncLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        wake_.wait_for(lock, options_.sync_interval);
+        if (pending_ops_ > 0) {
+            FlushLocked(lock);
+        }
+    }
+}
+
+size_t OperationLog::Replay(const std::string& path,
+    const std::function<void(const Record&)>& apply) {
+    if (!std::ifstream(path)) {
+        return 0;
+    }
+
+    MappedFile file(path);
+    const char* data = file.Data();
+    const size_t size = file.Size();
+
+    size_t offset = 0;
+    while (size - offset >= RECORD_HEADER_SIZE) {
+        const uint32_t length = GetRaw<uint32_t>(data + offset);
+        const uint32_t crc = GetRaw<uint32_t>(data + offset + sizeof(uint32_t));
+        const char* payload = data + offset + RECORD_HEADER_SIZE;
+
+        if (length < PAYLOAD_FIXED_SIZE || size - offset - RECORD_HEADER_SIZE < length
+            || Crc32(payload, length) != crc) {
+            break;
+        }
+
+        Record record{
+            static_cast<OpType>(GetRaw<uint8_t>(payload)),
+            { GetRaw<int32_t>(payload + 1), GetRaw<int32_t>(payload + 1 + sizeof(int32_t)) },
+            std::string_view(payload + PAYLOAD_FIXED_SIZE, length - PAYLOAD_FIXED_SIZE),
+        };
+        if (record.type < OpType::Set || record.type > OpType::DeleteCols) {
+            break;
+        }
+        apply(record);
+
+        offset += RECORD_HEADER_SIZE + length;
+    }
+
+    return offset;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Параметры журнала операций.
+// Запись считается надёжной после fsync. Записи копятся в буфере и
+// сбрасываются на диск пачкой (group commit): как только накопилось
+// sync_every_ops операций или прошло sync_interval с последнего сброса.
+struct OperationLogOptions {
+    std::string path;
+    // 1 - fsync после каждой операции, 0 - без ограничения по количеству
+    size_t sync_every_ops = 1;
+    // 0 - без фонового сброса по таймеру
+    std::chrono::milliseconds sync_interval{ 0 };
+};
+
+// Журнал изменений ячеек, открытый только на дозапись.
+// Запись делается до изменения таблицы, но остаётся неподтверждённой: на
+// диск уходят лишь записи, подтверждённые Commit после успешного изменения.
+// Если таблица изменение отвергла, Abort отбрасывает его запись, так что в
+// журнале есть только проверенные операции.
+// Формат записи: длина полезной нагрузки (u32), её CRC32 (u32), нагрузка:
+// тип операции (u8), строка (i32), столбец (i32), текст ячейки.
+// Для вставки и удаления строк и столбцов вместо строки и столбца пишутся
+// первый индекс и количество, текст пуст.
+class OperationLog {
+public:
+    enum class OpType : uint8_t {
+        Set = 1,
+        Clear = 2,
+        InsertRows = 3,
+        InsertCols = 4,
+        DeleteRows = 5,
+        DeleteCols = 6,
+    };
+
+    struct Record {
+        OpType type;
+        // Для вставки и удаления: row - первый индекс, col - количество
+        Position pos;
+        std::string_view text;
+    };
+
+    // Открывает журнал; оборванная запись в конце файла отбрасывается
+    explicit OperationLog(OperationLogOptions options);
+    // Сбрасывает на диск всё накопленное
+    ~OperationLog();
+
+    OperationLog(const OperationLog&) = delete;
+    OperationLog& operator=(const OperationLog&) = delete;
+
+    void AppendSet(Position pos, std::string_view text);
+    void AppendClear(Position pos);
+    // Вставка или удаление count строк или столбцов, начиная с first
+    void AppendStructural(OpType type, int first, int count);
+
+    // Подтверждает записи, добавленные после предыдущего Commit или Abort.
+    // Не пишет на диск и не бросает исключений: изменение таблицы уже
+    // сделано, подтверждённые записи сбрасывает SyncIfDue.
+    void Commit();
+    // Сбрасывает подтверждённые записи, если по правилам group commit пора.
+    // Если запись на диск не удалась, бросает SheetFileException.
+    void SyncIfDue();
+    // Отбрасывает неподтверждённые записи
+    void Abort();
+
+    // Немедленно сбрасывает накопленные записи и вызывает fsync
+    void Sync();
+
+    // Последовательно передаёт в apply все целые записи журнала.
+    // Чтение останавливается на первой повреждённой или оборванной записи.
+    // Возвращает длину корректного префикса файла в байтах.
+    static size_t Replay(const std::string& path, const std::function<void(const Record&)>& apply);
+
+private:
+    void Append(OpType type, Position pos, std::string_view text);
+    // Пишет накопленный буфер и вызывает fsync. Вызывается под mutex_,
+    // на время записи блокировка отпускается.
+    void FlushLocked(std::unique_lock<std::mutex>& lock);
+    void SyncLoop();
+
+    OperationLogOptions options_;
+    int fd_ = -1;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable flushed_;
+    // Подтверждённые записи, за ними - неподтверждённые
+    std::string buffer_;
+    size_t committed_bytes_ = 0;
+    size_t pending_ops_ = 0;
+    size_t staged_ops_ = 0;
+    bool flushing_ = false;
+    bool failed_ = false;
+    bool stop_ = false;
+    std::thread syncer_;
+};
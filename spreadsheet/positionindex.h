@@ -0,0 +1,137 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <iterator>
+#include <optional>
+#include <set>
+#include <tuple>
+#include <vector>
+
+// Упорядоченное множество позиций таблицы. Позиции хранятся в двух
+// порядках: по строкам (сначала строка, затем столбец) - для обхода
+// прямоугольников и строк, и по столбцам - для обхода столбцов. Так
+// вставка и удаление строк или столбцов находят сдвигаемые позиции, не
+// перебирая остальные. Порядок по столбцам строится при первом обращении
+// к нему: таблица, где столбцы не вставляются и не удаляются, его не хранит.
+class PositionIndex {
+public:
+    // Порядки сравнивают позиции на месте, без вызова Position::operator<
+    struct RowOrder {
+        bool operator()(Position lhs, Position rhs) const {
+            return std::tie(lhs.row, lhs.col) < std::tie(rhs.row, rhs.col);
+        }
+    };
+
+    struct ColumnOrder {
+        bool operator()(Position lhs, Position rhs) const {
+            return std::tie(lhs.col, lhs.row) < std::tie(rhs.col, rhs.row);
+        }
+    };
+
+    void Insert(Position pos) {
+        by_rows_.insert(pos);
+        if (by_cols_) {
+            by_cols_->insert(pos);
+        }
+    }
+
+    // Вставляет позиции пачкой: в каждом дереве они вставляются по порядку,
+    // с подсказкой, и соседние позиции не ищутся заново
+    void Insert(std::vector<Position> positions) {
+        if (!std::is_sorted(positions.begin(), positions.end(), RowOrder{})) {
+            std::sort(positions.begin(), positions.end(), RowOrder{});
+        }
+        InsertIn(by_rows_, positions);
+        if (by_cols_) {
+            std::sort(positions.begin(), positions.end(), ColumnOrder{});
+            InsertIn(*by_cols_, positions);
+        }
+    }
+
+    void Erase(Position pos) {
+        by_rows_.erase(pos);
+        if (by_cols_) {
+            by_cols_->erase(pos);
+        }
+    }
+
+    // Позиции в порядке строк
+    const std::set<Position, RowOrder>& ByRows() const {
+        return by_rows_;
+    }
+
+    // Позиции, строка (rows == true) или столбец которых не меньше first
+    std::vector<Position> From(bool rows, int first) const {
+        if (rows) {
+            return { by_rows_.lower_bound({ first, 0 }), by_rows_.end() };
+        }
+        const auto& by_cols = ByCols();
+        return { by_cols.lower_bound({ 0, first }), by_cols.end() };
+    }
+
+    // Сдвигает на shift строку (rows == true) или столбец позиций, у которых
+    // они не меньше first. Позиция не должна попасть на оставшуюся на месте.
+    // Взаимный порядок позиций в обоих деревьях при сдвиге не меняется, поэтому
+    // узлы вставляются обратно с подсказкой, без поиска.
+    void Shift(bool rows, int first, int shift) {
+        std::vector<Position> moved = From(rows, first);
+        // Сдвиг вниз начинается с последних позиций, вверх - с первых: так
+        // новая позиция не совпадает с ещё не сдвинутой
+        if (shift > 0) {
+            std::reverse(moved.begin(), moved.end());
+        }
+        ShiftIn(by_rows_, moved, rows, shift);
+        if (by_cols_) {
+            ShiftIn(*by_cols_, moved, rows, shift);
+        }
+    }
+
+    // Наибольшая строка (rows == true) или столбец; -1, если позиций нет
+    int Last(bool rows) const {
+        if (by_rows_.empty()) {
+            return -1;
+        }
+        return rows ? by_rows_.rbegin()->row : ByCols().rbegin()->col;
+    }
+
+    size_t Size() const {
+        return by_rows_.size();
+    }
+
+    // Память узлов деревьев: цвет, три указателя и позиция
+    size_t MemoryUsage() const {
+        return (by_cols_ ? 2 : 1) * by_rows_.size() * (4 * sizeof(void*) + sizeof(Position));
+    }
+
+private:
+    const std::set<Position, ColumnOrder>& ByCols() const {
+        if (!by_cols_) {
+            by_cols_.emplace(by_rows_.begin(), by_rows_.end());
+        }
+        return *by_cols_;
+    }
+
+    template <typename Set>
+    static void InsertIn(Set& positions, const std::vector<Position>& sorted) {
+        auto hint = positions.end();
+        for (const Position& pos : sorted) {
+            hint = std::next(positions.insert(hint, pos));
+        }
+    }
+
+    template <typename Set>
+    static void ShiftIn(Set& positions, const std::vector<Position>& moved, bool rows, int shift) {
+        for (const Position& pos : moved) {
+            const auto it = positions.find(pos);
+            const auto next = std::next(it);
+            auto node = positions.extract(it);
+            (rows ? node.value().row : node.value().col) += shift;
+            positions.insert(next, std::move(node));
+        }
+    }
+
+    std::set<Position, RowOrder> by_rows_;
+    mutable std::optional<std::set<Position, ColumnOrder>> by_cols_;
+};
@@ -0,0 +1,106 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+void EvaluationProfiler::Enter(Position pos) {
+    const uint32_t parent = stack_.empty() ? ROOT : stack_.back().node;
+    const uint32_t node = GetChild(parent, pos);
+    stack_.push_back({ node, Clock::now(), 0 });
+}
+
+void EvaluationProfiler::Exit() {
+    const Frame frame = stack_.back();
+    stack_.pop_back();
+
+    const uint64_t inclusive = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - frame.start).count());
+    const uint64_t exclusive = inclusive - std::min(inclusive, frame.child_ns);
+
+    StackNode& node = nodes_[frame.node];
+    node.exclusive_ns += exclusive;
+
+    CellProfile& profile = cells_[node.pos];
+    profile.pos = node.pos;
+    ++profile.calls;
+    profile.inclusive_ns += inclusive;
+    profile.exclusive_ns += exclusive;
+
+    if (!stack_.empty()) {
+        stack_.back().child_ns += inclusive;
+    }
+}
+
+uint32_t EvaluationProfiler::GetChild(uint32_t parent, Position pos) {
+    auto it = nodes_[parent].children.find(pos);
+    if (it != nodes_[parent].children.end()) {
+        return it->second;
+    }
+    const uint32_t id = static_cast<uint32_t>(nodes_.size());
+    // Вставка может перераспределить nodes_, поэтому сначала добавляем узел
+    nodes_.push_back({ pos, parent, 0, {} });
+    nodes_[parent].children.emplace(pos, id);
+    return id;
+}
+
+void EvaluationProfiler::Reset() {
+    stack_.clear();
+    nodes_.resize(1);
+    nodes_[ROOT].children.clear();
+    cells_.clear();
+}
+
+std::vector<EvaluationProfiler::CellProfile> EvaluationProfiler::GetHottestCells(size_t count) const {
+    std::vector<CellProfile> result;
+    result.reserve(cells_.size());
+    for (const auto& [pos, profile] : cells_) {
+        result.push_back(profile);
+    }
+
+    auto hotter = [](const CellProfile& lhs, const CellProfile& rhs) {
+        if (lhs.exclusive_ns != rhs.exclusive_ns) {
+            return lhs.exclusive_ns > rhs.exclusive_ns;
+        }
+        return lhs.pos < rhs.pos;
+    };
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(), hotter);
+    result.resize(count);
+    return result;
+}
+
+void EvaluationProfiler::PrintFoldedStacks(std::ostream& out) const {
+    std::vector<Position> path;
+    for (uint32_t id = ROOT + 1; id < nodes_.size(); ++id) {
+        if (nodes_[id].exclusive_ns == 0) {
+            continue;
+        }
+
+        path.clear();
+        for (uint32_t cur = id; cur != ROOT; cur = nodes_[cur].parent) {
+            path.push_back(nodes_[cur].pos);
+        }
+
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            if (it != path.rbegin()) {
+                out << ';';
+            }
+            out << it->ToString();
+        }
+        out << ' ' << nodes_[id].exclusive_ns << '\n';
+    }
+}
+
+void EvaluationProfiler::PrintHottestCells(std::ostream& out, size_t count) const {
+    out << std::left << std::setw(10) << "cell" << std::right
+        << std::setw(10) << "calls"
+        << std::setw(16) << "exclusive_ns"
+        << std::setw(16) << "inclusive_ns" << '\n';
+    for (const CellProfile& profile : GetHottestCells(count)) {
+        out << std::left << std::setw(10) << profile.pos.ToString() << std::right
+            << std::setw(10) << profile.calls
+            << std::setw(16) << profile.exclusive_ns
+            << std::setw(16) << profile.inclusive_ns << '\n';
+    }
+}
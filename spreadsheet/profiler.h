@@ -0,0 +1,100 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <unordered_map>
+#include <vector>
+
+// Профилировщик вычислений формул по ячейкам.
+// Каждое вычисление формульной ячейки - кадр стека; вложенные кадры
+// появляются, когда формула читает другую невычисленную ячейку.
+// Для каждой ячейки копятся число вычислений, полное (inclusive) время и
+// собственное (exclusive) время без учёта вложенных вычислений.
+class EvaluationProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct CellProfile {
+        Position pos;
+        uint64_t calls = 0;
+        uint64_t inclusive_ns = 0;
+        uint64_t exclusive_ns = 0;
+    };
+
+    bool IsEnabled() const {
+        return enabled_;
+    }
+
+    void SetEnabled(bool enabled) {
+        enabled_ = enabled;
+    }
+
+    // Начало и конец вычисления ячейки
+    void Enter(Position pos);
+    void Exit();
+
+    // Сбрасывает накопленные данные
+    void Reset();
+
+    // Ячейки с наибольшим собственным временем, по убыванию
+    std::vector<CellProfile> GetHottestCells(size_t count) const;
+
+    // Выводит стеки в свёрнутом формате (folded stacks): по строке на
+    // цепочку вычислений вида "A3;A2;A1 <собственное время в нс>", от
+    // внешней ячейки к вложенной. Формат понимают flamegraph.pl,
+    // speedscope и аналогичные инструменты.
+    void PrintFoldedStacks(std::ostream& out) const;
+
+    // Выводит count самых затратных ячеек в виде таблицы
+    void PrintHottestCells(std::ostream& out, size_t count) const;
+
+private:
+    // Узел дерева стеков: ячейка и путь к ней
+    struct StackNode {
+        Position pos;
+        uint32_t parent;
+        uint64_t exclusive_ns = 0;
+        std::unordered_map<Position, uint32_t> children;
+    };
+
+    struct Frame {
+        uint32_t node;
+        Clock::time_point start;
+        uint64_t child_ns = 0;
+    };
+
+    static constexpr uint32_t ROOT = 0;
+
+    uint32_t GetChild(uint32_t parent, Position pos);
+
+    bool enabled_ = false;
+    std::vector<Frame> stack_;
+    std::vector<StackNode> nodes_{ StackNode{ Position::NONE, ROOT, 0, {} } };
+    std::unordered_map<Position, CellProfile> cells_;
+};
+
+// Кадр профилировщика на время вычисления ячейки (если профилирование включено)
+class ProfileScope {
+public:
+    ProfileScope(EvaluationProfiler& profiler, Position pos)
+        : profiler_(profiler.IsEnabled() ? &profiler : nullptr) {
+        if (profiler_) {
+            profiler_->Enter(pos);
+        }
+    }
+
+    ~ProfileScope() {
+        if (profiler_) {
+            profiler_->Exit();
+        }
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+private:
+    EvaluationProfiler* profiler_;
+};
@@ -0,0 +1,142 @@
+#include "recalc.h"
+
+#include "cell.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <utility>
+
+bool RecalcScheduler::Run(Sheet& sheet, Clock::time_point deadline) {
+    // Срок проверяется после вычисления, так что каждый запуск хоть
+    // немного продвигает пересчёт. Наблюдаемая ячейка пересчитывается
+    // целиком, вместе с конусом формул, от которых зависит.
+    for (const Position& pos : observed_) {
+        const auto* cell = static_cast<const Cell*>(sheet.FindCell(pos));
+        if (!cell || cell->IsUpToDate()) {
+            continue;
+        }
+        cell->GetValue();
+        if (Clock::now() >= deadline) {
+            return false;
+        }
+    }
+
+    if (all_changed_ || !changed_.empty()) {
+        Plan(sheet);
+    }
+
+    // Ячейки, от которых зависит формула, стоят в плане раньше неё, поэтому
+    // каждое вычисление читает уже пересчитанные значения и занимает мало
+    // времени: срок проверяется после каждой ячейки
+    while (next_ < order_.size()) {
+        if (const CellInterface* cell = sheet.FindCell(order_[next_])) {
+            cell->GetValue();
+        }
+        ++next_;
+        if (next_ < order_.size() && Clock::now() >= deadline) {
+            return false;
+        }
+    }
+    order_.clear();
+    next_ = 0;
+    return true;
+}
+
+void RecalcScheduler::MovePositions(const std::function<std::optional<Position>(Position)>& move) {
+    std::unordered_set<Position> changed;
+    for (const Position& pos : changed_) {
+        if (const std::optional<Position> moved = move(pos)) {
+            changed.insert(*moved);
+        }
+    }
+    changed_ = std::move(changed);
+    std::vector<Position> order;
+    for (size_t i = next_; i < order_.size(); ++i) {
+        if (const std::optional<Position> moved = move(order_[i])) {
+            order.push_back(*moved);
+        }
+    }
+    order_ = std::move(order);
+    next_ = 0;
+}
+
+std::vector<Position> RecalcScheduler::TakeRoots(Sheet& sheet) {
+    std::vector<Position> roots;
+    if (all_changed_) {
+        sheet.VisitRange({ 0, 0 }, { Position::MAX_ROWS, Position::MAX_COLS },
+            [&roots](Position pos, const CellInterface&) {
+                roots.push_back(pos);
+            });
+    }
+    else {
+        roots.assign(changed_.begin(), changed_.end());
+        roots.insert(roots.end(), order_.begin() + next_, order_.end());
+    }
+    all_changed_ = false;
+    changed_.clear();
+    order_.clear();
+    next_ = 0;
+    return roots;
+}
+
+std::vector<const Cell*> RecalcScheduler::DependencyOrder(const std::vector<const Cell*>& roots) {
+    // Обход в глубину по зависимым ячейкам: ячейка покидается после всех
+    // зависящих от неё, и обратный порядок выхода - порядок зависимостей
+    if (roots.empty()) {
+        return {};
+    }
+    // У ячеек книги граф общий
+    const CellGraph& graph = roots.front()->GetSheet().Graph();
+    CellGraph::Marks visited(graph);
+    // Ячейка и её ещё не пройденные зависимые
+    struct Frame {
+        CellId id;
+        CellGraph::EdgeRange::Iterator next;
+        CellGraph::EdgeRange::Iterator end;
+    };
+    std::vector<Frame> stack;
+    std::vector<const Cell*> finished;
+    auto push = [&](CellId id) {
+        const CellGraph::EdgeRange dependents = graph.GetDependents(id);
+        stack.push_back({ id, dependents.begin(), dependents.end() });
+    };
+    for (const Cell* start : roots) {
+        if (!visited.Mark(start->GetId())) {
+            continue;
+        }
+        push(start->GetId());
+        while (!stack.empty()) {
+            Frame& frame = stack.back();
+            if (frame.next == frame.end) {
+                finished.push_back(graph.GetCell(frame.id));
+                stack.pop_back();
+                continue;
+            }
+            const CellId dependent = *frame.next;
+            ++frame.next;
+            if (visited.Mark(dependent)) {
+                push(dependent);
+            }
+        }
+    }
+    std::reverse(finished.begin(), finished.end());
+    return finished;
+}
+
+void RecalcScheduler::Plan(Sheet& sheet) {
+    std::vector<const Cell*> roots;
+    for (const Position& pos : TakeRoots(sheet)) {
+        sheet.AddDependencyRoots(pos, roots);
+    }
+
+    // Ячейки других таблиц остаются в обходе: через них изменение может
+    // вернуться в эту таблицу
+    for (const Cell* cell : DependencyOrder(roots)) {
+        if (&cell->GetSheet() == &sheet) {
+            order_.push_back(cell->GetPosition());
+        }
+        else {
+            cell->GetSheet().Scheduler().NoteChanged(cell->GetPosition());
+        }
+    }
+}
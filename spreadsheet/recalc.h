@@ -0,0 +1,79 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <unordered_set>
+#include <vector>
+
+class Cell;
+class Sheet;
+
+// Пересчёт устаревших формул по частям (см. Sheet::Recalculate).
+// Таблица сообщает об изменённых ячейках; при очередном запуске из них
+// строится план: формулы, транзитивно зависящие от изменений, в порядке
+// зависимостей. План выполняется, пока не истечёт время, и продолжается
+// со следующего запуска.
+class RecalcScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Ячейка pos изменилась: зависящие от неё формулы нужно пересчитать
+    void NoteChanged(Position pos) {
+        if (!all_changed_) {
+            changed_.insert(pos);
+        }
+    }
+
+    // То же для ячеек вставки
+    void NoteChanged(Span<const Position> positions) {
+        if (!all_changed_) {
+            changed_.reserve(changed_.size() + positions.size());
+            changed_.insert(positions.begin(), positions.end());
+        }
+    }
+
+    // Позиции ячеек сдвинулись: изменения и невыполненная часть плана
+    // переносятся на новые позиции, удалённые (move вернул std::nullopt)
+    // забываются
+    void MovePositions(const std::function<std::optional<Position>(Position)>& move);
+
+    // Наблюдаемые ячейки пересчитываются в первую очередь
+    void Observe(Position pos) {
+        observed_.insert(pos);
+    }
+
+    void Unobserve(Position pos) {
+        observed_.erase(pos);
+    }
+
+    // Пересчитывает формулы sheet до момента deadline, но не меньше одной.
+    // Возвращает true, если устаревших формул не осталось.
+    bool Run(Sheet& sheet, Clock::time_point deadline);
+
+    // Позиции ячеек, от которых нужно начать пересчёт: изменённые ячейки и
+    // ещё не выполненная часть плана (все ячейки, если изменения не
+    // отслеживались). План забывается: пересчёт берёт на себя вызывающий.
+    std::vector<Position> TakeRoots(Sheet& sheet);
+
+    // Ячейки, транзитивно зависящие от roots, вместе с ними самими, в порядке
+    // зависимостей: ячейка идёт после всех ячеек, на которые ссылается.
+    // Обход идёт и по ячейкам других таблиц книги.
+    static std::vector<const Cell*> DependencyOrder(const std::vector<const Cell*>& roots);
+
+private:
+    // Строит план по изменённым ячейкам и ещё не выполненной части прежнего.
+    // Формулы других таблиц книги, зависящие от изменений, передаются их
+    // планировщикам.
+    void Plan(Sheet& sheet);
+
+    // Пока изменения не отслеживаются, первый запуск планирует всю таблицу
+    bool all_changed_ = true;
+    std::unordered_set<Position> changed_;
+    // План: позиции в порядке зависимостей и первая невыполненная
+    std::vector<Position> order_;
+    size_t next_ = 0;
+    std::unordered_set<Position> observed_;
+};
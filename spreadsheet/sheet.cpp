@@ -2,25 +2,291 @@
 
 #include "cell.h"
 #include "common.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <exception>
 #include <iostream>
 #include <optional>
+#include <utility>
 
 using namespace std::literals;
 
+namespace {
+    // Подъём из файла стольких ячеек сразу считается массовой загрузкой:
+    // после него граф зависимостей сжимается
+    constexpr size_t BULK_LOAD_CELLS = 1024;
+
+    // Правит ссылки формулы на таблицу sheet (пустое имя - на свою таблицу)
+    // при вставке или удалении count строк или столбцов, начиная с first
+    FormulaInterface::HandlingResult HandleStructureChange(FormulaInterface& formula,
+        OperationLog::OpType type, int first, int count, std::string_view sheet) {
+        switch (type) {
+        case OperationLog::OpType::InsertRows:
+            return formula.HandleInsertedRows(first, count, sheet);
+        case OperationLog::OpType::InsertCols:
+            return formula.HandleInsertedCols(first, count, sheet);
+        case OperationLog::OpType::DeleteRows:
+            return formula.HandleDeletedRows(first, count, sheet);
+        default:
+            return formula.HandleDeletedCols(first, count, sheet);
+        }
+    }
+
+    // Записи журнала операций, сделанные до изменения таблицы. Успешное
+    // изменение подтверждает их вызовом Commit; если оно прервалось
+    // исключением, записи отбрасываются. На диск подтверждённые записи
+    // уходят позже, в SyncOperationLogIfDue.
+    class LoggedChange {
+    public:
+        explicit LoggedChange(OperationLog* log)
+            : log_(log) {
+        }
+
+        ~LoggedChange() {
+            if (log_) {
+                log_->Abort();
+            }
+        }
+
+        LoggedChange(const LoggedChange&) = delete;
+        LoggedChange& operator=(const LoggedChange&) = delete;
+
+        void Commit() {
+            if (log_) {
+                std::exchange(log_, nullptr)->Commit();
+            }
+        }
+
+    private:
+        OperationLog* log_;
+    };
+}
+
+// Прежнее содержимое ячеек, изменённых внутри самой внешней области,
+// записывается в историю одной записью. Если область покидается по
+// исключению, запись отбрасывается.
+class Sheet::ChangeScope {
+public:
+    explicit ChangeScope(Sheet& sheet)
+        : sheet_(sheet)
+        , uncaught_(std::uncaught_exceptions()) {
+        ++sheet_.change_depth_;
+    }
+
+    ~ChangeScope() {
+        if (--sheet_.change_depth_ > 0) {
+            return;
+        }
+        UndoHistory::Entry changes = std::move(sheet_.changes_);
+        sheet_.changes_.clear();
+        if (sheet_.history_ && !changes.empty() && std::uncaught_exceptions() == uncaught_) {
+            sheet_.history_->Record(std::move(changes));
+        }
+    }
+
+    ChangeScope(const ChangeScope&) = delete;
+    ChangeScope& operator=(const ChangeScope&) = delete;
+
+private:
+    Sheet& sheet_;
+    int uncaught_;
+};
+
+Sheet::Sheet(std::unique_ptr<MappedSheetFile> source)
+    : source_(std::move(source)) {
+}
+
+Sheet::Sheet(Workbook& workbook, std::string name)
+    : revision_(&workbook.revision_),
+    graph_(&workbook.graph_),
+    workbook_(&workbook),
+    name_(std::move(name)) {
+}
+
 Sheet::~Sheet() {}
 
-void Sheet::SetCell(Position pos, std::string text) {
+Sheet* Sheet::FindSheet(std::string_view name) const {
+    return workbook_ ? workbook_->GetSheet(name) : nullptr;
+}
+
+void Sheet::LinkReference(Position pos, const Cell& dependent) {
+    graph_->AddDependent(ReferenceNode(pos, nullptr), dependent.GetId());
+}
+
+CellId Sheet::ReferenceNode(Position pos, std::vector<Position>* new_placeholders) {
+    if (Cell* cell = LoadCell(pos)) {
+        return cell->GetId();
+    }
+    auto [it, inserted] = placeholders_.try_emplace(pos);
+    if (inserted) {
+        it->second.id = graph_->Add(nullptr);
+        if (new_placeholders) {
+            new_placeholders->push_back(pos);
+        }
+        else if (placeholder_positions_) {
+            placeholder_positions_->Insert(pos);
+        }
+    }
+    return it->second.id;
+}
+
+void Sheet::UnlinkReference(Position pos, const Cell& dependent) {
+    auto it = placeholders_.find(pos);
+    if (it == placeholders_.end()) {
+        if (Cell* cell = LoadCell(pos)) {
+            cell->RemoveDependence(&dependent);
+        }
+        return;
+    }
+    const CellId id = it->second.id;
+    graph_->RemoveDependent(id, dependent.GetId());
+    if (graph_->GetDependents(id).empty()) {
+        // Пустая ячейка заглушки удаляется раньше номера, который она видит
+        placeholders_.erase(it);
+        if (placeholder_positions_) {
+            placeholder_positions_->Erase(pos);
+        }
+        graph_->Remove(id);
+    }
+}
+
+void Sheet::AddDependencyRoots(Position pos, std::vector<const Cell*>& roots) const {
+    if (const CellInterface* cell = FindCell(pos)) {
+        roots.push_back(static_cast<const Cell*>(cell));
+    }
+    else if (auto it = placeholders_.find(pos); it != placeholders_.end()) {
+        for (const CellId dependent : graph_->GetDependents(it->second.id)) {
+            roots.push_back(graph_->GetCell(dependent));
+        }
+    }
+}
+
+void Sheet::EraseCell(Position pos) {
+    auto it = printable_.find(pos);
+    const Cell* cell = static_cast<const Cell*>(it->second.get());
+    if (cell->HasDependents()) {
+        for (const CellId dependent : cell->GetDependents()) {
+            graph_->GetCell(dependent)->ClearCache();
+        }
+        placeholders_.emplace(pos, Placeholder{ cell->GetId(), nullptr });
+        if (placeholder_positions_) {
+            placeholder_positions_->Insert(pos);
+        }
+        graph_->SetCell(cell->GetId(), nullptr);
+    }
+    printable_.erase(it);
+    occupied_.Erase(pos);
+}
+
+PositionIndex& Sheet::PlaceholderPositions() {
+    if (!placeholder_positions_) {
+        std::vector<Position> positions;
+        positions.reserve(placeholders_.size());
+        for (const auto& [pos, placeholder] : placeholders_) {
+            positions.push_back(pos);
+        }
+        placeholder_positions_.emplace().Insert(std::move(positions));
+    }
+    return *placeholder_positions_;
+}
+
+std::optional<CellId> Sheet::FindNode(Position pos) const {
+    if (auto it = printable_.find(pos); it != printable_.end()) {
+        return static_cast<const Cell*>(it->second.get())->GetId();
+    }
+    if (auto it = placeholders_.find(pos); it != placeholders_.end()) {
+        return it->second.id;
+    }
+    return std::nullopt;
+}
+
+CellInterface::Value Sheet::GetExternalValue(std::string_view sheet_name, Position pos) const {
+    const Sheet* sheet = FindSheet(sheet_name);
+    if (!sheet) {
+        return FormulaError(FormulaError::Category::Ref);
+    }
+    const CellInterface* cell = sheet->FindCell(pos);
+    if (!cell) {
+        return 0.0;
+    }
+    return static_cast<const Cell*>(cell)->PeekValue();
+}
+
+Cell* Sheet::PrepareCell(Position pos, PasteBatch* batch) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("INVALID POSITION");
     }
-    try {
-        printable_.emplace(pos, std::make_unique<Cell>(*this));
-        printable_.at(pos)->Set(std::move(text));
+    if (source_) {
+        // Сначала поднимаем сохранённую ячейку, чтобы неудачная запись
+        // не затёрла её содержимое пустой ячейкой
+        LoadCell(pos);
     }
-    catch (const FormulaException&) {
-        throw;
+    auto [it, inserted] = printable_.try_emplace(pos);
+    if (inserted) {
+        // Заглушка становится ячейкой вместе со ссылающимися на неё формулами.
+        // Уже выданная GetCell пустая ячейка остаётся той же.
+        if (auto placeholder = placeholders_.find(pos); placeholder != placeholders_.end()) {
+            Placeholder& node = placeholder->second;
+            if (node.cell) {
+                graph_->SetCell(node.id, static_cast<Cell*>(node.cell.get()));
+                it->second = std::move(node.cell);
+            }
+            else {
+                it->second = std::make_unique<Cell>(*this, pos, node.id);
+            }
+            placeholders_.erase(placeholder);
+            if (placeholder_positions_) {
+                placeholder_positions_->Erase(pos);
+            }
+        }
+        else {
+            it->second = std::make_unique<Cell>(*this, pos);
+        }
+        if (batch) {
+            batch->new_positions.push_back(pos);
+        }
+        else {
+            occupied_.Insert(pos);
+        }
+    }
+    return static_cast<Cell*>(it->second.get());
+}
+
+void Sheet::SetCell(Position pos, std::string text) {
+    SHEET_STATS_LATENCY(stats_.set_cell_latency);
+    SHEET_STATS(++stats_.writes);
+    {
+        ChangeBatch batch(*this);
+        ChangeScope change(*this);
+        Cell* cell = PrepareCell(pos);
+        LoggedChange logged(log_.get());
+        try {
+            if (log_) {
+                log_->AppendSet(pos, text);
+            }
+            SetCellText(cell, std::move(text));
+            logged.Commit();
+        }
+        catch (...) {
+            // Неудачная запись не оставляет пустой ячейки: ссылки на неё, если
+            // они есть, снова хранит заглушка
+            if (cell->IsEmpty()) {
+                EraseCell(pos);
+            }
+            throw;
+        }
+        NoteChanged(pos);
+    }
+    SyncOperationLogIfDue();
+}
+
+void Sheet::SetCellText(Cell* cell, std::string text) {
+    if (RecordsHistory()) {
+        changes_.push_back(cell->Replace(std::move(text)));
+    }
+    else {
+        cell->Set(std::move(text));
     }
 }
 
@@ -30,35 +296,739 @@ const CellInterface* Sheet::GetCell(Position pos) const {
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
+    if (Cell* cell = LoadCell(pos)) {
+        return cell;
+    }
+    auto it = placeholders_.find(pos);
+    if (it == placeholders_.end()) {
+        return nullptr;
+    }
+    // На пустую ячейку ссылаются формулы: её объект создаётся лишь сейчас и
+    // хранится при заглушке, не расширяя таблицу
+    Placeholder& placeholder = it->second;
+    if (!placeholder.cell) {
+        placeholder.cell = std::make_unique<Cell>(*this, pos, placeholder.id);
+        graph_->SetCell(placeholder.id, nullptr);
+    }
+    return placeholder.cell.get();
+}
+
+const CellInterface* Sheet::FindCell(Position pos) const {
+    return const_cast<Sheet*>(this)->LoadCell(pos);
+}
+
+Cell* Sheet::LoadCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("INVALID POSITION");
     }
 
     auto it = printable_.find(pos);
     if (it == printable_.end()) {
-        return nullptr;
+        return source_ ? static_cast<Cell*>(MaterializeCell(pos)) : nullptr;
+    }
+    return static_cast<Cell*>(it->second.get());
+}
+
+CellInterface* Sheet::MaterializeCell(Position pos) {
+    // Обход явным стеком: глубина цепочки ссылок в файле не ограничена
+    std::vector<Position> pending{ pos };
+    std::vector<Cell*> loaded;
+
+    while (!pending.empty()) {
+        Position p = pending.back();
+        pending.pop_back();
+
+        if (printable_.count(p) || detached_.count(p)) {
+            continue;
+        }
+        auto text = source_->Find(p);
+        if (!text) {
+            continue;
+        }
+
+        auto cell = std::make_unique<Cell>(*this, p);
+        // Содержимое файла было проверено при сохранении
+        cell->Load(std::string(*text));
+        // Ссылки формулы правятся строками и столбцами, вставленными и
+        // удалёнными после открытия файла
+        for (const StructureChange& change : source_changes_) {
+            cell->UpdateReferences([this, &change](FormulaInterface& formula) {
+                auto result = HandleStructureChange(formula, change.type, change.first, change.count, {});
+                if (!name_.empty()) {
+                    result = std::max(result,
+                        HandleStructureChange(formula, change.type, change.first, change.count, name_));
+                }
+                return result;
+            });
+        }
+        for (const Position& ref : cell->ReferencedCells()) {
+            if (!printable_.count(ref)) {
+                pending.push_back(ref);
+            }
+        }
+        loaded.push_back(cell.get());
+        printable_.emplace(p, std::move(cell));
+        occupied_.Insert(p);
+        // Формула из файла ещё не вычислена
+        recalc_.NoteChanged(p);
+    }
+
+    // Связываем зависимости, когда все ячейки конуса уже созданы
+    for (Cell* cell : loaded) {
+        cell->LinkReferences();
+    }
+    if (loaded.size() >= BULK_LOAD_CELLS) {
+        graph_->Compact();
+    }
+
+    auto it = printable_.find(pos);
+    return it == printable_.end() ? nullptr : it->second.get();
+}
+
+void Sheet::VisitRange(Position top_left, Size size,
+    const std::function<void(Position, const CellInterface&)>& visit) const {
+    if (size.rows <= 0 || size.cols <= 0) {
+        return;
+    }
+    const Position bottom_right{ top_left.row + size.rows - 1, top_left.col + size.cols - 1 };
+    if (!top_left.IsValid() || !bottom_right.IsValid()) {
+        throw InvalidPositionException("INVALID POSITION");
+    }
+
+    if (source_) {
+        // Ячейки файла, попавшие в прямоугольник, создаются заранее; индекс
+        // файла тоже упорядочен по строкам
+        size_t i = source_->LowerBound(top_left);
+        while (i < source_->GetCellCount()) {
+            const Position pos = source_->GetPosition(i);
+            if (pos.row > bottom_right.row) {
+                break;
+            }
+            if (pos.col < top_left.col) {
+                i = source_->LowerBound({ pos.row, top_left.col });
+            }
+            else if (pos.col > bottom_right.col) {
+                i = source_->LowerBound({ pos.row + 1, top_left.col });
+            }
+            else {
+                FindCell(pos);
+                ++i;
+            }
+        }
+    }
+
+    // Строки без ячеек пропускаются одним поиском
+    const auto& occupied = occupied_.ByRows();
+    auto it = occupied.lower_bound(top_left);
+    while (it != occupied.end() && it->row <= bottom_right.row) {
+        if (it->col < top_left.col) {
+            it = occupied.lower_bound({ it->row, top_left.col });
+        }
+        else if (it->col > bottom_right.col) {
+            it = occupied.lower_bound({ it->row + 1, top_left.col });
+        }
+        else {
+            const Cell* cell = static_cast<const Cell*>(printable_.at(*it).get());
+            if (!cell->IsEmpty()) {
+                visit(*it, *cell);
+            }
+            ++it;
+        }
     }
-    return it->second.get();
 }
 
 void Sheet::ClearCell(Position pos) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("INVALID POSITION");
     }
+    SHEET_STATS_LATENCY(stats_.set_cell_latency);
+    SHEET_STATS(++stats_.writes);
+
+    {
+        ChangeBatch batch(*this);
+        ChangeScope change(*this);
+        LoggedChange logged(log_.get());
+        if (log_) {
+            log_->AppendClear(pos);
+        }
+        if (auto it = printable_.find(pos); it != printable_.end()) {
+            Cell* cell = static_cast<Cell*>(it->second.get());
+            SetCellText(cell, std::string());
+            NoteChanged(pos);
+            EraseCell(pos);
+        }
+        if (source_ && source_->Find(pos)) {
+            detached_.insert(pos);
+        }
+        logged.Commit();
+    }
+    SyncOperationLogIfDue();
+}
+
+void Sheet::CopyRange(Position from, Size size, Position to) {
+    if (size.rows <= 0 || size.cols <= 0) {
+        return;
+    }
+    const Position from_last{ from.row + size.rows - 1, from.col + size.cols - 1 };
+    const Position to_last{ to.row + size.rows - 1, to.col + size.cols - 1 };
+    if (!from.IsValid() || !to.IsValid() || !from_last.IsValid() || !to_last.IsValid()) {
+        throw InvalidPositionException("INVALID POSITION");
+    }
+
+    // Копии снимаются до вставки: прямоугольники могут пересекаться
+    std::vector<PastedCell> cells;
+    cells.reserve(static_cast<size_t>(size.rows) * size.cols);
+    for (int i = 0; i < size.rows; ++i) {
+        for (int j = 0; j < size.cols; ++j) {
+            const Position target{ to.row + i, to.col + j };
+            if (const CellInterface* cell = FindCell({ from.row + i, from.col + j })) {
+                cells.push_back(static_cast<const Cell*>(cell)->CopyTo(target));
+            }
+            else {
+                cells.push_back(PastedCell(target));
+            }
+        }
+    }
+    Paste(cells);
+    SyncOperationLogIfDue();
+}
+
+void Sheet::FillDown(Position source, int count) {
+    if (count <= 0) {
+        return;
+    }
+    if (!source.IsValid() || !Position{ source.row + count, source.col }.IsValid()) {
+        throw InvalidPositionException("INVALID POSITION");
+    }
+
+    std::vector<Position> targets;
+    targets.reserve(count);
+    for (int i = 1; i <= count; ++i) {
+        targets.push_back({ source.row + i, source.col });
+    }
+    std::vector<PastedCell> cells;
+    if (const CellInterface* cell = FindCell(source)) {
+        cells = static_cast<const Cell*>(cell)->CopyTo(targets);
+    }
+    else {
+        cells.reserve(count);
+        for (const Position& target : targets) {
+            cells.emplace_back(target);
+        }
+    }
+    Paste(cells);
+    SyncOperationLogIfDue();
+}
+
+void Sheet::Paste(std::vector<PastedCell>& cells) {
+    if (PasteCreatesCycle(cells)) {
+        throw CircularDependencyException("CILCULAR DEPENDENCY FOUND");
+    }
+    SHEET_STATS(stats_.writes += cells.size());
+
+    ChangeBatch batch(*this);
+    ChangeScope change(*this);
+    printable_.reserve(printable_.size() + cells.size());
+    LoggedChange logged(log_.get());
+    const uint64_t revision = NextRevision();
+    // Позиции вставки различны, поэтому регистрацию можно отложить до
+    // конца вставки (при отмене позиции повторяются, см. Restore)
+    PasteBatch paste_batch;
+    paste_batch.unlinked.reserve(cells.size());
+    paste_batch.changed.reserve(cells.size());
+    try {
+        for (PastedCell& pasted : cells) {
+            PastedCell old = PasteCell(std::move(pasted), revision, &paste_batch);
+            if (RecordsHistory()) {
+                changes_.push_back(std::move(old));
+            }
+        }
+    }
+    catch (...) {
+        FinishPaste(paste_batch);
+        throw;
+    }
+    FinishPaste(paste_batch);
+    logged.Commit();
+}
+
+void Sheet::FinishPaste(PasteBatch& batch) {
+    occupied_.Insert(std::move(batch.new_positions));
+    batch.new_positions.clear();
+
+    size_t references = 0;
+    for (const Cell* cell : batch.unlinked) {
+        references += cell->ReferencedCells().size();
+    }
+    std::vector<CellGraph::Edge> edges;
+    edges.reserve(references);
+    std::vector<Position> new_placeholders;
+    placeholders_.reserve(placeholders_.size() + references);
+    for (const Cell* cell : batch.unlinked) {
+        cell->CollectReferenceEdges(edges, [&](Sheet& sheet, Position pos) {
+            return sheet.ReferenceNode(pos, &sheet == this ? &new_placeholders : nullptr);
+        });
+    }
+    batch.unlinked.clear();
+    if (placeholder_positions_) {
+        placeholder_positions_->Insert(std::move(new_placeholders));
+    }
+    graph_->AddDependents(edges);
+
+    NoteChanged(batch.changed);
+    batch.changed.clear();
+}
+
+PastedCell Sheet::PasteCell(PastedCell&& pasted, uint64_t revision, PasteBatch* batch) {
+    const Position pos = pasted.pos;
+    // Запись журнала предшествует изменению; подтверждает её вызывающий
+    if (log_) {
+        if (pasted.IsEmpty()) {
+            log_->AppendClear(pos);
+        }
+        else {
+            log_->AppendSet(pos, pasted.GetText());
+        }
+    }
+    if (!pasted.IsEmpty()) {
+        Cell* cell = PrepareCell(pos, batch);
+        if (!batch) {
+            PastedCell old = cell->Paste(std::move(pasted), revision);
+            NoteChanged(pos);
+            return old;
+        }
+        PastedCell old = cell->Paste(std::move(pasted), revision, false);
+        batch->unlinked.push_back(cell);
+        batch->changed.push_back(pos);
+        return old;
+    }
+
+    PastedCell old(pos);
+    // Как в ClearCell: ячейка убирается, её ссылки переходят к заглушке
+    if (auto it = printable_.find(pos); it != printable_.end()) {
+        old = static_cast<Cell*>(it->second.get())->Paste(std::move(pasted), revision);
+        NoteChanged(pos);
+        EraseCell(pos);
+    }
+    if (source_ && source_->Find(pos)) {
+        detached_.insert(pos);
+    }
+    return old;
+}
+
+void Sheet::EnableUndo(UndoOptions options) {
+    history_ = std::make_unique<UndoHistory>(options);
+}
+
+void Sheet::DisableUndo() {
+    history_.reset();
+}
 
-    if (printable_.count(pos)) {
-        printable_.at(pos)->Clear();
+bool Sheet::Undo() {
+    if (!history_ || !history_->CanUndo()) {
+        return false;
+    }
+    {
+        ChangeBatch batch(*this);
+        history_->PushRedo(Restore(history_->PopUndo()));
+    }
+    SyncOperationLogIfDue();
+    return true;
+}
+
+bool Sheet::Redo() {
+    if (!history_ || !history_->CanRedo()) {
+        return false;
+    }
+    {
+        ChangeBatch batch(*this);
+        history_->PushUndo(Restore(history_->PopRedo()));
+    }
+    SyncOperationLogIfDue();
+    return true;
+}
+
+UndoHistory::Entry Sheet::Restore(UndoHistory::Entry entry) {
+    SHEET_STATS(stats_.writes += entry.size());
+
+    restoring_ = true;
+    UndoHistory::Entry replaced;
+    replaced.reserve(entry.size());
+    LoggedChange logged(log_.get());
+    try {
+        // Ячейки восстанавливаются в обратном порядке изменения. Тогда
+        // Restore(replaced) пройдёт их в исходном порядке и повторит изменение
+        const uint64_t revision = NextRevision();
+        for (auto it = entry.rbegin(); it != entry.rend(); ++it) {
+            replaced.push_back(PasteCell(std::move(*it), revision));
+        }
+        logged.Commit();
+    }
+    catch (...) {
+        restoring_ = false;
+        throw;
+    }
+    restoring_ = false;
+    return replaced;
+}
+
+bool Sheet::PasteCreatesCycle(const std::vector<PastedCell>& cells) const {
+    SHEET_STATS(++stats_.cycle_checks);
+
+    // Цикл, которого не было, проходит через вставляемую ячейку с зависимыми:
+    // прежними из графа или вставляемыми формулами, которые на неё ссылаются.
+    // Если таких ячеек нет (обычное заполнение вниз), обход не нужен.
+    // Ссылки сначала сравниваются с прямоугольником, охватывающим вставку.
+    if (cells.empty()) {
+        return false;
+    }
+    Position first = cells.front().pos;
+    Position last = first;
+    bool may_cycle = false;
+    for (const PastedCell& pasted : cells) {
+        first = { std::min(first.row, pasted.pos.row), std::min(first.col, pasted.pos.col) };
+        last = { std::max(last.row, pasted.pos.row), std::max(last.col, pasted.pos.col) };
+        if (const std::optional<CellId> id = FindNode(pasted.pos); id && !graph_->GetDependents(*id).empty()) {
+            may_cycle = true;
+            break;
+        }
+    }
+    const auto inside = [&](const Position& ref) {
+        return ref.row >= first.row && ref.row <= last.row && ref.col >= first.col && ref.col <= last.col;
+    };
+    for (auto it = cells.begin(); it != cells.end() && !may_cycle; ++it) {
+        may_cycle = std::any_of(it->references.begin(), it->references.end(), inside);
+    }
+    if (!may_cycle) {
+        return false;
+    }
+
+    // Граф после вставки: у вставляемых ячеек прежние ссылки заменяются
+    // новыми, у остальных ячеек связи те же. Цикл ищется обходом в глубину
+    // от вставляемых ячеек по зависимым, как в Cell::CircularDependencyCheck,
+    // но для всех ячеек вставки сразу.
+    // Узел графа - ячейка вместе с таблицей: цикл может пройти через
+    // другие таблицы книги
+    using Node = std::pair<const Sheet*, Position>;
+    struct NodeHasher {
+        size_t operator()(const Node& node) const {
+            return std::hash<const Sheet*>{}(node.first) * 37 + std::hash<Position>{}(node.second);
+        }
+    };
+    std::unordered_set<Position> targets;
+    std::unordered_map<Node, std::vector<Node>, NodeHasher> new_dependents;
+    for (const PastedCell& pasted : cells) {
+        targets.insert(pasted.pos);
+        const Node target{ this, pasted.pos };
+        for (const Position& ref : pasted.references) {
+            new_dependents[{ this, ref }].push_back(target);
+        }
+        if (pasted.formula) {
+            for (const ExternalCell& ref : pasted.formula->ExternalReferences()) {
+                if (const Sheet* sheet = FindSheet(ref.sheet)) {
+                    new_dependents[{ sheet, ref.pos }].push_back(target);
+                }
+            }
+        }
+    }
+    if (new_dependents.empty()) {
+        return false;
+    }
+
+    enum class Mark { InProgress, Done };
+    std::unordered_map<Node, Mark, NodeHasher> marks;
+    // Ячейка и признак выхода из неё: ячейки в обработке - это цепочка
+    // от начала обхода до текущей, и ссылка на такую ячейку замыкает цикл
+    std::vector<std::pair<Node, bool>> stack;
+    bool found = false;
+    for (const PastedCell& start : cells) {
+        if (marks.count({ this, start.pos })) {
+            continue;
+        }
+        stack.push_back({ { this, start.pos }, false });
+        while (!stack.empty() && !found) {
+            const auto [node, leaving] = stack.back();
+            stack.pop_back();
+            if (leaving) {
+                marks[node] = Mark::Done;
+                continue;
+            }
+            if (marks.count(node)) {
+                continue;
+            }
+            marks[node] = Mark::InProgress;
+            stack.push_back({ node, true });
+
+            auto visit = [&](const Node& dependent) {
+                auto it = marks.find(dependent);
+                if (it == marks.end()) {
+                    stack.push_back({ dependent, false });
+                }
+                else if (it->second == Mark::InProgress) {
+                    found = true;
+                }
+            };
+            // Зависимые есть и у заглушки, на место которой идёт вставка
+            if (const std::optional<CellId> id = node.first->FindNode(node.second)) {
+                for (const CellId dependent : graph_->GetDependents(*id)) {
+                    const Cell* dependent_cell = graph_->GetCell(dependent);
+                    const Node dependent_node{ &dependent_cell->GetSheet(), dependent_cell->GetPosition() };
+                    // Прежние ссылки вставляемых ячеек заменяются новыми
+                    if (dependent_node.first != this || !targets.count(dependent_node.second)) {
+                        visit(dependent_node);
+                    }
+                }
+            }
+            if (auto it = new_dependents.find(node); it != new_dependents.end()) {
+                for (const Node& dependent : it->second) {
+                    visit(dependent);
+                }
+            }
+        }
+        if (found) {
+            break;
+        }
+    }
+
+    SHEET_STATS(stats_.cycle_check_nodes_visited += marks.size());
+    return found;
+}
+
+void Sheet::InsertRows(int before, int count) {
+    ChangeStructure(OperationLog::OpType::InsertRows, before, count);
+    SyncOperationLogIfDue();
+}
+
+void Sheet::InsertCols(int before, int count) {
+    ChangeStructure(OperationLog::OpType::InsertCols, before, count);
+    SyncOperationLogIfDue();
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    ChangeStructure(OperationLog::OpType::DeleteRows, first, count);
+    SyncOperationLogIfDue();
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    ChangeStructure(OperationLog::OpType::DeleteCols, first, count);
+    SyncOperationLogIfDue();
+}
+
+void Sheet::MaterializeFrom(bool rows, int first) {
+    if (!source_) {
+        return;
+    }
+    // Индекс файла упорядочен по строкам: для столбцов в каждой строке
+    // пропускаются ячейки левее first
+    const size_t count = source_->GetCellCount();
+    size_t i = source_->LowerBound(rows ? Position{ first, 0 } : Position{ 0, first });
+    while (i < count) {
+        const Position pos = source_->GetPosition(i);
+        if (rows || pos.col >= first) {
+            LoadCell(pos);
+            ++i;
+        }
+        else {
+            i = source_->LowerBound({ pos.row, first });
+        }
+    }
+}
+
+void Sheet::ChangeStructure(OperationLog::OpType type, int first, int count) {
+    using OpType = OperationLog::OpType;
+    const bool rows = type == OpType::InsertRows || type == OpType::DeleteRows;
+    const bool insert = type == OpType::InsertRows || type == OpType::InsertCols;
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    if (first < 0 || first >= limit || count <= 0) {
+        throw InvalidPositionException("INVALID POSITION");
+    }
+    SHEET_STATS_LATENCY(stats_.set_cell_latency);
+    SHEET_STATS(++stats_.writes);
+    ChangeBatch batch(*this);
+    LoggedChange logged(log_.get());
+    if (log_) {
+        log_->AppendStructural(type, first, count);
+    }
+
+    // Из файла создаются лишь сдвигаемые и удаляемые ячейки
+    MaterializeFrom(rows, first);
+
+    auto index = [rows](Position& pos) -> int& {
+        return rows ? pos.row : pos.col;
+    };
+    auto find_cell = [this](Position pos) {
+        return static_cast<Cell*>(printable_.at(pos).get());
+    };
+
+    // Ячейки и заглушки за вставленными или удалёнными строками сдвигаются
+    PositionIndex& placeholder_positions = PlaceholderPositions();
+    const int64_t moved_from = insert ? first : int64_t{ first } + count;
+    const int shift = insert ? count : -count;
+    if (insert) {
+        const int64_t last = std::max(occupied_.Last(rows), placeholder_positions.Last(rows));
+        if (last >= moved_from && last + count >= limit) {
+            throw TableTooBigException("TABLE TOO BIG");
+        }
+    }
+    // Новая позиция; std::nullopt - позиция удалена
+    auto move = [&](Position pos) -> std::optional<Position> {
+        int& i = index(pos);
+        if (i >= moved_from) {
+            i += shift;
+            return pos;
+        }
+        if (!insert && i >= first) {
+            return std::nullopt;
+        }
+        return pos;
+    };
+    std::vector<Position> moved;
+    std::vector<Position> deleted;
+    for (const Position& pos : occupied_.From(rows, first)) {
+        (move(pos) ? moved : deleted).push_back(pos);
+    }
+
+    // Формулы, ссылки которых нужно поправить: сдвигаемые ячейки и все
+    // ячейки, ссылающиеся на сдвигаемые или удаляемые ячейки и заглушки
+    std::unordered_set<Cell*> affected;
+    for (const auto* positions : { &moved, &deleted }) {
+        for (const Position& pos : *positions) {
+            Cell* cell = find_cell(pos);
+            if (positions == &moved) {
+                affected.insert(cell);
+            }
+            // Зависимая ячейка может принадлежать другой таблице книги
+            for (const CellId dependent : cell->GetDependents()) {
+                affected.insert(graph_->GetCell(dependent));
+            }
+        }
+    }
+
+    // Удаляемые ячейки сначала отвязываются от ячеек, на которые ссылались
+    for (const Position& pos : deleted) {
+        Cell* cell = find_cell(pos);
+        affected.erase(cell);
+        cell->Clear();
+    }
+    for (const Position& pos : deleted) {
         printable_.erase(pos);
+        occupied_.Erase(pos);
+    }
+
+    // Заглушки разбираются после очистки удаляемых ячеек: она могла убрать
+    // последние ссылки на некоторые из них
+    std::vector<Position> moved_placeholders;
+    for (const Position& pos : placeholder_positions.From(rows, first)) {
+        const CellId id = placeholders_.at(pos).id;
+        for (const CellId dependent : graph_->GetDependents(id)) {
+            affected.insert(graph_->GetCell(dependent));
+        }
+        if (move(pos)) {
+            moved_placeholders.push_back(pos);
+        }
+        else {
+            placeholders_.erase(pos);
+            placeholder_positions.Erase(pos);
+            graph_->Remove(id);
+        }
+    }
+
+    // Сохранённое в файле содержимое сдвинутых и удалённых позиций больше
+    // не действительно
+    if (source_) {
+        for (const auto* positions : { &moved, &deleted }) {
+            for (const Position& pos : *positions) {
+                if (source_->Find(pos)) {
+                    detached_.insert(pos);
+                }
+            }
+        }
+        source_changes_.push_back({ type, first, count });
+    }
+
+    // Сдвиг: узлы извлекаются все сразу, чтобы новые ключи не совпали со старыми
+    std::vector<decltype(printable_)::node_type> nodes;
+    nodes.reserve(moved.size());
+    for (const Position& pos : moved) {
+        nodes.push_back(printable_.extract(pos));
+    }
+    for (auto& node : nodes) {
+        const Position pos = *move(node.key());
+        node.key() = pos;
+        static_cast<Cell*>(node.mapped().get())->MoveTo(pos);
+        printable_.insert(std::move(node));
+    }
+    if (!moved.empty()) {
+        occupied_.Shift(rows, static_cast<int>(moved_from), shift);
+    }
+    std::vector<decltype(placeholders_)::node_type> placeholder_nodes;
+    placeholder_nodes.reserve(moved_placeholders.size());
+    for (const Position& pos : moved_placeholders) {
+        placeholder_nodes.push_back(placeholders_.extract(pos));
+    }
+    for (auto& node : placeholder_nodes) {
+        const Position pos = *move(node.key());
+        node.key() = pos;
+        if (node.mapped().cell) {
+            static_cast<Cell*>(node.mapped().cell.get())->MoveTo(pos);
+        }
+        placeholders_.insert(std::move(node));
+    }
+    if (!moved_placeholders.empty()) {
+        placeholder_positions.Shift(rows, static_cast<int>(moved_from), shift);
+    }
+
+    // Отмеченные, но ещё не пересчитанные изменения переезжают вместе с
+    // ячейками
+    recalc_.MovePositions(move);
+    std::unordered_set<Position> notify_changed;
+    for (const Position& pos : notify_changed_) {
+        if (const std::optional<Position> moved_to = move(pos)) {
+            notify_changed.insert(*moved_to);
+        }
+    }
+    notify_changed_ = std::move(notify_changed);
+
+    // Значения общих подвыражений кэшируются на ревизию: без новой ревизии
+    // сдвинутая формула взяла бы из пула значение, вычисленное для прежних
+    // ячеек с теми же адресами
+    NextRevision();
+    for (Cell* cell : affected) {
+        // Формула правит свои ссылки на эту таблицу и ссылки на неё по имени
+        const bool own = &cell->GetSheet() == this;
+        auto result = FormulaInterface::HandlingResult::NothingChanged;
+        cell->UpdateReferences([&](FormulaInterface& formula) {
+            if (own) {
+                result = HandleStructureChange(formula, type, first, count, {});
+            }
+            if (!name_.empty()) {
+                result = std::max(result, HandleStructureChange(formula, type, first, count, name_));
+            }
+            return result;
+        });
+        // Значение меняется, только если формула ссылалась на удалённые
+        // ячейки; сдвинутые ячейки сохраняют свои значения
+        if (result != FormulaInterface::HandlingResult::ReferencesChanged) {
+            continue;
+        }
+        if (own) {
+            NoteChanged(cell->GetPosition());
+        }
+        else {
+            cell->GetSheet().Scheduler().NoteChanged(cell->GetPosition());
+        }
+    }
+
+    logged.Commit();
+    // Прежнее содержимое в записях истории хранится по старым позициям
+    if (history_) {
+        history_->Clear();
     }
 }
 
 Size Sheet::GetPrintableSize() const {
     Size result;
 
-    if (printable_.empty()) {
-        return result;
-    }
-
     int max_row = -1;
     int max_col = -1;
     for (const auto& kv : printable_) {
@@ -67,6 +1037,25 @@ Size Sheet::GetPrintableSize() const {
         if (p.col > max_col) max_col = p.col;
     }
 
+    if (source_) {
+        if (detached_.empty()) {
+            // Размер из заголовка файла: индекс читать не нужно
+            const Size saved = source_->GetSize();
+            max_row = std::max(max_row, saved.rows - 1);
+            max_col = std::max(max_col, saved.cols - 1);
+        }
+        else {
+            for (size_t i = 0; i < source_->GetCellCount(); ++i) {
+                const Position p = source_->GetPosition(i);
+                if (detached_.count(p)) {
+                    continue;
+                }
+                if (p.row > max_row) max_row = p.row;
+                if (p.col > max_col) max_col = p.col;
+            }
+        }
+    }
+
     if (max_row >= 0) result.rows = max_row + 1;
     if (max_col >= 0) result.cols = max_col + 1;
 
@@ -77,7 +1066,7 @@ void Sheet::PrintValues(std::ostream& output) const {
     Size size = GetPrintableSize();
     for (int i = 0; i < size.rows; ++i) {
         for (int j = 0; j < size.cols; ++j) {
-            const CellInterface* cell = GetCell({ i, j });
+            const CellInterface* cell = FindCell({ i, j });
             if (cell) {
                 output << cell->GetValue();
             }
@@ -93,9 +1082,8 @@ void Sheet::PrintTexts(std::ostream& output) const {
     Size size = GetPrintableSize();
     for (int i = 0; i < size.rows; ++i) {
         for (int j = 0; j < size.cols; ++j) {
-            const CellInterface* cell = GetCell({ i, j });
-            if (cell) {
-                output << cell->GetText();
+            if (const CellInterface* cell = FindCell({ i, j })) {
+                static_cast<const Cell*>(cell)->PrintText(output);
             }
             if (j + 1 < size.cols) {
                 output << '\t';
@@ -105,6 +1093,233 @@ void Sheet::PrintTexts(std::ostream& output) const {
     }
 }
 
+bool Sheet::Recalculate(RecalcScheduler::Clock::time_point deadline) {
+    return recalc_.Run(*this, deadline);
+}
+
+void Sheet::Observe(Position pos) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("INVALID POSITION");
+    }
+    recalc_.Observe(pos);
+}
+
+void Sheet::Unobserve(Position pos) {
+    recalc_.Unobserve(pos);
+}
+
+size_t Sheet::Subscribe(ChangeListener listener) {
+    // Точка отсчёта: формула, которую ещё не вычисляли, иначе считалась бы
+    // изменившейся при первом же вычислении, даже дав прежнее значение
+    for (const auto& [pos, cell] : printable_) {
+        static_cast<const Cell*>(cell.get())->PeekValue();
+    }
+    listeners_.emplace_back(next_subscription_, std::move(listener));
+    if (workbook_) {
+        ++workbook_->listeners_;
+    }
+    return next_subscription_++;
+}
+
+void Sheet::Unsubscribe(size_t subscription) {
+    auto it = std::find_if(listeners_.begin(), listeners_.end(), [subscription](const auto& listener) {
+        return listener.first == subscription;
+    });
+    if (it == listeners_.end()) {
+        return;
+    }
+    listeners_.erase(it);
+    if (workbook_) {
+        --workbook_->listeners_;
+    }
+}
+
+Sheet::ChangeBatch::ChangeBatch(Sheet& sheet)
+    : sheet_(sheet) {
+    if (sheet_.batch_depth_++ == 0) {
+        sheet_.batch_revision_ = sheet_.GetRevision();
+    }
+}
+
+Sheet::ChangeBatch::~ChangeBatch() {
+    if (--sheet_.batch_depth_ == 0) {
+        sheet_.NotifyListeners();
+    }
+}
+
+void Sheet::NoteChanged(Position pos) {
+    recalc_.NoteChanged(pos);
+    if (WantsNotifications()) {
+        notify_changed_.insert(pos);
+    }
+}
+
+void Sheet::NoteChanged(Span<const Position> positions) {
+    recalc_.NoteChanged(positions);
+    if (WantsNotifications()) {
+        notify_changed_.reserve(notify_changed_.size() + positions.size());
+        notify_changed_.insert(positions.begin(), positions.end());
+    }
+}
+
+bool Sheet::WantsNotifications() const {
+    return workbook_ ? workbook_->listeners_ > 0 : !listeners_.empty();
+}
+
+void Sheet::NotifyListeners() {
+    const std::unordered_set<Position> changed = std::move(notify_changed_);
+    notify_changed_.clear();
+    if (changed.empty()) {
+        return;
+    }
+
+    // Очищенные и удалённые ячейки больше не существуют: их значение
+    // стало пустым
+    std::vector<const Cell*> roots;
+    std::unordered_map<Sheet*, std::vector<Position>> changed_by_sheet;
+    for (const Position& pos : changed) {
+        if (auto it = printable_.find(pos); it != printable_.end()) {
+            roots.push_back(static_cast<const Cell*>(it->second.get()));
+        }
+        else {
+            changed_by_sheet[this].push_back(pos);
+            // Формулы, ссылавшиеся на очищенную ячейку, теперь
+            // ссылаются на заглушку
+            AddDependencyRoots(pos, roots);
+        }
+    }
+
+    // Обход идёт дальше только от ячеек, значение которых изменилось: формула,
+    // давшая прежнее значение, не сдвигает ревизию изменения, и её зависимые
+    // не просматриваются. Обновляя ячейку, формула сама вычисляет устаревшие
+    // ячейки, которые читает, поэтому от порядка обхода результат не зависит.
+    if (!roots.empty()) {
+        const CellGraph& graph = *graph_;
+        CellGraph::Marks visited(graph);
+        std::vector<CellId>& stack = visited.Stack();
+        for (const Cell* root : roots) {
+            if (visited.Mark(root->GetId())) {
+                stack.push_back(root->GetId());
+            }
+        }
+        while (!stack.empty()) {
+            const Cell* cell = graph.GetCell(stack.back());
+            stack.pop_back();
+            if (cell->GetChangedAt() <= batch_revision_) {
+                continue;
+            }
+            changed_by_sheet[&cell->GetSheet()].push_back(cell->GetPosition());
+            for (const CellId dependent : graph.GetDependents(cell->GetId())) {
+                if (visited.Mark(dependent)) {
+                    stack.push_back(dependent);
+                }
+            }
+        }
+    }
+
+    for (auto& [sheet, positions] : changed_by_sheet) {
+        std::sort(positions.begin(), positions.end());
+        for (const auto& [subscription, listener] : sheet->listeners_) {
+            listener(positions);
+        }
+    }
+}
+
+bool Sheet::IsUpToDate(Position pos) const {
+    const CellInterface* cell = FindCell(pos);
+    return !cell || static_cast<const Cell*>(cell)->IsUpToDate();
+}
+
+void Sheet::EnableOperationLog(OperationLogOptions options) {
+    log_ = std::make_unique<OperationLog>(std::move(options));
+}
+
+void Sheet::DisableOperationLog() {
+    log_.reset();
+}
+
+void Sheet::SyncOperationLog() {
+    if (log_) {
+        log_->Sync();
+    }
+}
+
+void Sheet::SyncOperationLogIfDue() {
+    // Вложенное изменение сбросит внешнее, когда закончится целиком
+    if (log_ && batch_depth_ == 0) {
+        log_->SyncIfDue();
+    }
+}
+
+void Sheet::ReplayOperationLog(const std::string& path) {
+    // Воспроизводимые операции уже есть в журнале
+    auto log = std::move(log_);
+    ChangeBatch batch(*this);
+    try {
+        OperationLog::Replay(path, [this](const OperationLog::Record& record) {
+            switch (record.type) {
+            case OperationLog::OpType::Set:
+                PrepareCell(record.pos)->SetUnchecked(std::string(record.text));
+                NoteChanged(record.pos);
+                break;
+            case OperationLog::OpType::Clear:
+                ClearCell(record.pos);
+                break;
+            case OperationLog::OpType::InsertRows:
+                InsertRows(record.pos.row, record.pos.col);
+                break;
+            case OperationLog::OpType::InsertCols:
+                InsertCols(record.pos.row, record.pos.col);
+                break;
+            case OperationLog::OpType::DeleteRows:
+                DeleteRows(record.pos.row, record.pos.col);
+                break;
+            case OperationLog::OpType::DeleteCols:
+                DeleteCols(record.pos.row, record.pos.col);
+                break;
+            }
+        });
+    }
+    catch (...) {
+        log_ = std::move(log);
+        throw;
+    }
+    log_ = std::move(log);
+    graph_->Compact();
+}
+
+SheetMemoryUsage Sheet::MemoryUsage() const {
+    SheetMemoryUsage usage = memory_;
+    // Граф зависимостей книги общий: таблице приходится доля по числу ячеек
+    // и заглушек
+    if (const size_t graph_cells = graph_->CellCount(); graph_cells > 0) {
+        usage.dependents = graph_->MemoryUsage() * (printable_.size() + placeholders_.size()) / graph_cells;
+    }
+    // Узел хэш-таблицы: указатель на следующий, значение и сохранённый хэш
+    usage.cell_index += printable_.bucket_count() * sizeof(void*)
+        + printable_.size() * (sizeof(void*) + sizeof(decltype(printable_)::value_type) + sizeof(size_t))
+        + occupied_.MemoryUsage() + (placeholder_positions_ ? placeholder_positions_->MemoryUsage() : 0)
+        + placeholders_.bucket_count() * sizeof(void*)
+        + placeholders_.size() * (sizeof(void*) + sizeof(decltype(placeholders_)::value_type) + sizeof(size_t));
+    return usage;
+}
+
+SheetStats Sheet::GetStats() const {
+    return stats_;
+}
+
+void Sheet::ResetStats() {
+    stats_ = SheetStats{};
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
+
+void SaveSheet(const SheetInterface& sheet, const std::string& path) {
+    WriteSheetFile(sheet, path);
+}
+
+std::unique_ptr<SheetInterface> OpenSheet(const std::string& path) {
+    return std::make_unique<Sheet>(std::make_unique<MappedSheetFile>(path));
+}
@@ -1,8 +1,23 @@
 #pragma once
 
+#include "FormulaAST.h"
+#include "cellgraph.h"
 #include "common.h"
+#include "history.h"
+#include "oplog.h"
+#include "positionindex.h"
+#include "profiler.h"
+#include "recalc.h"
+#include "stats.h"
+#include "storage.h"
 
 #include <functional>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+class Cell;
+class Workbook;
 
 inline std::ostream& operator<<(std::ostream& out, const CellInterface::Value& val) {
     std::visit(
@@ -16,18 +31,24 @@ inline std::ostream& operator<<(std::ostream& out, const CellInterface::Value& v
 class Sheet : public SheetInterface {
 public:
     Sheet() = default;
+    // Таблица, ячейки которой лениво подгружаются из отображённого файла
+    explicit Sheet(std::unique_ptr<MappedSheetFile> source);
+    // Таблица книги workbook с именем name (см. Workbook::AddSheet)
+    Sheet(Workbook& workbook, std::string name);
     ~Sheet();
 
+    // Таблица не копируется и не перемещается: ячейки хранят ссылку на неё,
+    // а пул выражений - на её счётчик ревизий и статистику
     Sheet(const Sheet&) = delete;
     Sheet& operator=(const Sheet&) = delete;
-
-    Sheet(Sheet&&) = default;
-    Sheet& operator=(Sheet&&) = default;
+    Sheet(Sheet&&) = delete;
+    Sheet& operator=(Sheet&&) = delete;
 
     void SetCell(Position pos, std::string text) override;
 
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
+    const CellInterface* FindCell(Position pos) const override;
 
     void ClearCell(Position pos) override;
 
@@ -36,6 +57,349 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    CellInterface::Value GetExternalValue(std::string_view sheet_name, Position pos) const override;
+
+    // Имя таблицы в книге; у отдельной таблицы пустое
+    const std::string& GetName() const {
+        return name_;
+    }
+
+    // Таблица той же книги с именем name; nullptr, если такой нет
+    Sheet* FindSheet(std::string_view name) const;
+
+    // Регистрирует формулу dependent (возможно, другой таблицы книги) как
+    // ссылающуюся на ячейку pos. Если ячейки нет, ссылку запоминает заглушка:
+    // номер в графе зависимостей без объекта ячейки. Заглушка не расширяет
+    // GetPrintableSize; GetCell создаёт для неё пустую ячейку лишь по запросу.
+    // Запись в pos превращает заглушку в ячейку, а с последней ссылкой она
+    // удаляется. Это не изменение таблицы, и в историю и журнал операций оно
+    // не попадает.
+    void LinkReference(Position pos, const Cell& dependent);
+    void UnlinkReference(Position pos, const Cell& dependent);
+
+    // Добавляет к roots ячейку pos как начало обхода по зависимым. Вместо
+    // заглушки добавляются ссылающиеся на неё формулы.
+    void AddDependencyRoots(Position pos, std::vector<const Cell*>& roots) const;
+
+    // Вставляет count пустых строк перед строкой before (столбцов перед
+    // столбцом before). Ячейки сдвигаются целиком, ссылки формул правятся на
+    // месте, без повторного разбора. Если ячейки вышли бы за пределы таблицы,
+    // бросает TableTooBigException.
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+
+    // Удаляет count строк (столбцов), начиная с first. Ссылки формул на
+    // удалённые ячейки становятся #REF!.
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Копирует ячейки прямоугольника с левым верхним углом from и размером
+    // size так, чтобы его левый верхний угол оказался в to. Формулы не
+    // разбираются заново: их ссылки сдвигаются на то же смещение, ссылки за
+    // пределами таблицы становятся #REF!. Пустые ячейки источника очищают
+    // ячейки назначения. Если вставка приводит к циклической зависимости,
+    // бросается CircularDependencyException и таблица не меняется.
+    void CopyRange(Position from, Size size, Position to);
+
+    // Протягивает ячейку source вниз: копирует её в count следующих строк
+    // так же, как CopyRange
+    void FillDown(Position source, int count);
+
+    // Передаёт в visit непустые ячейки прямоугольника с левым верхним углом
+    // top_left и размером size в порядке строк. Стоимость зависит от числа
+    // строк прямоугольника и ячеек в нём, а не от размера таблицы; значения
+    // ячеек не вычисляются, пока visit их не запросит. visit не должен
+    // менять таблицу.
+    void VisitRange(Position top_left, Size size,
+        const std::function<void(Position, const CellInterface&)>& visit) const;
+
+    // Включает историю изменений: SetCell, ClearCell, CopyRange и FillDown
+    // можно отменять и повторять. Вставка и удаление строк и столбцов
+    // очищают историю.
+    void EnableUndo(UndoOptions options = {});
+    void DisableUndo();
+
+    // Отменяет последнее изменение. Формулы восстанавливаются уже
+    // разобранными, стоимость пропорциональна числу ячеек изменения.
+    // Возвращает false, если отменять нечего.
+    bool Undo();
+    // Повторяет последнее отменённое изменение
+    bool Redo();
+
+    // Пересчитывает формулы, устаревшие после изменений, пока не наступит
+    // deadline; следующий вызов продолжает с того же места. Сначала
+    // пересчитываются наблюдаемые ячейки, затем остальные зависящие от
+    // изменений формулы в порядке зависимостей, так что вычисление каждой
+    // читает уже свежие значения. Первый вызов, а также первый вызов после
+    // вставки или удаления строк и столбцов, планирует всю таблицу.
+    // Возвращает true, если устаревших формул не осталось.
+    bool Recalculate(RecalcScheduler::Clock::time_point deadline);
+
+    // Отмечает ячейку как наблюдаемую (например, видимую на экране):
+    // Recalculate пересчитывает её в первую очередь
+    void Observe(Position pos);
+    void Unobserve(Position pos);
+
+    // Актуально ли значение ячейки: GetValue вернёт его без вычислений.
+    // Пустые и текстовые ячейки актуальны всегда.
+    bool IsUpToDate(Position pos) const;
+
+    // Получатель изменений: позиции ячеек таблицы, значения которых
+    // изменились, в порядке строк
+    using ChangeListener = std::function<void(const std::vector<Position>&)>;
+
+    // Подписывает listener на изменения значений. После каждой записи
+    // (SetCell, ClearCell, CopyRange, Undo, вставки строк и т.п.) или группы
+    // записей (см. ChangeBatch) зависящие от неё формулы вычисляются, и
+    // listener получает один список ячеек, значения которых действительно
+    // изменились: формулы, давшие прежнее значение, в него не попадают.
+    // Изменения формул других таблиц книги получают подписчики тех таблиц.
+    // После вставки и удаления строк и столбцов позиции в списке - новые,
+    // а сдвиг ячеек без изменения значения не сообщается.
+    // Значения формул таблицы сравниваются с вычисленными при подписке,
+    // поэтому подписка вычисляет формулы, которые ещё не вычислялись.
+    // listener не должен менять таблицу и бросать исключения.
+    // Возвращает номер подписки для Unsubscribe.
+    size_t Subscribe(ChangeListener listener);
+    void Unsubscribe(size_t subscription);
+
+    // Группа записей: пока объект существует, подписчики не уведомляются,
+    // а после его разрушения получают один общий список
+    class ChangeBatch {
+    public:
+        explicit ChangeBatch(Sheet& sheet);
+        ~ChangeBatch();
+
+        ChangeBatch(const ChangeBatch&) = delete;
+        ChangeBatch& operator=(const ChangeBatch&) = delete;
+
+    private:
+        Sheet& sheet_;
+    };
+
+    // Включает журнал операций: каждая успешная запись SetCell/ClearCell,
+    // а также вставка и удаление строк и столбцов дописывается в конец
+    // файла options.path. Если сбросить запись на диск не удалось, изменение
+    // остаётся в таблице, а операция бросает SheetFileException.
+    void EnableOperationLog(OperationLogOptions options);
+    // Сбрасывает журнал на диск и отключает его
+    void DisableOperationLog();
+    // Сбрасывает накопленные записи журнала на диск
+    void SyncOperationLog();
+
+    // Применяет к таблице операции из журнала. Записанные формулы уже прошли
+    // проверку циклических зависимостей, поэтому она не повторяется.
+    // Сами операции в журнал не попадают.
+    void ReplayOperationLog(const std::string& path);
+
+    // Снимок статистики работы движка с момента создания или ResetStats.
+    // При сборке с SPREADSHEET_STATS=0 все счётчики нулевые.
+    SheetStats GetStats() const;
+    void ResetStats();
+
+    // Счётчики, которые пополняют ячейки таблицы
+    SheetStats& Stats() const {
+        return stats_;
+    }
+
+    // Память таблицы в байтах по видам данных. Берётся из счётчиков, которые
+    // ячейки поддерживают при каждом изменении, и размеров индексов, без
+    // обхода ячеек. Оценка: служебные данные распределителя памяти не
+    // учитываются, общие подвыражения формул и ячейки, ещё не поднятые из
+    // файла, тоже.
+    SheetMemoryUsage MemoryUsage() const;
+
+    // Счётчики памяти, которые поддерживают ячейки таблицы
+    SheetMemoryUsage& Memory() {
+        return memory_;
+    }
+
+    // Ревизия таблицы: увеличивается при каждом изменении ячейки. Кэш формулы
+    // действителен на той ревизии, на которой он проверен; при чтении на более
+    // поздней ревизии он проверяется заново по ревизиям изменения ячеек,
+    // на которые ссылается формула. Поэтому запись не обходит зависимые ячейки.
+    // У таблиц книги счётчик ревизий общий: формула видит изменения ячеек
+    // других таблиц, на которые ссылается.
+    uint64_t GetRevision() const {
+        return *revision_;
+    }
+
+    // Начинает новую ревизию и возвращает её номер
+    uint64_t NextRevision() {
+        return ++*revision_;
+    }
+
+    // Граф зависимостей ячеек таблицы; у таблиц книги общий
+    CellGraph& Graph() const {
+        return *graph_;
+    }
+
+    // Планировщик пересчёта (см. Recalculate)
+    RecalcScheduler& Scheduler() {
+        return recalc_;
+    }
+
+    // Общие подвыражения формул таблицы
+    ExpressionPool& Expressions() const {
+        return expressions_;
+    }
+
+    // Профилировщик вычислений формул; по умолчанию выключен
+    // (включается через Profiler().SetEnabled(true))
+    EvaluationProfiler& Profiler() const {
+        return profiler_;
+    }
+
 private:
+    // Вставка пачкой (см. Paste): позиции новых ячеек, их зависимости и
+    // изменения регистрируются после вставки всех ячеек, одним вызовом
+    // для каждой структуры (см. FinishPaste)
+    struct PasteBatch {
+        std::vector<Position> new_positions;
+        std::vector<Cell*> unlinked;
+        std::vector<Position> changed;
+    };
+
+    // Проверяет позицию и возвращает ячейку, создавая её при необходимости.
+    // Позицию новой ячейки в batch, если он передан, запоминает он.
+    Cell* PrepareCell(Position pos, PasteBatch* batch = nullptr);
+
+    // Убирает ячейку pos из таблицы. Если на неё ссылаются формулы, её номер
+    // в графе переходит к заглушке, а кэш формул сбрасывается: значение, от
+    // которого они зависели, стало пустым.
+    void EraseCell(Position pos);
+
+    // Номер в графе ячейки или заглушки pos
+    std::optional<CellId> FindNode(Position pos) const;
+
+    // Позиции заглушек; при первом обращении строятся по самим заглушкам
+    PositionIndex& PlaceholderPositions();
+
+    // Ячейка pos, в том числе ещё не созданная из файла; nullptr, если её нет
+    Cell* LoadCell(Position pos);
+
+    // Создаёт ячейку pos из файла вместе со всеми ещё не созданными ячейками,
+    // от которых она зависит. Возвращает nullptr, если ячейки нет в файле.
+    CellInterface* MaterializeCell(Position pos);
+
+    // Создаёт из файла ещё не созданные ячейки, строка (rows == true) или
+    // столбец которых не меньше first
+    void MaterializeFrom(bool rows, int first);
+
+    // Вставляет скопированные ячейки: проверяет циклы для всей вставки сразу,
+    // затем задаёт содержимое ячеек с одной общей ревизией
+    void Paste(std::vector<PastedCell>& cells);
+
+    // Задаёт содержимое одной ячейки без проверки циклов; пустое содержимое
+    // очищает ячейку, как ClearCell. Возвращает прежнее содержимое.
+    PastedCell PasteCell(PastedCell&& pasted, uint64_t revision, PasteBatch* batch = nullptr);
+
+    // Регистрирует то, что вставка пачкой отложила
+    void FinishPaste(PasteBatch& batch);
+
+    // Номер в графе ячейки pos для ссылки на неё; если ячейки нет, заводит
+    // заглушку (см. LinkReference). Позиции новых заглушек дописываются в
+    // new_placeholders, если он передан, иначе сразу попадают в индекс
+    // позиций заглушек, если он построен.
+    CellId ReferenceNode(Position pos, std::vector<Position>* new_placeholders);
+
+    // Задаёт текст ячейки, запоминая прежнее содержимое в текущем изменении
+    void SetCellText(Cell* cell, std::string text);
+
+    // Изменение, которое отменяется целиком (см. sheet.cpp)
+    class ChangeScope;
+
+    bool RecordsHistory() const {
+        return history_ && !restoring_;
+    }
+
+    // Возвращает ячейкам содержимое из entry. Возвращает содержимое, которое
+    // они имели до этого, для обратной операции.
+    UndoHistory::Entry Restore(UndoHistory::Entry entry);
+
+    // Появится ли цикл, если ячейки cells получат новое содержимое
+    bool PasteCreatesCycle(const std::vector<PastedCell>& cells) const;
+
+    // Отмечает изменение ячейки для пересчёта и уведомления подписчиков
+    void NoteChanged(Position pos);
+    void NoteChanged(Span<const Position> positions);
+
+    // Есть ли подписчики у этой таблицы или у других таблиц книги
+    bool WantsNotifications() const;
+
+    // Вычисляет формулы, зависящие от отмеченных изменений, и передаёт
+    // подписчикам ячейки, значения которых изменились
+    void NotifyListeners();
+
+    // Общая часть вставки и удаления строк и столбцов. Стоимость
+    // пропорциональна числу сдвигаемых и удаляемых ячеек и заглушек и
+    // ссылающихся на них формул (для столбцов таблицы из файла - плюс число
+    // строк в файле).
+    void ChangeStructure(OperationLog::OpType type, int first, int count);
+    // Сбрасывает журнал операций, если пора. Вызывается в конце изменения,
+    // когда оно уже записано в историю и сообщено подписчикам, так что
+    // ошибка записи журнала не оставляет изменение сделанным наполовину
+    void SyncOperationLogIfDue();
+
+    // Объявлены до ячеек: ячейки ссылаются на граф, пул и ревизию
+    uint64_t own_revision_ = 0;
+    // Счётчик ревизий: свой у отдельной таблицы, общий у таблиц книги
+    uint64_t* revision_ = &own_revision_;
+    // Граф зависимостей: свой у отдельной таблицы, общий у таблиц книги
+    mutable CellGraph own_graph_;
+    CellGraph* graph_ = &own_graph_;
+    mutable SheetStats stats_;
+    // Память ячеек; индексы учитываются в MemoryUsage
+    SheetMemoryUsage memory_;
+    mutable ExpressionPool expressions_{ *revision_, stats_ };
+    Workbook* workbook_ = nullptr;
+    std::string name_;
+
     std::unordered_map<Position, std::unique_ptr<CellInterface>> printable_;
+    // Позиции созданных ячеек: по ним обходятся прямоугольники таблицы и
+    // находятся сдвигаемые ячейки
+    PositionIndex occupied_;
+    // Заглушка: номер в графе позиции, на которую ссылаются формулы, но
+    // ячейки в которой нет, и пустая ячейка, если её запросили через GetCell.
+    // Номер в графе остаётся за заглушкой, а не за этой ячейкой.
+    struct Placeholder {
+        CellId id;
+        std::unique_ptr<CellInterface> cell;
+    };
+    std::unordered_map<Position, Placeholder> placeholders_;
+    // Позиции заглушек: по ним находятся сдвигаемые заглушки. Строятся при
+    // первой вставке или удалении строк (столбцов), до этого не хранятся
+    // (см. PlaceholderPositions).
+    std::optional<PositionIndex> placeholder_positions_;
+    // Файл, из которого ячейки создаются при первом обращении
+    std::unique_ptr<MappedSheetFile> source_;
+    // Позиции, сохранённое в файле содержимое которых больше не действительно
+    std::unordered_set<Position> detached_;
+    // Вставки и удаления строк и столбцов после открытия файла. Ячейки,
+    // которые они сдвигали, созданы сразу; ссылки формул, создаваемых из
+    // файла позже, правятся ими при создании.
+    struct StructureChange {
+        OperationLog::OpType type;
+        int first;
+        int count;
+    };
+    std::vector<StructureChange> source_changes_;
+    std::unique_ptr<OperationLog> log_;
+    std::unique_ptr<UndoHistory> history_;
+    // Прежнее содержимое ячеек текущего изменения
+    UndoHistory::Entry changes_;
+    int change_depth_ = 0;
+    // Идёт Undo или Redo: изменения не записываются
+    bool restoring_ = false;
+    RecalcScheduler recalc_;
+    mutable EvaluationProfiler profiler_;
+    // Подписчики на изменения значений в порядке подписки
+    std::vector<std::pair<size_t, ChangeListener>> listeners_;
+    size_t next_subscription_ = 0;
+    // Вложенность групп записей и ревизия начала внешней группы: ячейки,
+    // изменившиеся после неё, сообщаются подписчикам
+    int batch_depth_ = 0;
+    uint64_t batch_revision_ = 0;
+    // Ячейки, изменённые в текущей группе
+    std::unordered_set<Position> notify_changed_;
 };
\ No newline at end of file
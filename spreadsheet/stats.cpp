@@ -0,0 +1,120 @@
+#include "stats.h"
+
+#include <ostream>
+
+namespace {
+    // Глубина вложенных замеров с outermost_only в текущем потоке
+    thread_local int outermost_depth = 0;
+
+    void PrintHistogram(std::ostream& out, const char* name, const LatencyHistogram& histogram) {
+        const uint64_t count = histogram.Count();
+        out << name << ": count=" << count;
+        if (count > 0) {
+            out << " mean_ns=" << histogram.total_ns / count
+                << " p50_ns<=" << histogram.Percentile(0.5)
+                << " p99_ns<=" << histogram.Percentile(0.99);
+        }
+        out << '\n';
+    }
+}
+
+void LatencyHistogram::Record(uint64_t ns) {
+    int bucket = 0;
+    while (bucket + 1 < BUCKETS && (ns >> (bucket + 1)) != 0) {
+        ++bucket;
+    }
+    ++counts[bucket];
+    total_ns += ns;
+}
+
+uint64_t LatencyHistogram::Count() const {
+    uint64_t count = 0;
+    for (uint64_t c : counts) {
+        count += c;
+    }
+    return count;
+}
+
+uint64_t LatencyHistogram::Percentile(double fraction) const {
+    const uint64_t count = Count();
+    if (count == 0) {
+        return 0;
+    }
+    const double target = fraction * static_cast<double>(count);
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += counts[i];
+        if (static_cast<double>(seen) >= target) {
+            return (uint64_t{ 1 } << (i + 1)) - 1;
+        }
+    }
+    return (uint64_t{ 1 } << BUCKETS) - 1;
+}
+
+std::ostream& operator<<(std::ostream& out, const SheetStats& stats) {
+    out << "formulas_parsed: " << stats.formulas_parsed << '\n'
+        << "parse_ns: " << stats.parse_ns << '\n'
+        << "evaluations: " << stats.evaluations << '\n'
+        << "batch_evaluations: " << stats.batch_evaluations << '\n'
+        << "cache_hits: " << stats.cache_hits << '\n'
+        << "cache_misses: " << stats.cache_misses << '\n'
+        << "cache_revalidations: " << stats.cache_revalidations << '\n'
+        << "unchanged_results: " << stats.unchanged_results << '\n'
+        << "shared_expression_hits: " << stats.shared_expression_hits << '\n'
+        << "writes: " << stats.writes << '\n'
+        << "cycle_checks: " << stats.cycle_checks << '\n'
+        << "cycle_check_nodes_visited: " << stats.cycle_check_nodes_visited << '\n';
+    PrintHistogram(out, "set_cell_latency", stats.set_cell_latency);
+    PrintHistogram(out, "get_value_latency", stats.get_value_latency);
+    return out;
+}
+
+SheetMemoryUsage& SheetMemoryUsage::operator+=(const SheetMemoryUsage& rhs) {
+    cells += rhs.cells;
+    cell_index += rhs.cell_index;
+    text += rhs.text;
+    formulas += rhs.formulas;
+    dependents += rhs.dependents;
+    value_caches += rhs.value_caches;
+    return *this;
+}
+
+SheetMemoryUsage& SheetMemoryUsage::operator-=(const SheetMemoryUsage& rhs) {
+    cells -= rhs.cells;
+    cell_index -= rhs.cell_index;
+    text -= rhs.text;
+    formulas -= rhs.formulas;
+    dependents -= rhs.dependents;
+    value_caches -= rhs.value_caches;
+    return *this;
+}
+
+std::ostream& operator<<(std::ostream& out, const SheetMemoryUsage& usage) {
+    return out << "cells: " << usage.cells << '\n'
+               << "cell_index: " << usage.cell_index << '\n'
+               << "text: " << usage.text << '\n'
+               << "formulas: " << usage.formulas << '\n'
+               << "dependents: " << usage.dependents << '\n'
+               << "value_caches: " << usage.value_caches << '\n'
+               << "total: " << usage.Total() << '\n';
+}
+
+LatencyScope::LatencyScope(LatencyHistogram& histogram, bool outermost_only)
+    : histogram_(&histogram)
+    , outermost_only_(outermost_only) {
+    if (outermost_only_ && outermost_depth++ > 0) {
+        histogram_ = nullptr;
+        return;
+    }
+    start_ = Clock::now();
+}
+
+LatencyScope::~LatencyScope() {
+    if (outermost_only_) {
+        --outermost_depth;
+    }
+    if (histogram_) {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_);
+        histogram_->Record(static_cast<uint64_t>(elapsed.count()));
+    }
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+// Сбор статистики работы движка. Отключается при сборке
+// (-DSPREADSHEET_STATS=0 или опция CMake SPREADSHEET_STATS=OFF): тогда
+// макросы ниже разворачиваются в пустые операторы и не стоят ничего.
+#ifndef SPREADSHEET_STATS
+#define SPREADSHEET_STATS 1
+#endif
+
+// Гистограмма задержек с логарифмическими корзинами:
+// корзина i содержит замеры из [2^i, 2^(i+1)) наносекунд.
+struct LatencyHistogram {
+    static constexpr int BUCKETS = 40;
+
+    uint64_t counts[BUCKETS] = {};
+    uint64_t total_ns = 0;
+
+    void Record(uint64_t ns);
+
+    uint64_t Count() const;
+
+    // Верхняя граница корзины, в которую попадает заданная доля замеров
+    uint64_t Percentile(double fraction) const;
+};
+
+struct SheetStats {
+    // Разбор формул
+    uint64_t formulas_parsed = 0;
+    uint64_t parse_ns = 0;
+
+    // Вычисления формул и кэш
+    uint64_t evaluations = 0;
+    // Из них вычисленные пакетно вместе с такими же формулами столбца
+    uint64_t batch_evaluations = 0;
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    // Устаревшие по ревизии кэши, подтверждённые без вычисления:
+    // ячейки, на которые ссылается формула, с тех пор не менялись
+    uint64_t cache_revalidations = 0;
+    // Вычисления, давшие прежнее значение: зависимые формулы не считают
+    // ячейку изменившейся и не вычисляются заново
+    uint64_t unchanged_results = 0;
+    // Значения общих подвыражений формул, взятые из кэша пула
+    uint64_t shared_expression_hits = 0;
+
+    // Записи
+    uint64_t writes = 0;
+
+    // Проверка циклических зависимостей
+    uint64_t cycle_checks = 0;
+    uint64_t cycle_check_nodes_visited = 0;
+
+    LatencyHistogram set_cell_latency;
+    LatencyHistogram get_value_latency;
+};
+
+std::ostream& operator<<(std::ostream& out, const SheetStats& stats);
+
+// Память таблицы в байтах по видам данных (см. Sheet::MemoryUsage).
+// Считается всегда, независимо от SPREADSHEET_STATS.
+struct SheetMemoryUsage {
+    // Объекты ячеек и их содержимого (без текстов и формул)
+    size_t cells = 0;
+    // Индексы ячеек: хэш-таблица по позиции и упорядоченный индекс
+    size_t cell_index = 0;
+    // Тексты текстовых ячеек
+    size_t text = 0;
+    // Деревья формул и списки ссылок ячеек
+    size_t formulas = 0;
+    // Граф зависимостей (см. CellGraph)
+    size_t dependents = 0;
+    // Кэши значений формул
+    size_t value_caches = 0;
+
+    size_t Total() const {
+        return cells + cell_index + text + formulas + dependents + value_caches;
+    }
+
+    SheetMemoryUsage& operator+=(const SheetMemoryUsage& rhs);
+    SheetMemoryUsage& operator-=(const SheetMemoryUsage& rhs);
+};
+
+std::ostream& operator<<(std::ostream& out, const SheetMemoryUsage& usage);
+
+// Память строки в куче; короткие строки хранятся в самом объекте
+inline size_t StringHeapBytes(const std::string& str) {
+    return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+// Замер времени участка кода с записью в гистограмму.
+// При outermost_only вложенные замеры в том же потоке не записываются:
+// так GetValue, вызванный во время вычисления другой формулы, не
+// учитывается дважды.
+class LatencyScope {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit LatencyScope(LatencyHistogram& histogram, bool outermost_only = false);
+    ~LatencyScope();
+
+    LatencyScope(const LatencyScope&) = delete;
+    LatencyScope& operator=(const LatencyScope&) = delete;
+
+private:
+    LatencyHistogram* histogram_;
+    bool outermost_only_;
+    Clock::time_point start_;
+};
+
+#if SPREADSHEET_STATS
+#define SHEET_STATS(statement) \
+    do {                       \
+        statement;             \
+    } while (false)
+#define SHEET_STATS_LATENCY(histogram) LatencyScope sheet_stats_latency_scope_(histogram)
+#define SHEET_STATS_OUTERMOST_LATENCY(histogram) \
+    LatencyScope sheet_stats_latency_scope_(histogram, /* outermost_only = */ true)
+#else
+#define SHEET_STATS(statement) \
+    do {                       \
+    } while (false)
+#define SHEET_STATS_LATENCY(histogram) \
+    do {                               \
+    } while (false)
+#define SHEET_STATS_OUTERMOST_LATENCY(histogram) \
+    do {                                         \
+    } while (false)
+#endif
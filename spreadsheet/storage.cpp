@@ -0,0 +1,180 @@
+#include "storage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    constexpr char SHEET_FILE_MAGIC[4] = { 'S', 'P', 'S', 'H' };
+    constexpr uint32_t SHEET_FILE_VERSION = 1;
+}
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw SheetFileException("CANNOT OPEN FILE " + path);
+    }
+    buffer_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    data_ = buffer_.data();
+    size_ = buffer_.size();
+}
+
+MappedFile::~MappedFile() = default;
+#else
+MappedFile::MappedFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw SheetFileException("CANNOT OPEN FILE " + path);
+    }
+
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw SheetFileException("CANNOT STAT FILE " + path);
+    }
+
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > 0) {
+        void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            throw SheetFileException("CANNOT MAP FILE " + path);
+        }
+        // Обращения к ячейкам точечные, упреждающее чтение только мешает
+        ::madvise(addr, size_, MADV_RANDOM);
+        data_ = static_cast<const char*>(addr);
+    }
+    // Отображение остаётся действительным и после закрытия дескриптора
+    ::close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+}
+#endif
+
+MappedSheetFile::MappedSheetFile(const std::string& path)
+    : file_(path) {
+    SheetFileHeader header;
+    if (file_.Size() < sizeof(header)) {
+        throw SheetFileException("TRUNCATED SHEET FILE");
+    }
+    std::memcpy(&header, file_.Data(), sizeof(header));
+
+    if (std::memcmp(header.magic, SHEET_FILE_MAGIC, sizeof(SHEET_FILE_MAGIC)) != 0
+        || header.version != SHEET_FILE_VERSION) {
+        throw SheetFileException("UNSUPPORTED SHEET FILE");
+    }
+
+    cell_count_ = header.cell_count;
+    size_ = { header.rows, header.cols };
+
+    const size_t index_size = cell_count_ * sizeof(SheetFileEntry);
+    if (file_.Size() - sizeof(header) < index_size) {
+        throw SheetFileException("TRUNCATED SHEET FILE");
+    }
+    index_ = file_.Data() + sizeof(header);
+    texts_ = index_ + index_size;
+    texts_size_ = file_.Size() - sizeof(header) - index_size;
+}
+
+SheetFileEntry MappedSheetFile::GetEntry(size_t index) const {
+    // memcpy вместо reinterpret_cast: отображённые данные не обязаны быть выровнены
+    SheetFileEntry entry;
+    std::memcpy(&entry, index_ + index * sizeof(SheetFileEntry), sizeof(entry));
+    return entry;
+}
+
+Position MappedSheetFile::GetPosition(size_t index) const {
+    SheetFileEntry entry = GetEntry(index);
+    return { entry.row, entry.col };
+}
+
+size_t MappedSheetFile::LowerBound(Position pos) const {
+    // Бинарный поиск по индексу: затрагиваются лишь O(log n) страниц
+    size_t lo = 0;
+    size_t hi = cell_count_;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (GetPosition(mid) < pos) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+std::optional<std::string_view> MappedSheetFile::Find(Position pos) const {
+    const size_t lo = LowerBound(pos);
+    if (lo == cell_count_) {
+        return std::nullopt;
+    }
+
+    SheetFileEntry entry = GetEntry(lo);
+    if (Position{ entry.row, entry.col } != pos) {
+        return std::nullopt;
+    }
+    if (entry.offset > texts_size_ || entry.length > texts_size_ - entry.offset) {
+        throw SheetFileException("CORRUPTED SHEET FILE");
+    }
+    return std::string_view(texts_ + entry.offset, entry.length);
+}
+
+void WriteSheetFile(const SheetInterface& sheet, const std::string& path) {
+    const Size size = sheet.GetPrintableSize();
+
+    std::vector<SheetFileEntry> index;
+    std::string texts;
+    // Обход по строкам даёт индекс, уже отсортированный по позиции
+    for (int i = 0; i < size.rows; ++i) {
+        for (int j = 0; j < size.cols; ++j) {
+            const CellInterface* cell = sheet.FindCell({ i, j });
+            if (!cell) {
+                continue;
+            }
+            std::string text = cell->GetText();
+            if (text.empty()) {
+                continue;
+            }
+            index.push_back({ i, j, static_cast<uint32_t>(texts.size()),
+                static_cast<uint32_t>(text.size()) });
+            texts += text;
+        }
+    }
+
+    SheetFileHeader header{};
+    std::memcpy(header.magic, SHEET_FILE_MAGIC, sizeof(SHEET_FILE_MAGIC));
+    header.version = SHEET_FILE_VERSION;
+    header.cell_count = static_cast<uint32_t>(index.size());
+    // Размер считается только по сохранённым (непустым) ячейкам
+    for (const SheetFileEntry& entry : index) {
+        header.rows = std::max(header.rows, entry.row + 1);
+        header.cols = std::max(header.cols, entry.col + 1);
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw SheetFileException("CANNOT OPEN FILE " + path);
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(index.data()),
+        static_cast<std::streamsize>(index.size() * sizeof(SheetFileEntry)));
+    out.write(texts.data(), static_cast<std::streamsize>(texts.size()));
+    if (!out) {
+        throw SheetFileException("CANNOT WRITE FILE " + path);
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Формат файла таблицы (порядок байт - родной для платформы):
+// * заголовок SheetFileHeader;
+// * индекс из cell_count записей SheetFileEntry, отсортированный по позиции
+//   (сначала строка, затем столбец);
+// * блок текстов ячеек, на который ссылаются записи индекса.
+// Индекс позволяет найти текст ячейки бинарным поиском, не читая файл целиком.
+struct SheetFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t cell_count;
+    int32_t rows;
+    int32_t cols;
+    uint32_t reserved;
+};
+
+struct SheetFileEntry {
+    int32_t row;
+    int32_t col;
+    uint32_t offset;  // смещение текста от начала блока текстов
+    uint32_t length;
+};
+
+// Отображённый в память файл только для чтения.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    // На Windows файл читается в буфер целиком
+    std::vector<char> buffer_;
+#endif
+};
+
+// Файл таблицы, открытый для ленивого чтения.
+// Открытие проверяет только заголовок и размеры, поэтому выполняется
+// за постоянное время; страницы индекса и текстов подгружаются ОС по мере
+// обращения к ним.
+class MappedSheetFile {
+public:
+    explicit MappedSheetFile(const std::string& path);
+
+    // Возвращает сохранённый текст ячейки либо nullopt, если ячейки нет в файле.
+    // Строка указывает на отображённую память и живёт, пока жив объект.
+    std::optional<std::string_view> Find(Position pos) const;
+
+    // Размер печатной области на момент сохранения
+    Size GetSize() const {
+        return size_;
+    }
+
+    size_t GetCellCount() const {
+        return cell_count_;
+    }
+
+    Position GetPosition(size_t index) const;
+
+    // Номер первой записи индекса с позицией не меньше pos
+    // (GetCellCount(), если таких нет)
+    size_t LowerBound(Position pos) const;
+
+private:
+    SheetFileEntry GetEntry(size_t index) const;
+
+    MappedFile file_;
+    size_t cell_count_ = 0;
+    Size size_;
+    const char* index_ = nullptr;
+    const char* texts_ = nullptr;
+    size_t texts_size_ = 0;
+};
+
+// Сохраняет непустые ячейки таблицы в файл указанного формата.
+void WriteSheetFile(const SheetInterface& sheet, const std::string& path);
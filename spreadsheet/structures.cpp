@@ -103,46 +103,3 @@ std::string_view FormulaError::ToString() const {
      }
     return "";
 }
-
-bool DFS(const CellInterface* start,
-    const CellInterface* cur,
-    int depth,
-    std::vector<const CellInterface*>& path,
-    const SheetInterface& sheet) {
-    // Если уже в пути — не углубляемся (предотвращаем прогулку по уже пройденному пути).
-    if (std::find(path.begin(), path.end(), cur) != path.end()) {
-        return false;
-    }
-
-    path.push_back(cur);
-
-    if (cur) {
-        const std::vector<Position> neigh = cur->GetReferencedCells();
-        for (const Position& next : neigh) {
-            // Наткнулись на старт — определяем длину цикла:
-            // depth + 1 т.к. добавляется ребро cur->start.
-            if (sheet.GetCell(next) == start) {
-                if (depth + 1 >= 3) { // учитываем только циклы длины >= 3
-                    path.pop_back();
-                    return true;
-                }
-                else {
-                    continue;
-                }
-            }
-
-            // Если next уже в текущем пути — пропускаем, чтобы не зациклиться внутри пути
-            if (std::find(path.begin(), path.end(), sheet.GetCell(next)) != path.end()) {
-                continue;
-            }
-
-            if (DFS(start, sheet.GetCell(next), depth + 1, path, sheet)) {
-                path.pop_back();
-                return true;
-            }
-        }
-    }
-
-    path.pop_back();
-    return false;
-}
\ No newline at end of file
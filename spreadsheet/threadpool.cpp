@@ -0,0 +1,82 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    workers_.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        workers_.emplace_back([this] {
+            Work();
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    has_tasks_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Run(const std::vector<std::function<void()>>& tasks) {
+    if (tasks.empty()) {
+        return;
+    }
+    std::unique_lock lock(mutex_);
+    tasks_ = &tasks;
+    next_ = 0;
+    unfinished_ = tasks.size();
+    error_ = nullptr;
+    has_tasks_.notify_all();
+
+    RunPending(lock);
+    finished_.wait(lock, [this] {
+        return unfinished_ == 0;
+    });
+    tasks_ = nullptr;
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void ThreadPool::Work() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        has_tasks_.wait(lock, [this] {
+            return stop_ || (tasks_ && next_ < tasks_->size());
+        });
+        if (stop_) {
+            return;
+        }
+        RunPending(lock);
+    }
+}
+
+void ThreadPool::RunPending(std::unique_lock<std::mutex>& lock) {
+    while (tasks_ && next_ < tasks_->size()) {
+        const std::function<void()>& task = (*tasks_)[next_++];
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            task();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+        if (error && !error_) {
+            error_ = error;
+        }
+        if (--unfinished_ == 0) {
+            finished_.notify_all();
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с одной операцией: выполнить набор задач и дождаться их.
+// Потоки создаются один раз и ждут следующего набора.
+class ThreadPool {
+public:
+    // threads - общее число потоков, включая вызывающий Run;
+    // 0 - по числу ядер
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const {
+        return workers_.size() + 1;
+    }
+
+    // Выполняет задачи параллельно и возвращается, когда выполнены все.
+    // Вызывающий поток тоже берёт задачи. Если задача бросила исключение,
+    // остальные всё равно выполняются, а первое исключение пробрасывается.
+    void Run(const std::vector<std::function<void()>>& tasks);
+
+private:
+    void Work();
+    // Выполняет задачи текущего набора, пока они не кончатся.
+    // Вызывается под захваченным lock.
+    void RunPending(std::unique_lock<std::mutex>& lock);
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable has_tasks_;
+    std::condition_variable finished_;
+    const std::vector<std::function<void()>>* tasks_ = nullptr;
+    size_t next_ = 0;
+    size_t unfinished_ = 0;
+    std::exception_ptr error_;
+    bool stop_ = false;
+};
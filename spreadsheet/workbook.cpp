@@ -0,0 +1,152 @@
+#include "workbook.h"
+
+#include "cell.h"
+#include "common.h"
+#include "recalc.h"
+
+#include <cctype>
+#include <unordered_set>
+
+namespace {
+    // Имя таблицы должно читаться в формуле как часть ссылки Имя!A1
+    bool IsValidSheetName(std::string_view name) {
+        if (name.empty() || std::isdigit(static_cast<unsigned char>(name.front()))) {
+            return false;
+        }
+        for (char c : name) {
+            if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+Workbook::Workbook(size_t threads)
+    : pool_(threads) {
+}
+
+Workbook::~Workbook() = default;
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (!IsValidSheetName(name)) {
+        throw InvalidSheetNameException("INVALID SHEET NAME " + name);
+    }
+    if (sheets_by_name_.count(name)) {
+        throw InvalidSheetNameException("DUPLICATE SHEET NAME " + name);
+    }
+    auto sheet = std::make_unique<Sheet>(*this, name);
+    Sheet& result = *sheet;
+    sheets_.push_back(std::move(sheet));
+    sheets_by_name_.emplace(std::move(name), &result);
+    return result;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) const {
+    auto it = sheets_by_name_.find(std::string(name));
+    return it == sheets_by_name_.end() ? nullptr : it->second;
+}
+
+void Workbook::Recalculate() {
+    std::vector<const Cell*> roots;
+    for (const auto& sheet : sheets_) {
+        for (const Position& pos : sheet->Scheduler().TakeRoots(*sheet)) {
+            sheet->AddDependencyRoots(pos, roots);
+        }
+    }
+    const std::vector<const Cell*> order = RecalcScheduler::DependencyOrder(roots);
+    if (order.empty()) {
+        return;
+    }
+
+    std::unordered_map<const Sheet*, size_t> sheet_index;
+    for (size_t i = 0; i < sheets_.size(); ++i) {
+        sheet_index[sheets_[i].get()] = i;
+    }
+    const std::unordered_set<const Cell*> planned(order.begin(), order.end());
+
+    // Ячейки каждой таблицы в общем порядке и связи между таблицами:
+    // successors[i] - таблицы, пересчитываемые ячейки которых читают
+    // пересчитываемые ячейки таблицы i
+    std::vector<std::vector<const Cell*>> cells(sheets_.size());
+    std::vector<std::unordered_set<size_t>> successors(sheets_.size());
+    std::vector<size_t> predecessors(sheets_.size(), 0);
+    for (const Cell* cell : order) {
+        const size_t from = sheet_index.at(&cell->GetSheet());
+        cells[from].push_back(cell);
+        for (const CellId dependent : cell->GetDependents()) {
+            const size_t to = sheet_index.at(&graph_.GetCell(dependent)->GetSheet());
+            if (to != from && successors[from].insert(to).second) {
+                ++predecessors[to];
+            }
+        }
+    }
+
+    // Ячейки вне плана, которые читают пересчитываемые, проверяются заранее
+    // в одном потоке: тогда параллельные задачи лишь читают их кэш, а не
+    // проверяют одни и те же ячейки одновременно
+    for (const Cell* cell : order) {
+        cell->VisitReferencedCells([&planned](const Cell& ref) {
+            if (!planned.count(&ref)) {
+                ref.GetValue();
+            }
+        });
+    }
+
+    auto recalculate = [](const std::vector<const Cell*>& cells) {
+        Cell::SingleCellEvaluationScope scope;
+        for (const Cell* cell : cells) {
+            cell->GetValue();
+        }
+    };
+
+    // Таблицы пересчитываются группами: группа - таблицы, все
+    // предшественники которых уже пересчитаны
+    std::vector<bool> done(sheets_.size(), false);
+    size_t remaining = 0;
+    for (size_t i = 0; i < sheets_.size(); ++i) {
+        if (cells[i].empty()) {
+            done[i] = true;
+        }
+        else {
+            ++remaining;
+        }
+    }
+    while (remaining > 0) {
+        std::vector<size_t> ready;
+        for (size_t i = 0; i < sheets_.size(); ++i) {
+            if (!done[i] && predecessors[i] == 0) {
+                ready.push_back(i);
+            }
+        }
+        if (ready.empty()) {
+            // Таблицы связаны циклом: оставшиеся ячейки пересчитываются
+            // одной задачей в общем порядке зависимостей
+            std::vector<const Cell*> rest;
+            for (const Cell* cell : order) {
+                if (!done[sheet_index.at(&cell->GetSheet())]) {
+                    rest.push_back(cell);
+                }
+            }
+            recalculate(rest);
+            break;
+        }
+
+        std::vector<std::function<void()>> tasks;
+        tasks.reserve(ready.size());
+        for (size_t i : ready) {
+            tasks.push_back([&recalculate, &sheet_cells = cells[i]] {
+                recalculate(sheet_cells);
+            });
+        }
+        pool_.Run(tasks);
+
+        for (size_t i : ready) {
+            done[i] = true;
+            --remaining;
+            for (size_t next : successors[i]) {
+                --predecessors[next];
+            }
+        }
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "sheet.h"
+#include "threadpool.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Книга из нескольких таблиц. Формулы таблиц книги могут ссылаться на ячейки
+// других таблиц по имени: Sheet2!A1. Зависимости между таблицами учитываются
+// так же, как внутри таблицы: изменение ячейки одной таблицы устаревает
+// зависящие от неё формулы других, а циклы через несколько таблиц
+// запрещены. У таблиц книги общий счётчик ревизий.
+class Workbook {
+public:
+    // threads - число потоков пересчёта (см. Recalculate); 0 - по числу ядер
+    explicit Workbook(size_t threads = 0);
+    ~Workbook();
+
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Добавляет пустую таблицу. Имя состоит из латинских букв, цифр и '_'
+    // и не начинается с цифры; иначе или если имя занято, бросает
+    // InvalidSheetNameException. Таблицы живут, пока живёт книга.
+    Sheet& AddSheet(std::string name);
+
+    // Таблица с именем name; nullptr, если такой нет
+    Sheet* GetSheet(std::string_view name) const;
+
+    // Таблицы в порядке добавления
+    const std::vector<std::unique_ptr<Sheet>>& GetSheets() const {
+        return sheets_;
+    }
+
+    // Пересчитывает все устаревшие формулы книги. Сначала строится общий
+    // порядок зависимостей формул, затем таблицы пересчитываются группами:
+    // таблица идёт после таблиц, чьи пересчитываемые ячейки читают её
+    // формулы, а таблицы одной группы пересчитываются параллельно, каждая
+    // в своём потоке. Таблицы, связанные циклом ссылок, пересчитываются
+    // одной задачей. Таблицы нельзя менять, пока идёт пересчёт.
+    void Recalculate();
+
+private:
+    friend class Sheet;
+
+    // Общий счётчик ревизий таблиц книги
+    uint64_t revision_ = 0;
+    // Число подписок на изменения во всех таблицах: запись в одну таблицу
+    // может изменить значения формул другой
+    size_t listeners_ = 0;
+    // Общий граф зависимостей; объявлен до таблиц, чтобы пережить их ячейки
+    CellGraph graph_;
+    std::vector<std::unique_ptr<Sheet>> sheets_;
+    std::unordered_map<std::string, Sheet*> sheets_by_name_;
+    ThreadPool pool_;
+};
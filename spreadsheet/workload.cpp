@@ -0,0 +1,355 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+namespace {
+    // Копии пределов таблицы: std::min и std::clamp принимают ссылки
+    constexpr int MAX_ROWS = Position::MAX_ROWS;
+    constexpr int MAX_COLS = Position::MAX_COLS;
+
+    // Позиция i-й ячейки при раскладке по столбцам, начиная со столбца
+    // first_col: после MAX_ROWS строк раскладка продолжается правее
+    Position ColumnMajor(int i, int first_col = 0) {
+        return { i % MAX_ROWS, first_col + i / MAX_ROWS };
+    }
+
+    std::string Ref(Position pos) {
+        return pos.ToString();
+    }
+
+    void GenerateChain(SheetInterface& sheet, const WorkloadOptions& options) {
+        sheet.SetCell(ColumnMajor(0), "1");
+        for (int i = 1; i < options.size; ++i) {
+            sheet.SetCell(ColumnMajor(i), "=" + Ref(ColumnMajor(i - 1)) + "+1");
+        }
+    }
+
+    void GenerateFanOut(SheetInterface& sheet, const WorkloadOptions& options) {
+        sheet.SetCell({ 0, 0 }, "1");
+        for (int i = 0; i + 1 < options.size; ++i) {
+            sheet.SetCell(ColumnMajor(i, 1), "=A1*" + std::to_string(i % 10 + 1));
+        }
+    }
+
+    void GenerateFanIn(SheetInterface& sheet, const WorkloadOptions& options) {
+        const int width = std::max(options.width, 2);
+        int count = std::min(std::max(options.size, 1), MAX_ROWS);
+        for (int i = 0; i < count; ++i) {
+            sheet.SetCell({ i, 0 }, std::to_string(i % 100));
+        }
+        for (int col = 1; count > 1 && col < MAX_COLS; ++col) {
+            const int next = (count + width - 1) / width;
+            for (int i = 0; i < next; ++i) {
+                std::string formula = "=";
+                for (int j = i * width; j < std::min(count, (i + 1) * width); ++j) {
+                    if (j != i * width) {
+                        formula += '+';
+                    }
+                    formula += Ref({ j, col - 1 });
+                }
+                sheet.SetCell({ i, col }, formula);
+            }
+            count = next;
+        }
+    }
+
+    void GenerateGrid(SheetInterface& sheet, const WorkloadOptions& options) {
+        const int width = std::clamp(options.width, 3, MAX_COLS);
+        const int rows = std::clamp(options.size / width, 1, MAX_ROWS);
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row));
+            sheet.SetCell({ row, 1 }, std::to_string(row % 7 + 1));
+            for (int col = 2; col < width; ++col) {
+                sheet.SetCell({ row, col },
+                    "=" + Ref({ row, col - 1 }) + "*2+" + Ref({ row, col - 2 }) + "/3");
+            }
+        }
+    }
+
+    void GenerateRandomDag(SheetInterface& sheet, const WorkloadOptions& options, std::mt19937& random) {
+        const int depth = std::clamp(options.depth, 1, MAX_COLS);
+        const int rows = std::clamp(options.size / depth, 1, MAX_ROWS);
+        std::uniform_int_distribution<int> row_dist(0, rows - 1);
+        std::uniform_int_distribution<int> refs_dist(1, 3);
+        const char ops[] = { '+', '-', '*' };
+        std::uniform_int_distribution<int> op_dist(0, 2);
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({ row, 0 }, std::to_string(row_dist(random) % 100));
+        }
+        for (int col = 1; col < depth; ++col) {
+            // Ссылки в основном на предыдущий слой, изредка на более ранние
+            std::uniform_int_distribution<int> col_dist(std::max(0, col - 3), col - 1);
+            for (int row = 0; row < rows; ++row) {
+                std::string formula = "=" + Ref({ row_dist(random), col - 1 });
+                for (int refs = refs_dist(random); refs > 1; --refs) {
+                    formula += ops[op_dist(random)];
+                    formula += Ref({ row_dist(random), col_dist(random) });
+                }
+                sheet.SetCell({ row, col }, formula);
+            }
+        }
+    }
+
+    void GenerateLabels(SheetInterface& sheet, const WorkloadOptions& options, std::mt19937& random) {
+        const int width = std::clamp(options.width, 1, MAX_COLS);
+        const int rows = std::clamp(options.size / width, 1, MAX_ROWS);
+        std::uniform_int_distribution<int> kind(0, 19);
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < width; ++col) {
+                const int k = kind(random);
+                if (k < 15) {
+                    sheet.SetCell({ row, col }, "Label " + std::to_string(row) + "-" + std::to_string(col));
+                }
+                else if (k < 17) {
+                    // Экранированный текст, похожий на число
+                    sheet.SetCell({ row, col }, "'" + std::to_string(row * width + col));
+                }
+                else if (k < 19 || col == 0) {
+                    sheet.SetCell({ row, col }, std::to_string(row + col));
+                }
+                else {
+                    sheet.SetCell({ row, col }, "=" + Ref({ row, col - 1 }) + "+1");
+                }
+            }
+        }
+    }
+
+    void GenerateErrors(SheetInterface& sheet, const WorkloadOptions& options, std::mt19937& random) {
+        const int depth = std::clamp(options.depth, 1, MAX_COLS - 1);
+        const int rows = std::clamp(options.size / (depth + 1), 1, MAX_ROWS);
+        std::uniform_int_distribution<int> kind(0, 9);
+        for (int row = 0; row < rows; ++row) {
+            const int k = kind(random);
+            if (k == 0) {
+                sheet.SetCell({ row, 0 }, "=1/0");
+            }
+            else if (k == 1) {
+                sheet.SetCell({ row, 0 }, "not a number");
+            }
+            else {
+                sheet.SetCell({ row, 0 }, std::to_string(row));
+            }
+        }
+        for (int col = 1; col <= depth; ++col) {
+            for (int row = 0; row < rows; ++row) {
+                // Ячейка читает соседа слева и ячейку выше: ошибки расходятся
+                // и вправо, и вниз
+                std::string formula = "=" + Ref({ row, col - 1 });
+                if (row > 0) {
+                    formula += "+" + Ref({ row - 1, col });
+                }
+                sheet.SetCell({ row, col }, formula);
+            }
+        }
+    }
+}
+
+std::string_view ToString(SheetShape shape) {
+    switch (shape) {
+    case SheetShape::Chain:
+        return "chain";
+    case SheetShape::FanOut:
+        return "fan_out";
+    case SheetShape::FanIn:
+        return "fan_in";
+    case SheetShape::Grid:
+        return "grid";
+    case SheetShape::RandomDag:
+        return "dag";
+    case SheetShape::Labels:
+        return "labels";
+    default:
+        return "errors";
+    }
+}
+
+std::optional<SheetShape> ParseSheetShape(std::string_view name) {
+    for (SheetShape shape : { SheetShape::Chain, SheetShape::FanOut, SheetShape::FanIn, SheetShape::Grid,
+             SheetShape::RandomDag, SheetShape::Labels, SheetShape::Errors }) {
+        if (ToString(shape) == name) {
+            return shape;
+        }
+    }
+    return std::nullopt;
+}
+
+void GenerateSheet(SheetInterface& sheet, const WorkloadOptions& options) {
+    std::mt19937 random(options.seed);
+    switch (options.shape) {
+    case SheetShape::Chain:
+        GenerateChain(sheet, options);
+        break;
+    case SheetShape::FanOut:
+        GenerateFanOut(sheet, options);
+        break;
+    case SheetShape::FanIn:
+        GenerateFanIn(sheet, options);
+        break;
+    case SheetShape::Grid:
+        GenerateGrid(sheet, options);
+        break;
+    case SheetShape::RandomDag:
+        GenerateRandomDag(sheet, options, random);
+        break;
+    case SheetShape::Labels:
+        GenerateLabels(sheet, options, random);
+        break;
+    case SheetShape::Errors:
+        GenerateErrors(sheet, options, random);
+        break;
+    }
+}
+
+std::vector<TraceOperation> GenerateTrace(const TraceOptions& options) {
+    std::mt19937 random(options.seed);
+    std::uniform_int_distribution<int> row_dist(0, std::max(options.area.rows, 1) - 1);
+    std::uniform_int_distribution<int> col_dist(0, std::max(options.area.cols, 1) - 1);
+    std::uniform_real_distribution<double> fraction(0.0, 1.0);
+    std::uniform_int_distribution<int> number(0, 999);
+
+    std::vector<TraceOperation> trace;
+    trace.reserve(options.operations);
+    for (size_t i = 0; i < options.operations; ++i) {
+        TraceOperation op;
+        op.pos = { row_dist(random), col_dist(random) };
+        if (fraction(random) < options.read_fraction) {
+            op.type = TraceOperation::Type::Read;
+        }
+        else if (fraction(random) < options.clear_fraction) {
+            op.type = TraceOperation::Type::Clear;
+        }
+        else if (fraction(random) < options.formula_fraction && (op.pos.row > 0 || op.pos.col > 0)) {
+            // Ссылка левее или выше в том же столбце
+            Position ref = op.pos;
+            if (ref.col > 0 && (ref.row == 0 || fraction(random) < 0.5)) {
+                ref.col = std::uniform_int_distribution<int>(0, ref.col - 1)(random);
+                ref.row = row_dist(random);
+            }
+            else {
+                ref.row = std::uniform_int_distribution<int>(0, ref.row - 1)(random);
+            }
+            op.type = TraceOperation::Type::Set;
+            op.text = "=" + Ref(ref) + "+" + std::to_string(number(random));
+        }
+        else {
+            op.type = TraceOperation::Type::Set;
+            op.text = std::to_string(number(random));
+        }
+        trace.push_back(std::move(op));
+    }
+    return trace;
+}
+
+void WriteTrace(std::ostream& out, const std::vector<TraceOperation>& trace) {
+    for (const TraceOperation& op : trace) {
+        switch (op.type) {
+        case TraceOperation::Type::Read:
+            out << "R " << op.pos.ToString() << '\n';
+            break;
+        case TraceOperation::Type::Clear:
+            out << "C " << op.pos.ToString() << '\n';
+            break;
+        case TraceOperation::Type::Set:
+            out << "S " << op.pos.ToString() << ' ' << op.text << '\n';
+            break;
+        }
+    }
+}
+
+std::vector<TraceOperation> ReadTrace(std::istream& in) {
+    std::vector<TraceOperation> trace;
+    std::string line;
+    size_t line_number = 0;
+    while (std::getline(in, line)) {
+        ++line_number;
+        if (line.empty()) {
+            continue;
+        }
+        auto error = [line_number](const std::string& message) {
+            return std::invalid_argument("trace line " + std::to_string(line_number) + ": " + message);
+        };
+        if (line.size() < 3 || line[1] != ' ') {
+            throw error("malformed operation");
+        }
+
+        TraceOperation op;
+        const std::string_view rest = std::string_view(line).substr(2);
+        const size_t space = rest.find(' ');
+        op.pos = Position::FromString(rest.substr(0, space));
+        if (!op.pos.IsValid()) {
+            throw error("invalid position");
+        }
+        switch (line[0]) {
+        case 'R':
+            op.type = TraceOperation::Type::Read;
+            break;
+        case 'C':
+            op.type = TraceOperation::Type::Clear;
+            break;
+        case 'S':
+            if (space == std::string_view::npos) {
+                throw error("missing text");
+            }
+            op.type = TraceOperation::Type::Set;
+            op.text = std::string(rest.substr(space + 1));
+            break;
+        default:
+            throw error("unknown operation");
+        }
+        trace.push_back(std::move(op));
+    }
+    return trace;
+}
+
+std::ostream& operator<<(std::ostream& out, const TraceTiming& timing) {
+    auto print = [&out](std::string_view name, const LatencyHistogram& histogram) {
+        out << name << ".count: " << histogram.Count() << '\n'
+            << name << ".p50_ns: " << histogram.Percentile(0.5) << '\n'
+            << name << ".p99_ns: " << histogram.Percentile(0.99) << '\n'
+            << name << ".max_ns: " << histogram.Percentile(1.0) << '\n';
+    };
+    out << "reads: " << timing.reads << '\n'
+        << "writes: " << timing.writes << '\n'
+        << "rejected: " << timing.rejected << '\n'
+        << "total_ns: " << timing.total.count() << '\n';
+    print("read_latency", timing.read_latency);
+    print("write_latency", timing.write_latency);
+    return out;
+}
+
+TraceTiming ReplayTrace(SheetInterface& sheet, const std::vector<TraceOperation>& trace) {
+    using Clock = std::chrono::steady_clock;
+    TraceTiming timing;
+    const auto start = Clock::now();
+    for (const TraceOperation& op : trace) {
+        const auto op_start = Clock::now();
+        if (op.type == TraceOperation::Type::Read) {
+            if (const CellInterface* cell = sheet.GetCell(op.pos)) {
+                cell->GetValue();
+            }
+            ++timing.reads;
+        }
+        else {
+            try {
+                if (op.type == TraceOperation::Type::Set) {
+                    sheet.SetCell(op.pos, op.text);
+                }
+                else {
+                    sheet.ClearCell(op.pos);
+                }
+            }
+            catch (const std::exception&) {
+                ++timing.rejected;
+            }
+            ++timing.writes;
+        }
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - op_start);
+        (op.type == TraceOperation::Type::Read ? timing.read_latency : timing.write_latency)
+            .Record(static_cast<uint64_t>(elapsed.count()));
+    }
+    timing.total = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    return timing;
+}
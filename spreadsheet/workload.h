@@ -0,0 +1,112 @@
+#pragma once
+
+#include "common.h"
+#include "stats.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Синтетические нагрузки: таблицы типичной формы и смешанные трассы чтений
+// и записей. Всё определяется параметрами и seed, так что одна и та же
+// нагрузка воспроизводится без данных пользователей.
+
+enum class SheetShape {
+    // A1 = 1, каждая следующая ячейка столбца A = предыдущая+1
+    Chain,
+    // A1 - источник, B1..B{size} = A1*k
+    FanOut,
+    // size чисел в столбце A, сворачиваемых суммами по width ячеек в
+    // столбцах правее, пока не останется одна ячейка
+    FanIn,
+    // width столбцов: два столбца чисел, правее - протянутые вниз формулы
+    // от соседей слева
+    Grid,
+    // Случайный ациклический граф из depth слоёв-столбцов: формулы слоя
+    // ссылаются на случайные ячейки предыдущих слоёв
+    RandomDag,
+    // В основном текстовые метки в width столбцах, немного чисел и формул
+    Labels,
+    // Столбец чисел с источниками ошибок (#ARITHM!, #VALUE!) и depth
+    // столбцов формул, по которым ошибки расходятся
+    Errors,
+};
+
+// Имя формы для командной строки: chain, fan_out, fan_in, grid, dag,
+// labels, errors
+std::string_view ToString(SheetShape shape);
+std::optional<SheetShape> ParseSheetShape(std::string_view name);
+
+struct WorkloadOptions {
+    SheetShape shape = SheetShape::Chain;
+    // Примерное число ячеек
+    int size = 1000;
+    // Ширина: число столбцов сетки и меток, арность сумм FanIn
+    int width = 8;
+    // Число слоёв RandomDag и столбцов распространения ошибок
+    int depth = 8;
+    uint32_t seed = 1;
+};
+
+// Заполняет таблицу ячейками заданной формы. Все ссылки формул ведут в
+// ячейки левее или выше в том же столбце, так что циклов нет.
+void GenerateSheet(SheetInterface& sheet, const WorkloadOptions& options);
+
+// Операция трассы
+struct TraceOperation {
+    enum class Type {
+        Read,
+        Set,
+        Clear,
+    };
+
+    Type type = Type::Read;
+    Position pos;
+    // Текст записи Set
+    std::string text;
+};
+
+struct TraceOptions {
+    size_t operations = 10000;
+    // Ячейки выбираются из прямоугольника с левым верхним углом A1
+    Size area{ 100, 10 };
+    // Доля чтений; остальное - записи
+    double read_fraction = 0.8;
+    // Доля формул среди записей (остальное - числа и очистки)
+    double formula_fraction = 0.3;
+    // Доля очисток среди записей
+    double clear_fraction = 0.05;
+    uint32_t seed = 1;
+};
+
+// Смешанная трасса чтений и записей. Формулы трассы, как и в GenerateSheet,
+// ссылаются лишь на ячейки левее или выше.
+std::vector<TraceOperation> GenerateTrace(const TraceOptions& options);
+
+// Текстовый формат трассы - по операции в строке: "R A1", "C A1",
+// "S A1 текст" (текст - до конца строки)
+void WriteTrace(std::ostream& out, const std::vector<TraceOperation>& trace);
+// Бросает std::invalid_argument при ошибке в строке
+std::vector<TraceOperation> ReadTrace(std::istream& in);
+
+// Результат воспроизведения трассы
+struct TraceTiming {
+    size_t reads = 0;
+    size_t writes = 0;
+    // Записи, отвергнутые таблицей (например, из-за цикла)
+    size_t rejected = 0;
+    std::chrono::nanoseconds total{ 0 };
+    LatencyHistogram read_latency;
+    LatencyHistogram write_latency;
+};
+
+std::ostream& operator<<(std::ostream& out, const TraceTiming& timing);
+
+// Выполняет операции трассы по порядку, замеряя каждую. Чтение
+// запрашивает значение ячейки. Записи, на которые таблица бросила
+// исключение, считаются отвергнутыми, и воспроизведение продолжается.
+TraceTiming ReplayTrace(SheetInterface& sheet, const std::vector<TraceOperation>& trace);